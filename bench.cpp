@@ -0,0 +1,345 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <new>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <functional>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "raft.h"
+#include "linebuf.h"
+
+// Microbenchmarks of the per-message paths: tokenizing, applying entries to the state
+// machine, decoding AppendEntries and framing pipelined input. Each one reports the
+// best ns/op of --reps timed batches, plus heap allocations and bytes allocated per
+// op, counted by the operator new below. --save writes the results as a baseline
+// and --baseline compares against one, failing if anything got slower by more than
+// --threshold percent or allocates more. bench_baseline.txt is the checked-in one.
+
+#define BENCH_MIN_MS        200     // per benchmark, split across the reps
+#define BENCH_REPS          5
+#define BENCH_ALLOC_OPS     1000    // ops allocations are counted over
+#define BENCH_THRESHOLD_PCT 20      // ns/op beyond this is a regression; allocations get 5%
+#define BENCH_SENSORS       100     // node ids in the generated traffic
+#define BENCH_BURST         64      // pipelined lines or frames per simulated recv
+
+static uint64_t allocCount = 0;
+static uint64_t allocBytes = 0;
+
+void *operator new(size_t n){
+    allocCount++;
+    allocBytes += n;
+    void *p = malloc(n ? n : 1);
+    if(!p) throw std::bad_alloc();
+    return p;
+}
+// gcc cannot see that free() pairs with the malloc() in operator new above
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+#pragma GCC diagnostic pop
+
+// results land here so the compiler cannot drop the work
+static volatile size_t sink;
+
+struct Bench {
+    std::string name;
+    std::function<void(size_t)> run;   // performs n ops
+};
+
+struct BenchResult {
+    double ns;
+    double allocs;
+    double bytes;
+};
+
+static double elapsedNs(std::chrono::steady_clock::time_point t0){
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count();
+}
+
+// Counts allocations over the first BENCH_ALLOC_OPS ops, while the benchmark's state
+// is still as it was set up, so those figures repeat exactly on any machine. Then sizes
+// a batch to take minMs / reps and keeps the fastest of reps batches, the least
+// disturbed by everything else running on the machine.
+static BenchResult measure(const Bench &b, double minMs, int reps){
+    uint64_t c0 = allocCount, b0 = allocBytes;
+    b.run(BENCH_ALLOC_OPS);
+    BenchResult res{0, (double)(allocCount - c0) / BENCH_ALLOC_OPS, (double)(allocBytes - b0) / BENCH_ALLOC_OPS};
+
+    double target = minMs * 1e6 / reps;
+    size_t n = 1;
+    while(true){
+        auto t0 = std::chrono::steady_clock::now();
+        b.run(n);
+        double ns = elapsedNs(t0);
+        if(ns >= target) break;
+        n = ns < target / 100 ? n * 100 : (size_t)(n * target / ns * 1.1) + 1;
+    }
+
+    for(int r = 0; r < reps; r++){
+        auto t0 = std::chrono::steady_clock::now();
+        b.run(n);
+        double ns = elapsedNs(t0) / n;
+        if(r == 0 || ns < res.ns) res.ns = ns;
+    }
+    return res;
+}
+
+// ---- payloads, shaped like what sensors and loadgen send ----
+
+static std::mt19937 rng(12345);
+
+static std::string dataCommand(){
+    return "DATA node=" + std::to_string(1 + rng() % BENCH_SENSORS) +
+           " temp=" + std::to_string(20 + rng() % 16) +
+           " humidity=" + std::to_string(40 + rng() % 51);
+}
+
+static std::string heartbeatCommand(){
+    return "HEARTBEAT node=" + std::to_string(1 + rng() % BENCH_SENSORS);
+}
+
+static std::string batchLine(int k){
+    std::string line = "DATA_BATCH node=" + std::to_string(1 + rng() % BENCH_SENSORS);
+    for(int i = 0; i < k; i++)
+        line += " " + std::to_string(20 + rng() % 16) + "," + std::to_string(40 + rng() % 51);
+    return line + " seq=" + std::to_string(rng() % 100000);
+}
+
+// a leader's AppendEntries with n entries, mostly readings with a heartbeat in ten
+static AppendEntriesArgs appendArgs(int n){
+    AppendEntriesArgs a;
+    a.term = 7;
+    a.leader = 1;
+    a.prevIdx = 1250000;
+    a.prevTerm = 7;
+    a.leaderCommit = 1249990;
+    int64_t ts = 1700000000000LL;
+    for(int i = 0; i < n; i++)
+        a.entries.push_back(commandEntry(7, i % 10 == 9 ? heartbeatCommand() : dataCommand(), ts + i / 8));
+    return a;
+}
+
+static std::vector<Bench> benches(){
+    std::vector<Bench> all;
+
+    // tokenizing: a pipelined sensor line, a batch line and a text AppendEntries
+    for(auto &p : std::vector<std::pair<std::string, std::string>>{
+            {"split_ws/data", dataCommand() + " seq=48213"},
+            {"split_ws/data_batch/16", batchLine(16)},
+            {"split_ws/append_text/256", encodeText(appendArgs(256))}}){
+        std::string line = p.second;
+        all.push_back({p.first, [line](size_t n){
+            for(size_t i = 0; i < n; i++) sink = split_ws(line).size();
+        }});
+    }
+
+    // the leader's one parse of each sensor command, into the entry it appends
+    for(auto &p : std::vector<std::pair<std::string, std::string>>{
+            {"parse_command/data", dataCommand()},
+            {"parse_command/heartbeat", heartbeatCommand()}}){
+        std::string cmd = p.second;
+        all.push_back({p.first, [cmd](size_t n){
+            for(size_t i = 0; i < n; i++){
+                Log e;
+                sink = parseCommand(cmd, e);
+            }
+        }});
+    }
+
+    // applying committed entries, one at a time and in apply-thread batches; the state
+    // machine keeps every reading, so it grows as a follower's would
+    struct ApplyCase { const char *name; int nodes; int batch; bool heartbeats; };
+    for(auto c : std::vector<ApplyCase>{
+            {"apply/data/nodes=100", 100, 1, false},
+            {"apply/data/nodes=10000", 10000, 1, false},
+            {"apply/heartbeat/nodes=100", 100, 1, true},
+            {"apply_batch/data/256", 100, 256, false}}){
+        std::vector<Log> pool;
+        for(int i = 0; i < 4096; i++){
+            int node = 1 + rng() % c.nodes;
+            std::string cmd = c.heartbeats ? "HEARTBEAT node=" + std::to_string(node)
+                                           : "DATA node=" + std::to_string(node) + " temp=" + std::to_string(20 + rng() % 16) +
+                                             " humidity=" + std::to_string(40 + rng() % 51);
+            pool.push_back(commandEntry(3, cmd, 1700000000000LL + i));
+        }
+        std::vector<std::vector<Log>> batches;
+        for(size_t i = 0; i + c.batch <= pool.size(); i += c.batch)
+            batches.emplace_back(pool.begin() + i, pool.begin() + i + c.batch);
+        // every node has reported once before anything is measured
+        auto sm = std::make_shared<StateMachine>();
+        sm->applyBatch(1, pool);
+        auto next = std::make_shared<int>(pool.size() + 1);
+        int batch = c.batch;
+        all.push_back({c.name, [sm, next, pool, batches, batch](size_t n){
+            if(batch == 1){
+                for(size_t i = 0; i < n; i++, (*next)++) sm->apply(*next, pool[*next % pool.size()]);
+                return;
+            }
+            // one op is one batch, as the apply thread takes them
+            for(size_t i = 0; i < n; i++){
+                sm->applyBatch(*next, batches[(*next / batch) % batches.size()]);
+                *next += batch;
+            }
+        }});
+    }
+
+    // the follower's side of replication, in both peer encodings
+    for(int count : {1, 16, 256}){
+        AppendEntriesArgs a = appendArgs(count);
+        std::string text = encodeText(a), frame = encodeFrame(a);
+        all.push_back({"append_decode/text/" + std::to_string(count), [text](size_t n){
+            for(size_t i = 0; i < n; i++){
+                AppendEntriesArgs d;
+                decodeText(text, d);
+                sink = d.entries.size();
+            }
+        }});
+        all.push_back({"append_decode/binary/" + std::to_string(count), [frame](size_t n){
+            for(size_t i = 0; i < n; i++){
+                AppendEntriesArgs d;
+                decodeFrame(frame, d);
+                sink = d.entries.size();
+            }
+        }});
+    }
+
+    // a connection's receive path: a burst of pipelined lines arriving in one recv,
+    // and the same burst split at arbitrary points across several
+    std::string burst;
+    for(int i = 0; i < BENCH_BURST; i++) burst += dataCommand() + " seq=" + std::to_string(i) + "\n";
+    for(size_t piece : {burst.size(), (size_t)1500}){
+        std::string name = piece == burst.size() ? "frame/text/burst=64" : "frame/text/burst=64/mtu=1500";
+        auto buf = std::make_shared<LineBuffer>();
+        all.push_back({name, [burst, piece, buf](size_t n){
+            LineBuffer &in = *buf;
+            for(size_t i = 0; i < n; i++){
+                size_t lines = 0;
+                for(size_t off = 0; off < burst.size(); off += piece){
+                    size_t len = std::min(piece, burst.size() - off);
+                    memcpy(in.space(len), burst.data() + off, len);
+                    in.commit(len);
+                    std::string_view line;
+                    while(in.nextLine(line)) lines += line.size();
+                }
+                sink = lines;
+            }
+        }});
+    }
+
+    // binary peer framing: a burst of heartbeat frames, as a follower's connection sees them
+    std::string frames;
+    for(int i = 0; i < BENCH_BURST; i++) frames += encodeFrame(appendArgs(0));
+    auto buf = std::make_shared<LineBuffer>();
+    all.push_back({"frame/binary/burst=64", [frames, buf](size_t n){
+        LineBuffer &in = *buf;
+        for(size_t i = 0; i < n; i++){
+            memcpy(in.space(frames.size()), frames.data(), frames.size());
+            in.commit(frames.size());
+            size_t got = 0, frameLen = 0;
+            while(wireFrameReady(in.data().data(), in.size(), frameLen) > 0){
+                got += wireFrameType(in.data().data());
+                in.consume(frameLen);
+            }
+            sink = got;
+        }
+    }});
+
+    return all;
+}
+
+static std::map<std::string, BenchResult> loadBaseline(const std::string &path){
+    std::map<std::string, BenchResult> out;
+    std::ifstream in(path);
+    std::string line;
+    while(std::getline(in, line)){
+        if(line.empty() || line[0] == '#') continue;
+        std::istringstream ss(line);
+        std::string name;
+        BenchResult r;
+        if(ss >> name >> r.ns >> r.allocs >> r.bytes) out[name] = r;
+    }
+    return out;
+}
+
+int main(int argc, char *argv[]) {
+    std::string filter, savePath, basePath;
+    double minMs = BENCH_MIN_MS;
+    int reps = BENCH_REPS;
+    double threshold = BENCH_THRESHOLD_PCT;
+
+    for(int i = 1; i < argc; i++){
+        std::string arg = argv[i];
+        if(arg.rfind("--filter=", 0) == 0) filter = arg.substr(9);
+        else if(arg.rfind("--min-ms=", 0) == 0) minMs = std::max(1.0, atof(arg.c_str() + 9));
+        else if(arg.rfind("--reps=", 0) == 0) reps = std::max(1, atoi(arg.c_str() + 7));
+        else if(arg.rfind("--save=", 0) == 0) savePath = arg.substr(7);
+        else if(arg.rfind("--baseline=", 0) == 0) basePath = arg.substr(11);
+        else if(arg.rfind("--threshold=", 0) == 0) threshold = std::max(0.0, atof(arg.c_str() + 12));
+        else {
+            std::cout << "Usage: " << argv[0] << " [options]\n";
+            std::cout << "  --filter=S        only benchmarks whose name contains S\n";
+            std::cout << "  --min-ms=T        time spent per benchmark (default " << BENCH_MIN_MS << ")\n";
+            std::cout << "  --reps=N          timed batches; ns/op is the fastest (default " << BENCH_REPS << ")\n";
+            std::cout << "  --save=FILE       write the results as a baseline\n";
+            std::cout << "  --baseline=FILE   compare against a saved baseline; exits 1 on a regression\n";
+            std::cout << "  --threshold=P     ns/op regression threshold in percent (default " << BENCH_THRESHOLD_PCT << ")\n";
+            return 1;
+        }
+    }
+
+    std::map<std::string, BenchResult> base;
+    if(!basePath.empty()){
+        base = loadBaseline(basePath);
+        if(base.empty()){
+            std::cout << "ERROR: no baseline in " << basePath << "\n";
+            return 1;
+        }
+    }
+
+    std::ostringstream saved;
+    saved << "# name ns/op allocs/op bytes/op\n";
+    int regressions = 0;
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%-32s %10s %10s %10s", "benchmark", "ns/op", "allocs/op", "bytes/op");
+    std::cout << buf << (base.empty() ? "" : "   vs baseline") << "\n";
+
+    for(auto &b : benches()){
+        if(!filter.empty() && b.name.find(filter) == std::string::npos) continue;
+        BenchResult r = measure(b, minMs, reps);
+        snprintf(buf, sizeof(buf), "%-32s %10.1f %10.2f %10.1f", b.name.c_str(), r.ns, r.allocs, r.bytes);
+        std::cout << buf;
+        snprintf(buf, sizeof(buf), "%s %.2f %.3f %.1f\n", b.name.c_str(), r.ns, r.allocs, r.bytes);
+        saved << buf;
+
+        auto it = base.find(b.name);
+        if(it != base.end()){
+            const BenchResult &o = it->second;
+            bool slower = r.ns > o.ns * (1 + threshold / 100);
+            bool allocs = r.allocs > o.allocs * 1.05 + 0.01 || r.bytes > o.bytes * 1.05 + 1;
+            snprintf(buf, sizeof(buf), "   %+6.1f%%%s", o.ns > 0 ? (r.ns / o.ns - 1) * 100 : 0.0,
+                     slower || allocs ? (allocs ? "  REGRESSION (allocations)" : "  REGRESSION") : "");
+            std::cout << buf;
+            if(slower || allocs) regressions++;
+        }
+        std::cout << std::endl;
+    }
+
+    if(!savePath.empty()){
+        std::ofstream out(savePath);
+        out << saved.str();
+        if(!out){
+            std::cout << "ERROR: cannot write " << savePath << "\n";
+            return 1;
+        }
+    }
+    if(regressions) std::cout << regressions << " regression(s) against " << basePath << "\n";
+    return regressions ? 1 : 0;
+}
@@ -0,0 +1,168 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <chrono>
+#include <algorithm>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+// Connection-scaling benchmark for the server's I/O model. Opens many connections
+// from one epoll loop, keeps `pipeline` requests in flight on each, and reports how
+// many connections stayed up and how many replies per second came back. Run it
+// against `./server ... --io=threads` and `--io=epoll` to compare the two models.
+
+struct BenchConn {
+    int fd;
+    bool up;
+    std::string in;
+    std::deque<std::chrono::steady_clock::time_point> sent;
+};
+
+int main(int argc, char *argv[]) {
+    if(argc < 5) {
+        std::cout << "Usage: " << argv[0] << " <server_ip> <port> <connections> <seconds> [pipeline] [message]\n";
+        std::cout << "Example: " << argv[0] << " 127.0.0.1 10035 2000 10 1 PING\n";
+        return 1;
+    }
+
+    std::string ip = argv[1];
+    int port = atoi(argv[2]);
+    int nconns = atoi(argv[3]);
+    int runSeconds = atoi(argv[4]);
+    int pipeline = argc >= 6 ? std::max(1, atoi(argv[5])) : 1;
+    std::string msg = (argc >= 7 ? std::string(argv[6]) : std::string("PING")) + "\n";
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if(inet_pton(AF_INET, ip.c_str(), &addr.sin_addr) <= 0){
+        std::cout << "ERROR: Invalid address\n";
+        return 1;
+    }
+
+    int epfd = epoll_create1(0);
+    std::vector<BenchConn> conns(nconns);
+    int failed = 0;
+
+    for(int i = 0; i < nconns; i++){
+        BenchConn &c = conns[i];
+        c.up = false;
+        c.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        int one = 1;
+        setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if(c.fd < 0 || (connect(c.fd, (sockaddr*)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS)){
+            if(c.fd >= 0) close(c.fd);
+            c.fd = -1;
+            failed++;
+            continue;
+        }
+        epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLOUT;
+        ev.data.u32 = i;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, c.fd, &ev);
+    }
+
+    using namespace std::chrono;
+    auto start = steady_clock::now();
+    auto end = start + seconds(runSeconds);
+    long long replies = 0;
+    long long dropped = 0;
+    std::vector<long long> latUs;
+    latUs.reserve(1 << 20);
+
+    auto fire = [&](BenchConn &c){
+        std::string out;
+        while((int)c.sent.size() < pipeline){
+            out += msg;
+            c.sent.push_back(steady_clock::now());
+        }
+        if(!out.empty() && send(c.fd, out.data(), out.size(), MSG_NOSIGNAL) < (ssize_t)out.size()){
+            dropped++;
+            close(c.fd);
+            c.fd = -1;
+            c.up = false;
+        }
+    };
+
+    std::vector<epoll_event> events(1024);
+    while(steady_clock::now() < end){
+        int n = epoll_wait(epfd, events.data(), events.size(), 100);
+        for(int k = 0; k < n; k++){
+            BenchConn &c = conns[events[k].data.u32];
+            if(c.fd < 0) continue;
+
+            if(events[k].events & (EPOLLERR | EPOLLHUP)){
+                if(c.up) dropped++; else failed++;
+                epoll_ctl(epfd, EPOLL_CTL_DEL, c.fd, nullptr);
+                close(c.fd);
+                c.fd = -1;
+                c.up = false;
+                continue;
+            }
+
+            if(!c.up && (events[k].events & EPOLLOUT)){
+                c.up = true;
+                epoll_event ev;
+                memset(&ev, 0, sizeof(ev));
+                ev.events = EPOLLIN;
+                ev.data.u32 = events[k].data.u32;
+                epoll_ctl(epfd, EPOLL_CTL_MOD, c.fd, &ev);
+                fire(c);
+                continue;
+            }
+
+            if(events[k].events & EPOLLIN){
+                char buf[16384];
+                ssize_t r = recv(c.fd, buf, sizeof(buf), 0);
+                if(r <= 0){
+                    dropped++;
+                    epoll_ctl(epfd, EPOLL_CTL_DEL, c.fd, nullptr);
+                    close(c.fd);
+                    c.fd = -1;
+                    c.up = false;
+                    continue;
+                }
+                c.in.append(buf, r);
+                size_t pos;
+                auto now = steady_clock::now();
+                while((pos = c.in.find('\n')) != std::string::npos){
+                    c.in.erase(0, pos + 1);
+                    if(c.sent.empty()) continue;
+                    latUs.push_back(duration_cast<microseconds>(now - c.sent.front()).count());
+                    c.sent.pop_front();
+                    replies++;
+                }
+                fire(c);
+            }
+        }
+    }
+
+    double elapsed = duration_cast<duration<double>>(steady_clock::now() - start).count();
+    int alive = 0;
+    for(auto &c : conns) if(c.up) alive++;
+    std::sort(latUs.begin(), latUs.end());
+    auto pct = [&](double p) -> long long {
+        if(latUs.empty()) return 0;
+        return latUs[std::min(latUs.size() - 1, (size_t)(p * latUs.size()))];
+    };
+
+    std::cout << "connections requested: " << nconns << "\n";
+    std::cout << "connections sustained: " << alive << "\n";
+    std::cout << "connections failed:    " << failed << "\n";
+    std::cout << "connections dropped:   " << dropped << "\n";
+    std::cout << "replies:               " << replies << "\n";
+    std::cout << "messages/sec:          " << (long long)(replies / elapsed) << "\n";
+    std::cout << "latency p50/p99 (us):  " << pct(0.50) << " / " << pct(0.99) << "\n";
+
+    for(auto &c : conns) if(c.fd >= 0) close(c.fd);
+    close(epfd);
+    return 0;
+}
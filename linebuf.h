@@ -0,0 +1,74 @@
+#ifndef __LINEBUF_H__
+#define __LINEBUF_H__
+
+#include <string.h>
+#include <string>
+#include <algorithm>
+#include <string_view>
+#include <vector>
+
+#define LINEBUF_INITIAL 4096
+
+// Per-connection receive buffer. recv() writes straight into the free tail and
+// complete lines are handed out as views into the buffer, so a pipelined burst of
+// messages is framed without copying or reallocating per line. Consumed bytes are
+// reclaimed by sliding the unread remainder down only when the tail runs out of room.
+// Views stay valid until the next call to space().
+class LineBuffer{
+private:
+    std::vector<char> buf;
+    size_t head;     // first unread byte
+    size_t tail;     // one past the last received byte
+    size_t scan;     // bytes before this offset are known to hold no '\n'
+
+public:
+    LineBuffer() : buf(LINEBUF_INITIAL), head(0), tail(0), scan(0) {}
+
+    // returns room for at least `want` more bytes at the tail
+    char *space(size_t want){
+        if(buf.size() - tail < want){
+            if(head > 0){
+                memmove(buf.data(), buf.data() + head, tail - head);
+                tail -= head;
+                scan -= head;
+                head = 0;
+            }
+            if(buf.size() - tail < want) buf.resize(std::max(buf.size() * 2, tail + want));
+        }
+        return buf.data() + tail;
+    }
+
+    size_t room() const { return buf.size() - tail; }
+
+    void commit(size_t n){ tail += n; }
+
+    bool nextLine(std::string_view &line){
+        const char *base = buf.data();
+        const void *nl = memchr(base + scan, '\n', tail - scan);
+        if(!nl){
+            scan = tail;
+            return false;
+        }
+        size_t pos = (const char*)nl - base;
+        line = std::string_view(base + head, pos - head);
+        head = pos + 1;
+        scan = head;
+        if(head == tail) head = tail = scan = 0;
+        return true;
+    }
+
+    // unread bytes, for binary framing
+    std::string_view data() const {
+        return std::string_view(buf.data() + head, tail - head);
+    }
+
+    void consume(size_t n){
+        head += n;
+        if(scan < head) scan = head;
+        if(head == tail) head = tail = scan = 0;
+    }
+
+    size_t size() const { return tail - head; }
+};
+
+#endif
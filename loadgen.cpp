@@ -0,0 +1,503 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <queue>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#include "linebuf.h"
+
+// Capacity test for the ingest path. Drives thousands of virtual sensors from one
+// epoll loop, each on its own non-blocking connection and speaking the pipelined
+// sensor protocol (seq=N tags, "ACK upto=N" acks, go-back-N resend after an error).
+// Sensors connect gradually over the ramp-up, pick message types from a weighted
+// mix, and on not_leader or a dropped connection move to another server after a
+// jittered exponential backoff; a not_leader naming the leader is followed at once. A per-interval timeline makes the reconnection
+// storm after a leader kill visible; the summary reports ingest throughput and
+// ack latency percentiles.
+
+#define LOADGEN_READ_CHUNK   4096
+#define LOADGEN_MAX_BACKOFF  2000
+
+using Clock = std::chrono::steady_clock;
+
+enum class SensorState { Idle, Connecting, Up };
+
+struct Pending {
+    unsigned long long seq;
+    int readings;
+    std::string line;
+    Clock::time_point sentAt;
+};
+
+struct VSensor {
+    int id;
+    int fd;
+    int portIdx;
+    SensorState state;
+    LineBuffer in;
+    std::string out;
+    std::deque<Pending> unacked;
+    unsigned long long nextSeq;
+    int backoffMs;
+    bool blocked;               // a message came due while the window was full
+    bool redirected;            // followed a leader hint and has had no ack since
+    Clock::time_point due;      // next send, or next connect attempt while Idle
+};
+
+struct Interval {
+    long long readings;
+    long long errors;
+    long long reconnects;
+    int connected;
+};
+
+struct LoadOptions {
+    double rate;                // messages per second per sensor
+    int window;
+    int batch;
+    int mixData, mixHb, mixBatch;
+    int rampMs;
+    int backoffMs;
+    bool randomFailover;
+    int reportMs;
+};
+
+static bool parseMix(const std::string &s, LoadOptions &o){
+    int d, h, b;
+    if(sscanf(s.c_str(), "%d:%d:%d", &d, &h, &b) != 3 || d < 0 || h < 0 || b < 0 || d + h + b == 0) return false;
+    o.mixData = d;
+    o.mixHb = h;
+    o.mixBatch = b;
+    return true;
+}
+
+class LoadGen {
+private:
+    LoadOptions opt;
+    std::vector<sockaddr_in> servers;
+    std::vector<VSensor> sensors;
+    int epfd;
+    std::mt19937 rng;
+
+    typedef std::pair<Clock::time_point, int> Timer;
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers;
+
+    std::vector<long long> latUs;
+    long long sentMsgs, ackedMsgs, ackedReadings, errors, reconnects, connectFails, resent;
+    Interval cur;
+    std::vector<Interval> timeline;
+
+    void schedule(VSensor &s, Clock::time_point when){
+        s.due = when;
+        timers.push(Timer(when, s.id));
+    }
+
+    Clock::duration interval() const {
+        return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / opt.rate));
+    }
+
+    void startConnect(VSensor &s){
+        s.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if(s.fd < 0){
+            failed(s, false);
+            return;
+        }
+        int one = 1;
+        setsockopt(s.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        const sockaddr_in &a = servers[s.portIdx];
+        if(connect(s.fd, (const sockaddr*)&a, sizeof(a)) < 0 && errno != EINPROGRESS){
+            failed(s, false);
+            return;
+        }
+        epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.u32 = s.id;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, s.fd, &ev);
+        s.state = SensorState::Connecting;
+    }
+
+    // the configured server named by "leader=<host:port>" in a reply, or -1
+    int leaderIndex(std::string_view line) const {
+        size_t pos = line.find(" leader=");
+        if(pos == std::string_view::npos) return -1;
+        std::string_view addr = line.substr(pos + 8);
+        addr = addr.substr(0, addr.find(' '));
+        size_t colon = addr.rfind(':');
+        if(colon == std::string_view::npos) return -1;
+        in_addr host;
+        if(inet_pton(AF_INET, std::string(addr.substr(0, colon)).c_str(), &host) != 1) return -1;
+        int port = atoi(std::string(addr.substr(colon + 1)).c_str());
+        for(size_t i = 0; i < servers.size(); i++)
+            if(servers[i].sin_addr.s_addr == host.s_addr && ntohs(servers[i].sin_port) == port) return i;
+        return -1;
+    }
+
+    // drops the connection and schedules a reconnect with full-jitter backoff, or at
+    // once to the leader a not_leader reply named, unless the last hint got nowhere
+    void failed(VSensor &s, bool moveOn, int leader = -1){
+        if(s.fd >= 0){
+            epoll_ctl(epfd, EPOLL_CTL_DEL, s.fd, nullptr);
+            close(s.fd);
+        }
+        if(s.state == SensorState::Up){
+            cur.reconnects++;
+            reconnects++;
+        } else {
+            connectFails++;
+            moveOn = true;
+        }
+        s.fd = -1;
+        s.state = SensorState::Idle;
+        s.out.clear();
+        s.in = LineBuffer();
+        s.blocked = false;
+
+        if(leader >= 0 && !s.redirected){
+            s.redirected = true;
+            s.portIdx = leader;
+            schedule(s, Clock::now());
+            return;
+        }
+        if(moveOn && servers.size() > 1){
+            if(opt.randomFailover){
+                int next = rng() % (servers.size() - 1);
+                s.portIdx = next >= s.portIdx ? next + 1 : next;
+            } else {
+                s.portIdx = (s.portIdx + 1) % servers.size();
+            }
+        }
+        int wait = s.backoffMs > 0 ? (int)(rng() % (s.backoffMs + 1)) : 0;
+        if(opt.backoffMs > 0) s.backoffMs = std::min(std::max(s.backoffMs * 2, opt.backoffMs), LOADGEN_MAX_BACKOFF);
+        schedule(s, Clock::now() + std::chrono::milliseconds(wait));
+    }
+
+    void connected(VSensor &s){
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(s.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if(err != 0){
+            failed(s, true);
+            return;
+        }
+        s.state = SensorState::Up;
+        s.backoffMs = opt.backoffMs;
+
+        // go-back-N: everything the last server did not ack goes out again, in order
+        auto now = Clock::now();
+        for(auto &p : s.unacked){
+            s.out += p.line;
+            p.sentAt = now;
+            resent++;
+        }
+        if(!flush(s)) return;
+        schedule(s, now);
+    }
+
+    std::string makeLine(VSensor &s, int &readings){
+        int pick = rng() % (opt.mixData + opt.mixHb + opt.mixBatch);
+        std::string line;
+        if(pick < opt.mixHb){
+            line = "HEARTBEAT node=" + std::to_string(s.id);
+            readings = 0;
+        } else if(pick < opt.mixHb + opt.mixBatch){
+            line = "DATA_BATCH node=" + std::to_string(s.id);
+            for(int k = 0; k < opt.batch; k++)
+                line += " " + std::to_string(20 + rng() % 16) + "," + std::to_string(40 + rng() % 51);
+            readings = opt.batch;
+        } else {
+            line = "DATA node=" + std::to_string(s.id) +
+                   " temp=" + std::to_string(20 + rng() % 16) +
+                   " humidity=" + std::to_string(40 + rng() % 51);
+            readings = 1;
+        }
+        line += " seq=" + std::to_string(s.nextSeq) + "\n";
+        return line;
+    }
+
+    void sendNext(VSensor &s, Clock::time_point now){
+        if((int)s.unacked.size() >= opt.window){
+            s.blocked = true;
+            return;
+        }
+        int readings = 0;
+        std::string line = makeLine(s, readings);
+        s.out += line;
+        s.unacked.push_back(Pending{s.nextSeq++, readings, std::move(line), now});
+        sentMsgs++;
+        if(!flush(s)) return;
+        // keep the configured rate even if a timer fires late, but never burst to catch up
+        Clock::time_point next = s.due + interval();
+        schedule(s, next < now ? now : next);
+    }
+
+    // false if the connection failed
+    bool flush(VSensor &s){
+        while(!s.out.empty()){
+            ssize_t n = send(s.fd, s.out.data(), s.out.size(), MSG_NOSIGNAL);
+            if(n > 0){
+                s.out.erase(0, n);
+                continue;
+            }
+            if(n < 0 && errno == EINTR) continue;
+            if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+            failed(s, true);
+            return false;
+        }
+        return true;
+    }
+
+    void readable(VSensor &s){
+        while(true){
+            char *buf = s.in.space(LOADGEN_READ_CHUNK);
+            ssize_t n = recv(s.fd, buf, s.in.room(), 0);
+            if(n > 0){
+                s.in.commit(n);
+                if(!replies(s)) return;
+                continue;
+            }
+            if(n < 0 && errno == EINTR) continue;
+            if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+            failed(s, true);
+            return;
+        }
+    }
+
+    // false if the connection was dropped
+    bool replies(VSensor &s){
+        auto now = Clock::now();
+        std::string_view line;
+        while(s.in.nextLine(line)){
+            if(line.substr(0, 9) == "ACK upto="){
+                unsigned long long upto = strtoull(std::string(line.substr(9)).c_str(), nullptr, 10);
+                while(!s.unacked.empty() && s.unacked.front().seq <= upto){
+                    Pending &p = s.unacked.front();
+                    latUs.push_back(std::chrono::duration_cast<std::chrono::microseconds>(now - p.sentAt).count());
+                    ackedMsgs++;
+                    ackedReadings += p.readings;
+                    cur.readings += p.readings;
+                    s.unacked.pop_front();
+                }
+                s.redirected = false;
+                if(s.blocked){
+                    s.blocked = false;
+                    sendNext(s, now);
+                    if(s.state != SensorState::Up) return false;
+                }
+            } else if(line.substr(0, 3) == "ERR"){
+                errors++;
+                cur.errors++;
+                bool notLeader = line.find("not_leader") != std::string_view::npos;
+                failed(s, notLeader, notLeader ? leaderIndex(line) : -1);
+                return false;
+            }
+        }
+        return true;
+    }
+
+public:
+    LoadGen(const LoadOptions &o, const std::vector<sockaddr_in> &addrs, int count)
+      : opt(o), servers(addrs), sensors(count), epfd(epoll_create1(0)), rng(12345),
+        sentMsgs(0), ackedMsgs(0), ackedReadings(0), errors(0), reconnects(0), connectFails(0), resent(0)
+    {
+        memset(&cur, 0, sizeof(cur));
+        auto start = Clock::now();
+        for(int i = 0; i < count; i++){
+            VSensor &s = sensors[i];
+            s.id = i;
+            s.fd = -1;
+            s.portIdx = i % servers.size();
+            s.state = SensorState::Idle;
+            s.nextSeq = 1;
+            s.backoffMs = opt.backoffMs;
+            s.blocked = false;
+            s.redirected = false;
+            long long offsetUs = count > 1 ? (long long)opt.rampMs * 1000 * i / count : 0;
+            schedule(s, start + std::chrono::microseconds(offsetUs));
+        }
+        latUs.reserve(1 << 20);
+    }
+
+    ~LoadGen(){
+        for(auto &s : sensors) if(s.fd >= 0) close(s.fd);
+        close(epfd);
+    }
+
+    void run(int runSeconds){
+        using namespace std::chrono;
+        auto start = Clock::now();
+        auto end = start + seconds(runSeconds);
+        auto reportAt = start + milliseconds(opt.reportMs);
+        std::vector<epoll_event> events(1024);
+
+        std::cout << "   t(s)  readings/s  errors  reconnects  connected\n";
+        while(Clock::now() < end){
+            auto now = Clock::now();
+            int waitMs = 100;
+            if(!timers.empty())
+                waitMs = std::max(0, std::min(waitMs, (int)duration_cast<milliseconds>(timers.top().first - now).count()));
+
+            int n = epoll_wait(epfd, events.data(), events.size(), waitMs);
+            for(int k = 0; k < n; k++){
+                VSensor &s = sensors[events[k].data.u32];
+                if(s.fd < 0) continue;
+                uint32_t ev = events[k].events;
+                if(s.state == SensorState::Connecting){
+                    if(ev & (EPOLLOUT | EPOLLERR | EPOLLHUP)) connected(s);
+                    continue;
+                }
+                if(ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) readable(s);
+                if(s.state == SensorState::Up && (ev & EPOLLOUT)) flush(s);
+            }
+
+            now = Clock::now();
+            while(!timers.empty() && timers.top().first <= now){
+                Timer t = timers.top();
+                timers.pop();
+                VSensor &s = sensors[t.second];
+                if(t.first != s.due) continue;     // superseded
+                if(s.state == SensorState::Idle) startConnect(s);
+                else if(s.state == SensorState::Up) sendNext(s, now);
+            }
+
+            if(now >= reportAt){
+                for(auto &s : sensors) if(s.state == SensorState::Up) cur.connected++;
+                timeline.push_back(cur);
+                double secs = duration_cast<duration<double>>(now - start).count();
+                printf("%7.1f  %10lld  %6lld  %10lld  %9d\n", secs,
+                       cur.readings * 1000 / opt.reportMs, cur.errors, cur.reconnects, cur.connected);
+                memset(&cur, 0, sizeof(cur));
+                reportAt += milliseconds(opt.reportMs);
+            }
+        }
+
+        double elapsed = duration_cast<duration<double>>(Clock::now() - start).count();
+        report(elapsed);
+    }
+
+    void report(double elapsed){
+        std::sort(latUs.begin(), latUs.end());
+        auto pct = [&](double p) -> long long {
+            if(latUs.empty()) return 0;
+            return latUs[std::min(latUs.size() - 1, (size_t)(p * latUs.size()))];
+        };
+
+        // a storm is the peak reconnect rate; the outage is the longest run of
+        // intervals in which nothing was acked, after the ramp-up completed
+        long long peak = 0;
+        int gap = 0, longestGap = 0;
+        size_t rampIntervals = (opt.rampMs + opt.reportMs - 1) / opt.reportMs;
+        for(size_t i = 0; i < timeline.size(); i++){
+            peak = std::max(peak, timeline[i].reconnects);
+            if(i < rampIntervals) continue;
+            gap = timeline[i].readings == 0 ? gap + 1 : 0;
+            longestGap = std::max(longestGap, gap);
+        }
+        int alive = 0;
+        for(auto &s : sensors) if(s.state == SensorState::Up) alive++;
+
+        std::cout << "sensors:                  " << sensors.size() << " (" << alive << " connected at end)\n";
+        std::cout << "messages sent/acked:      " << sentMsgs << " / " << ackedMsgs << " (" << resent << " resent)\n";
+        std::cout << "readings acked:           " << ackedReadings << "\n";
+        std::cout << "ingest readings/sec:      " << (long long)(ackedReadings / elapsed) << "\n";
+        std::cout << "ack latency p50/p90/p99/p99.9/max (us): " << pct(0.50) << " / " << pct(0.90) << " / "
+                  << pct(0.99) << " / " << pct(0.999) << " / " << (latUs.empty() ? 0 : latUs.back()) << "\n";
+        std::cout << "errors:                   " << errors << "\n";
+        std::cout << "reconnects:               " << reconnects << " (" << connectFails << " failed connects)\n";
+        std::cout << "reconnect storm peak:     " << peak * 1000 / opt.reportMs << "/s\n";
+        std::cout << "longest ingest outage:    " << longestGap * opt.reportMs << " ms\n";
+    }
+};
+
+int main(int argc, char *argv[]) {
+    if(argc < 5) {
+        std::cout << "Usage: " << argv[0] << " <server_ip> <port1,port2,...> <sensors> <seconds> [options]\n";
+        std::cout << "Options:\n";
+        std::cout << "  --rate=R          messages per second per sensor (default 1)\n";
+        std::cout << "  --window=N        messages in flight per sensor (default 4)\n";
+        std::cout << "  --mix=D:H:B       weights of DATA, HEARTBEAT and DATA_BATCH messages (default 8:1:1)\n";
+        std::cout << "  --batch=K         readings per DATA_BATCH (default 16)\n";
+        std::cout << "  --ramp-ms=T       spread sensor connects over T ms (default 2000)\n";
+        std::cout << "  --backoff-ms=B    reconnect backoff base, doubled per failure with full jitter (default 50, 0 = none)\n";
+        std::cout << "  --failover=next|random   server to try after not_leader or a dropped connection\n";
+        std::cout << "  --report-ms=I     timeline interval (default 1000)\n";
+        std::cout << "Example: " << argv[0] << " 127.0.0.1 10035,10036,10037 5000 30 --rate=2 --ramp-ms=5000\n";
+        return 1;
+    }
+
+    std::string ip = argv[1];
+    int count = atoi(argv[3]);
+    int runSeconds = atoi(argv[4]);
+
+    std::vector<sockaddr_in> servers;
+    std::string ports = argv[2];
+    size_t pos = 0;
+    while(pos <= ports.size()){
+        size_t comma = ports.find(',', pos);
+        if(comma == std::string::npos) comma = ports.size();
+        sockaddr_in a;
+        memset(&a, 0, sizeof(a));
+        a.sin_family = AF_INET;
+        a.sin_port = htons(atoi(ports.substr(pos, comma - pos).c_str()));
+        if(inet_pton(AF_INET, ip.c_str(), &a.sin_addr) <= 0){
+            std::cout << "ERROR: Invalid address\n";
+            return 1;
+        }
+        servers.push_back(a);
+        pos = comma + 1;
+    }
+
+    LoadOptions opt;
+    opt.rate = 1;
+    opt.window = 4;
+    opt.batch = 16;
+    opt.mixData = 8;
+    opt.mixHb = 1;
+    opt.mixBatch = 1;
+    opt.rampMs = 2000;
+    opt.backoffMs = 50;
+    opt.randomFailover = false;
+    opt.reportMs = 1000;
+
+    for(int i = 5; i < argc; i++){
+        std::string arg = argv[i];
+        if(arg.rfind("--rate=", 0) == 0) opt.rate = std::max(0.001, atof(arg.c_str() + 7));
+        else if(arg.rfind("--window=", 0) == 0) opt.window = std::max(1, atoi(arg.c_str() + 9));
+        else if(arg.rfind("--batch=", 0) == 0) opt.batch = std::max(1, atoi(arg.c_str() + 8));
+        else if(arg.rfind("--ramp-ms=", 0) == 0) opt.rampMs = std::max(0, atoi(arg.c_str() + 10));
+        else if(arg.rfind("--backoff-ms=", 0) == 0) opt.backoffMs = std::max(0, atoi(arg.c_str() + 13));
+        else if(arg.rfind("--report-ms=", 0) == 0) opt.reportMs = std::max(10, atoi(arg.c_str() + 12));
+        else if(arg == "--failover=next") opt.randomFailover = false;
+        else if(arg == "--failover=random") opt.randomFailover = true;
+        else if(arg.rfind("--mix=", 0) == 0 && parseMix(arg.substr(6), opt)) {}
+        else {
+            std::cout << "ERROR: bad option " << arg << "\n";
+            return 1;
+        }
+    }
+
+    // one descriptor per sensor; raise the soft limit as far as the hard limit allows
+    rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)count + 64){
+        rl.rlim_cur = std::min(rl.rlim_max, (rlim_t)count + 64);
+        setrlimit(RLIMIT_NOFILE, &rl);
+        if(rl.rlim_cur < (rlim_t)count + 64)
+            std::cout << "WARNING: descriptor limit " << rl.rlim_cur << " is below " << count << " sensors\n";
+    }
+
+    LoadGen gen(opt, servers, count);
+    gen.run(runSeconds);
+    return 0;
+}
@@ -0,0 +1,174 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <map>
+
+// Instruments cheap enough for the request path. Every update is a relaxed atomic
+// add on a shard picked once per thread, so threads counting the same thing do not
+// share a cache line; readers sum the shards when QUERY METRICS asks.
+
+#define METRICS_SHARDS  8
+#define HIST_SUB_BITS   4       // 16 buckets per power of two: within 6.25% of the value
+#define HIST_MAX_BITS   40      // values are clamped below 2^40 (µs: about 12 days)
+#define HIST_BUCKETS    ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+static inline int metricsShard(){
+    static std::atomic<int> next(0);
+    thread_local int shard = next++ % METRICS_SHARDS;
+    return shard;
+}
+
+class Counter {
+private:
+    struct alignas(64) Shard { std::atomic<uint64_t> v{0}; };
+    Shard shards[METRICS_SHARDS];
+
+public:
+    void add(uint64_t n = 1){ shards[metricsShard()].v.fetch_add(n, std::memory_order_relaxed); }
+
+    uint64_t value() const {
+        uint64_t sum = 0;
+        for(auto &s : shards) sum += s.v.load(std::memory_order_relaxed);
+        return sum;
+    }
+};
+
+// a level rather than a total, so a single atomic: shards could not be summed
+class Gauge {
+private:
+    std::atomic<int64_t> v{0};
+
+public:
+    void add(int64_t n){ v.fetch_add(n, std::memory_order_relaxed); }
+    void set(int64_t n){ v.store(n, std::memory_order_relaxed); }
+    int64_t value() const { return v.load(std::memory_order_relaxed); }
+};
+
+// Log-linear buckets as in HdrHistogram. Values below 2^HIST_SUB_BITS get a bucket
+// each. Above that, every power of two is cut into 2^HIST_SUB_BITS equal buckets, so
+// powers of two are always bucket boundaries, which is where the export puts its le.
+class Histogram {
+private:
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> counts[HIST_BUCKETS];
+        std::atomic<uint64_t> sum{0};
+        Shard(){ for(auto &c : counts) c.store(0, std::memory_order_relaxed); }
+    };
+    Shard shards[METRICS_SHARDS];
+
+public:
+    static int bucket(uint64_t v){
+        if(v < (1u << HIST_SUB_BITS)) return (int)v;
+        if(v >> HIST_MAX_BITS) v = (1ull << HIST_MAX_BITS) - 1;
+        int e = 63 - __builtin_clzll(v);
+        int sub = (int)(v >> (e - HIST_SUB_BITS)) - (1 << HIST_SUB_BITS);
+        return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + sub;
+    }
+
+    // smallest value of the next bucket
+    static uint64_t bucketEnd(int b){
+        if(b < (1 << HIST_SUB_BITS)) return b + 1;
+        int e = (b >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+        uint64_t sub = b & ((1 << HIST_SUB_BITS) - 1);
+        return (((1ull << HIST_SUB_BITS) + sub + 1) << (e - HIST_SUB_BITS));
+    }
+
+    void record(uint64_t v){
+        Shard &s = shards[metricsShard()];
+        s.counts[bucket(v)].fetch_add(1, std::memory_order_relaxed);
+        s.sum.fetch_add(v, std::memory_order_relaxed);
+    }
+
+    // per-bucket counts summed over the shards; sum is the total of recorded values
+    std::vector<uint64_t> counts(uint64_t &sum) const {
+        std::vector<uint64_t> out(HIST_BUCKETS, 0);
+        sum = 0;
+        for(auto &s : shards){
+            for(int b = 0; b < HIST_BUCKETS; b++) out[b] += s.counts[b].load(std::memory_order_relaxed);
+            sum += s.sum.load(std::memory_order_relaxed);
+        }
+        return out;
+    }
+};
+
+// Prometheus text exposition (format 0.0.4). HELP and TYPE are written once per
+// metric name, and calls for one metric may come in any order, interleaved with
+// other metrics. The body ends in "# EOF", a comment to Prometheus, which tells a
+// line-protocol client that the reply is complete.
+class MetricsText {
+private:
+    // each family's samples stay together, in the order families first appear, even
+    // when callers interleave them (one Raft group after another, say)
+    std::vector<std::string> order;
+    std::map<std::string, std::ostringstream> families;
+
+    std::ostringstream &head(const std::string &name, const char *help, const char *type){
+        auto it = families.find(name);
+        if(it != families.end()) return it->second;
+        order.push_back(name);
+        std::ostringstream &out = families[name];
+        out.precision(15);
+        out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n";
+        return out;
+    }
+
+    static std::string braces(const std::string &labels){
+        return labels.empty() ? "" : "{" + labels + "}";
+    }
+
+public:
+    void counter(const std::string &name, const char *help, uint64_t v, const std::string &labels = ""){
+        head(name, help, "counter") << name << braces(labels) << " " << v << "\n";
+    }
+
+    void gauge(const std::string &name, const char *help, double v, const std::string &labels = ""){
+        head(name, help, "gauge") << name << braces(labels) << " " << v << "\n";
+    }
+
+    // h holds microseconds; it is exported in seconds with le at 16 µs, 32 µs, ... 16.8 s
+    void histogram(const std::string &name, const char *help, const Histogram &h, const std::string &labels = ""){
+        std::ostringstream &out = head(name, help, "histogram");
+        uint64_t sum;
+        std::vector<uint64_t> c = h.counts(sum);
+        std::string sep = labels.empty() ? "" : labels + ",";
+        uint64_t cum = 0;
+        int b = 0;
+        for(int k = 4; k <= 24; k++){
+            uint64_t le = 1ull << k;
+            while(b < HIST_BUCKETS && Histogram::bucketEnd(b) <= le) cum += c[b++];
+            out << name << "_bucket{" << sep << "le=\"" << le / 1e6 << "\"} " << cum << "\n";
+        }
+        while(b < HIST_BUCKETS) cum += c[b++];
+        out << name << "_bucket{" << sep << "le=\"+Inf\"} " << cum << "\n";
+        out << name << "_sum" << braces(labels) << " " << sum / 1e6 << "\n";
+        out << name << "_count" << braces(labels) << " " << cum << "\n";
+    }
+
+    std::string str(){
+        std::string s;
+        for(auto &name : order) s += families[name].str();
+        return s + "# EOF\n";
+    }
+};
+
+// process-wide instruments of the client-facing side of a server
+struct ServerMetrics {
+    Histogram ingestAck;        // µs from a write arriving to its reply being ready
+    Counter requests;
+    Counter bytesIn;
+    Counter bytesOut;
+    Counter accepted;
+    Gauge open;
+};
+
+static inline ServerMetrics &serverMetrics(){
+    static ServerMetrics m;
+    return m;
+}
+
+#endif
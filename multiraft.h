@@ -0,0 +1,112 @@
+#ifndef __MULTIRAFT_H__
+#define __MULTIRAFT_H__
+
+#include <stdint.h>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+
+#include "raft.h"
+
+#define MAX_RAFT_GROUPS      255    // a group id has to fit the frame header's flags byte
+#define BALANCE_INTERVAL_MS  1000
+#define BALANCE_BACKOFF_MS   10000  // before a group whose handover failed is tried again
+
+// Raft group owning a sensor's readings: node ids hash onto the 32-bit space, which
+// the n groups split into equal ranges. The hash (murmur3's finalizer) spreads
+// sequential ids, so no range gets a run of neighbouring sensors.
+static inline int groupOfNode(int node, int n){
+    uint32_t h = (uint32_t)node;
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return (int)(((uint64_t)h * (uint64_t)n) >> 32);
+}
+
+// Several independent Raft groups on one server, all with the same peers. Each has
+// its own log, state machine, WAL and peer connections, and elects its own leader, so
+// with leaders on different servers every server takes writes. Sensor entries go to
+// the group of their node; anything else to group 0.
+//
+// Leaders are spread by a balancer thread: group g belongs on the server with the
+// (g mod n)-th smallest id of the n servers, and a server leading a group that
+// belongs elsewhere hands it over once that server is caught up.
+class RaftGroups {
+private:
+    int me;
+    std::vector<std::unique_ptr<Raft>> rafts;
+    std::vector<std::chrono::steady_clock::time_point> retryAt;     // per group, next handover attempt
+
+    std::thread balancer;
+    std::mutex mu;
+    std::condition_variable cv;
+    bool stopping;
+
+    void balance(){
+        auto now = std::chrono::steady_clock::now();
+        for(size_t g = 0; g < rafts.size(); g++){
+            Raft &r = *rafts[g];
+            if(now < retryAt[g] || !r.isLeader()) continue;
+            std::vector<int> ids = r.getServerIds();
+            if(ids.empty()) continue;
+            int want = ids[g % ids.size()];
+            if(want == me || !r.peerCaughtUp(want)) continue;
+            retryAt[g] = now + std::chrono::milliseconds(BALANCE_BACKOFF_MS);
+            // done runs under the group's lock and has nothing to do: the handover
+            // either goes through or leaves this server leading until the next try
+            r.transferLeadership(want, [](TransferResult){});
+        }
+    }
+
+    void balanceLoop(){
+        std::unique_lock<std::mutex> lk(mu);
+        while(!stopping){
+            cv.wait_for(lk, std::chrono::milliseconds(BALANCE_INTERVAL_MS));
+            if(stopping) break;
+            lk.unlock();
+            balance();
+            lk.lock();
+        }
+    }
+
+public:
+    RaftGroups(int id, int port, const std::vector<std::string> &peers, int n)
+      : me(id), stopping(false)
+    {
+        for(int g = 0; g < n; g++){
+            rafts.emplace_back(new Raft(id, port, peers));
+            if(n > 1) rafts[g]->setGroup(g);
+        }
+        retryAt.assign(n, std::chrono::steady_clock::time_point());
+    }
+
+    ~RaftGroups(){ stop(); }
+
+    int size() const { return rafts.size(); }
+    Raft &at(int g){ return *rafts[g]; }
+    Raft &forNode(int node){ return *rafts[groupOfNode(node, rafts.size())]; }
+    Raft &forEntry(const Log &e){ return e.kind == EntryKind::Opaque ? *rafts[0] : forNode(e.node); }
+
+    bool start(){
+        for(auto &r : rafts) if(!r->start()) return false;
+        if(rafts.size() > 1) balancer = std::thread(&RaftGroups::balanceLoop, this);
+        return true;
+    }
+
+    void stop(){
+        {
+            std::lock_guard<std::mutex> lk(mu);
+            stopping = true;
+        }
+        cv.notify_all();
+        if(balancer.joinable()) balancer.join();
+        for(auto &r : rafts) r->stop();
+    }
+};
+
+#endif
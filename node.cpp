@@ -17,21 +17,315 @@
 #include <vector>
 #include <thread>
 #include <random>
+#include <deque>
+#include <poll.h>
 #include "node.h"
+#include "linebuf.h"
+
+#define PIPELINE_WINDOW       32
+#define PIPELINE_ACK_TIMEOUT  5000
+#define PIPELINE_STATS_MS     5000
+
+struct SensorOptions {
+    bool pipeline;
+    int window;          // messages sent but not yet acked
+    int batch;           // readings per DATA_BATCH line; 1 sends plain DATA
+    int intervalMs;      // between data messages; 0 streams as fast as acks allow
+    int heartbeatMs;
+};
+
+struct InFlight {
+    unsigned long long seq;
+    std::string line;
+    std::chrono::steady_clock::time_point sentAt;
+    bool failed;        // answered with an ERR on this connection
+};
+
+// blocks until a whole reply line has arrived; false on timeout or disconnect
+static bool recvLine(int sock, LineBuffer &in, std::string &line){
+    std::string_view v;
+    while(!in.nextLine(v)){
+        char *buf = in.space(BUFFER_SIZE);
+        ssize_t n = recv(sock, buf, in.room(), 0);
+        if(n <= 0) return false;
+        in.commit(n);
+    }
+    line.assign(v.data(), v.size());
+    return true;
+}
+
+static bool sendAll(int sock, const std::string &out){
+    size_t off = 0;
+    while(off < out.size()){
+        ssize_t n = send(sock, out.data() + off, out.size() - off, MSG_NOSIGNAL);
+        if(n <= 0) return false;
+        off += n;
+    }
+    return true;
+}
+
+// The server a sensor dials next: the configured ones in turn, or the leader named by
+// the last "ERR not_leader leader=<host:port> term=<t>" reply, so after a failover it
+// takes one round trip to find the leader instead of a walk through every server.
+struct ServerTarget {
+    std::string ip;
+    std::vector<int> ports;
+    size_t idx = 0;
+    std::string host;
+    int port;
+    size_t redirects = 0;      // since the last successful exchange
+
+    ServerTarget(const std::string &ip_, const std::vector<int> &ports_)
+      : ip(ip_), ports(ports_), host(ip_), port(ports_[0]) {}
+
+    void next(){
+        idx = (idx + 1) % ports.size();
+        host = ip;
+        port = ports[idx];
+    }
+
+    // false if the reply names no leader (mid-election) or the redirects look like a loop;
+    // the caller should then pause and try the next server
+    bool follow(const std::string &reply){
+        size_t pos = reply.find(" leader=");
+        size_t colon = pos == std::string::npos ? pos : reply.find(':', pos);
+        if(colon == std::string::npos || ++redirects > ports.size()){
+            next();
+            return false;
+        }
+        host = reply.substr(pos + 8, colon - pos - 8);
+        port = atoi(reply.c_str() + colon + 1);
+        return true;
+    }
+};
+
+static unsigned long long seqOf(const std::string &reply, const char *key){
+    size_t pos = reply.find(key);
+    if(pos == std::string::npos) return 0;
+    return strtoull(reply.c_str() + pos + strlen(key), nullptr, 10);
+}
+
+// Pipelined uplink: every message carries "seq=N" and up to `window` of them are in
+// flight at once. The server acks cumulatively ("ACK upto=N"), so one reply can
+// retire many messages. After an ERR the rest of the window is still answered and
+// its acks are kept; once every message has its reply the sensor reconnects (to the
+// leader a not_leader reply names, or the next server) and resends the failed ones,
+// plus any a dropped connection left unanswered, in their original order. Delivery
+// is at least once: a resent reading can land after later ones, or twice if it was
+// committed but its ack was lost with the connection.
+static void runPipelined(const std::string &ip, int node_id, const std::vector<int> &server_ports, const SensorOptions &opt){
+    using namespace std::chrono;
+    ServerTarget target(ip, server_ports);
+    size_t failedConnects = 0;
+    unsigned long long nextSeq = 1;
+    std::deque<InFlight> unacked;
+
+    std::default_random_engine gen(time(NULL) + node_id);
+    std::uniform_int_distribution<int> tempDist(20, 35);
+    std::uniform_int_distribution<int> humDist(40, 90);
+
+    long long readings = 0, acked = 0, resent = 0, reconnects = 0;
+    long long latSumUs = 0, latCount = 0;
+    auto statsAt = steady_clock::now() + milliseconds(PIPELINE_STATS_MS);
+    long long readingsAtLast = 0;
+
+    Node1 node;
+    std::cout << "Starting pipelined uplink (window=" << opt.window << ", batch=" << opt.batch << ")..." << std::endl;
+
+    while(1){
+        if(node.Init(target.host, target.port) == 0){
+            // a dead server is skipped at once; pause only once all of them have failed
+            target.next();
+            if(++failedConnects % server_ports.size() == 0) std::this_thread::sleep_for(std::chrono::seconds(1));
+            continue;
+        }
+        failedConnects = 0;
+        int sock = node.GetSocket();
+        int one = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        struct timeval tv;
+        tv.tv_sec = PIPELINE_ACK_TIMEOUT / 1000;
+        tv.tv_usec = 0;
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (const char*)&tv, sizeof(tv));
+
+        std::cout << "[Sensor Node " << node_id << "] Connected to server at " << target.host << ":" << target.port
+                  << " (" << unacked.size() << " to resend)" << std::endl;
+
+        LineBuffer in;
+        bool connected = true;
+        bool rotate = false;
+        bool redirect = false;
+        size_t failed = 0;      // messages in unacked answered with an ERR
+
+        std::string out;
+        for(auto &m : unacked){
+            out += m.line;
+            m.sentAt = steady_clock::now();
+            m.failed = false;
+        }
+        resent += unacked.size();
+        if(!out.empty() && !sendAll(sock, out)) connected = false;
+
+        auto nextData = steady_clock::now();
+        auto nextHb = nextData;
+        auto lastProgress = nextData;
+
+        while(connected){
+            auto now = steady_clock::now();
+
+            out.clear();
+            while(failed == 0 && (int)unacked.size() < opt.window && (now >= nextHb || now >= nextData)){
+                std::string line;
+                if(now >= nextHb){
+                    line = "HEARTBEAT node=" + std::to_string(node_id);
+                    nextHb = now + milliseconds(opt.heartbeatMs);
+                } else if(opt.batch > 1){
+                    line = "DATA_BATCH node=" + std::to_string(node_id);
+                    for(int k = 0; k < opt.batch; k++)
+                        line += " " + std::to_string(tempDist(gen)) + "," + std::to_string(humDist(gen));
+                    readings += opt.batch;
+                    nextData += milliseconds(opt.intervalMs);
+                } else {
+                    line = "DATA node=" + std::to_string(node_id) +
+                           " temp=" + std::to_string(tempDist(gen)) +
+                           " humidity=" + std::to_string(humDist(gen));
+                    readings++;
+                    nextData += milliseconds(opt.intervalMs);
+                }
+                line += " seq=" + std::to_string(nextSeq) + "\n";
+                unacked.push_back(InFlight{nextSeq++, line, now, false});
+                out += line;
+            }
+            if(!out.empty() && !sendAll(sock, out)){
+                connected = false;
+                break;
+            }
+            if(nextData < now - milliseconds(opt.heartbeatMs)) nextData = now;
+
+            int waitMs = PIPELINE_ACK_TIMEOUT;
+            if(failed == 0 && (int)unacked.size() < opt.window){
+                auto due = std::min(nextData, nextHb);
+                waitMs = std::max(0, (int)duration_cast<milliseconds>(due - now).count());
+            }
+            if(now >= statsAt) waitMs = 0;
+
+            pollfd pfd;
+            pfd.fd = sock;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            int pr = poll(&pfd, 1, std::min(waitMs, PIPELINE_STATS_MS));
+            now = steady_clock::now();
+
+            if(pr > 0){
+                char *buf = in.space(BUFFER_SIZE * 16);
+                ssize_t n = recv(sock, buf, in.room(), 0);
+                if(n <= 0){
+                    connected = false;
+                    break;
+                }
+                in.commit(n);
+
+                // replies come in request order, so each answers the oldest message
+                // still waiting for one; an ack does not cover messages that failed
+                std::string_view v;
+                while(in.nextLine(v)){
+                    std::string reply(v);
+                    if(reply.rfind("ACK upto=", 0) == 0){
+                        unsigned long long upto = seqOf(reply, "upto=");
+                        for(auto it = unacked.begin(); it != unacked.end() && it->seq <= upto; ){
+                            if(it->failed){
+                                ++it;
+                                continue;
+                            }
+                            latSumUs += duration_cast<microseconds>(now - it->sentAt).count();
+                            latCount++;
+                            it = unacked.erase(it);
+                            acked++;
+                        }
+                        lastProgress = now;
+                        target.redirects = 0;
+                    } else if(reply.rfind("ERR", 0) == 0){
+                        for(auto &m : unacked){
+                            if(m.failed) continue;
+                            m.failed = true;
+                            failed++;
+                            break;
+                        }
+                        // the first not_leader decides where to reconnect
+                        if(!rotate && reply.find("not_leader") != std::string::npos){
+                            rotate = true;
+                            redirect = target.follow(reply);
+                        }
+                        lastProgress = now;
+                    }
+                }
+                if(failed > 0 && failed == unacked.size()) connected = false;
+            } else if(!unacked.empty() && now - lastProgress > milliseconds(PIPELINE_ACK_TIMEOUT)){
+                connected = false;
+            }
+            if(unacked.empty()) lastProgress = now;
+
+            if(now >= statsAt){
+                double rate = (readings - readingsAtLast) * 1000.0 / PIPELINE_STATS_MS;
+                std::cout << "[Sensor Node " << node_id << "] readings=" << readings
+                          << " acked_msgs=" << acked << " in_flight=" << unacked.size()
+                          << " resent=" << resent << " reconnects=" << reconnects
+                          << " readings/s=" << (long long)rate
+                          << " ack_latency_avg_us=" << (latCount ? latSumUs / latCount : 0) << std::endl;
+                readingsAtLast = readings;
+                latSumUs = latCount = 0;
+                statsAt = now + milliseconds(PIPELINE_STATS_MS);
+            }
+        }
+
+        node.Close();
+        reconnects++;
+        if(redirect){
+            std::cout << "[Sensor Node " << node_id << "] Redirected to leader at " << target.host << ":" << target.port << std::endl;
+            continue;
+        }
+        std::cout << "[Sensor Node " << node_id << "] Reconnecting..." << std::endl;
+        std::this_thread::sleep_for(std::chrono::milliseconds(rotate ? 100 : 500));
+    }
+}
 
 int main(int argc, char *argv[]) {
     if(argc < 5){
-        std::cout << "Usage:\n"<< argv[0] << " [ip] [Node_ID] [server_port1 server_port2 ...]\n";
+        std::cout << "Usage:\n"<< argv[0] << " [ip] [Node_ID] [server_port1 server_port2 ...] [options]\n";
+        std::cout << "Options:\n";
+        std::cout << "  --pipeline          stream with sequence numbers and cumulative acks\n";
+        std::cout << "  --window=N          messages in flight when pipelining (default " << PIPELINE_WINDOW << ")\n";
+        std::cout << "  --batch=K           readings per DATA_BATCH line (default 1, plain DATA)\n";
+        std::cout << "  --interval-ms=M     delay between data messages when pipelining (default 0)\n";
+        std::cout << "  --hb-ms=H           heartbeat period when pipelining (default 1000)\n";
         std::cout << "Example:\n" << argv[0] << " 127.0.0.1 1 10035 10036 10037\n";
+        std::cout << argv[0] << " 127.0.0.1 1 10035 10036 10037 --pipeline --window=64 --batch=16\n";
         return 0;
     }
     
 	std::string ip = argv[1];
     int node_id = atoi(argv[2]);
 
+    SensorOptions opt;
+    opt.pipeline = false;
+    opt.window = PIPELINE_WINDOW;
+    opt.batch = 1;
+    opt.intervalMs = 0;
+    opt.heartbeatMs = 1000;
+
     std::vector<int> server_ports;
     for(int i = 3; i < argc; i++){
-        server_ports.push_back(atoi(argv[i]));
+        std::string arg = argv[i];
+        if(arg == "--pipeline") opt.pipeline = true;
+        else if(arg.rfind("--window=", 0) == 0) opt.window = std::max(1, atoi(arg.c_str() + 9));
+        else if(arg.rfind("--batch=", 0) == 0) opt.batch = std::max(1, atoi(arg.c_str() + 8));
+        else if(arg.rfind("--interval-ms=", 0) == 0) opt.intervalMs = std::max(0, atoi(arg.c_str() + 14));
+        else if(arg.rfind("--hb-ms=", 0) == 0) opt.heartbeatMs = std::max(1, atoi(arg.c_str() + 8));
+        else if(arg.rfind("--", 0) == 0){
+            std::cerr << "Unknown option " << arg << std::endl;
+            return 0;
+        }
+        else server_ports.push_back(atoi(argv[i]));
     }
 
     if(server_ports.empty()){
@@ -39,24 +333,29 @@ int main(int argc, char *argv[]) {
         return 0;
     }
 
-    int current_port_idx = 0;
-    int current_port = server_ports[current_port_idx];
+    if(opt.pipeline){
+        runPipelined(ip, node_id, server_ports, opt);
+        return 0;
+    }
+
+    ServerTarget target(ip, server_ports);
+    size_t failedConnects = 0;
     
     Node1 node;
     
     std::cout << "Starting..." << std::endl;
     
     while(1){
-        if(node.Init(ip, current_port) == 0) {
+        if(node.Init(target.host, target.port) == 0) {
     		 
-            current_port_idx = (current_port_idx + 1) % server_ports.size();
-            current_port = server_ports[current_port_idx];
-            std::this_thread::sleep_for(std::chrono::seconds(1));
+            target.next();
+            if(++failedConnects % server_ports.size() == 0) std::this_thread::sleep_for(std::chrono::seconds(1));
             continue;
         }
+        failedConnects = 0;
         
-        std::cout << "[Sensor Node " << node_id << "] Connected to server at port " 
-                 << current_port << std::endl;
+        std::cout << "[Sensor Node " << node_id << "] Connected to server at " 
+                 << target.host << ":" << target.port << std::endl;
         
         int sock = node.GetSocket();
         
@@ -71,8 +370,10 @@ int main(int argc, char *argv[]) {
         std::uniform_int_distribution<int> tempDist(20, 35);
         std::uniform_int_distribution<int> humDist(40, 90);
         
+        LineBuffer in;
         int messageCount = 0;
         bool connected = true;
+        bool redirect = false;
         
         while (connected) {
            
@@ -87,23 +388,20 @@ int main(int argc, char *argv[]) {
             
            
 			
-            char ack_buf[256];
-            ssize_t n = recv(sock, ack_buf, sizeof(ack_buf)-1, 0);
-            if (n <= 0) {
+            std::string ack;
+            if (!recvLine(sock, in, ack)) {
                 
                 connected = false;
                 break;
             }
-            ack_buf[n] = '\0';
             
            
 			
-            if(strstr(ack_buf, "not_leader") != NULL) {
+            if(ack.find("not_leader") != std::string::npos) {
                 
                 connected = false;
                
-                current_port_idx = (current_port_idx + 1) % server_ports.size();
-                current_port = server_ports[current_port_idx];
+                redirect = target.follow(ack);
                 break;
             }
             
@@ -124,27 +422,25 @@ int main(int argc, char *argv[]) {
                 break;
             }
             
-            n = recv(sock, ack_buf, sizeof(ack_buf)-1, 0);
-            if (n <= 0) {
+            if (!recvLine(sock, in, ack)) {
                 std::cout << "No data response" << std::endl;
                 connected = false;
                 break;
             }
-            ack_buf[n] = '\0';
             
             
-            if(strstr(ack_buf, "not_leader") != NULL) {
+            if(ack.find("not_leader") != std::string::npos) {
                 connected = false;
                 
-                current_port_idx = (current_port_idx + 1) % server_ports.size();
-                current_port = server_ports[current_port_idx];
+                redirect = target.follow(ack);
                 break;
             }
+            target.redirects = 0;
             
             messageCount++;
             if(messageCount % 5 == 0) {
                 std::cout << "[Sensor Node " << node_id << "] Sent " << messageCount 
-                         << " messages to port " << current_port
+                         << " messages to port " << target.port
                          << " (temp=" << temp << "C, humidity=" << hum << "%)" << std::endl;
             }
             
@@ -152,6 +448,7 @@ int main(int argc, char *argv[]) {
         }
         
         node.Close();
+        if(redirect) continue;
         std::cout << "[Sensor Node " << node_id << "] Reconnecting..." << std::endl;
         std::this_thread::sleep_for(std::chrono::milliseconds(500));
     }
@@ -0,0 +1,242 @@
+#ifndef __PEERCONN_H__
+#define __PEERCONN_H__
+
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "rpc.h"
+
+#define PEER_TIMEOUT_MS      1000
+#define PEER_BACKOFF_MIN_MS  50
+#define PEER_BACKOFF_MAX_MS  1000
+#define PEER_MAX_REPLY       (64 << 20)
+
+struct PeerConnStats {
+    std::string addr;
+    bool connected;
+    bool binary;
+    long long calls;
+    long long reused;
+    long long reconnects;
+    long long failures;
+    long long bytesOut;
+    long long bytesIn;
+};
+
+// One long-lived connection to a peer. Every reply is read up to its terminating '\n'
+// (text) or its declared frame length (binary), so a socket can carry any number of
+// round trips. Each new connection offers the binary protocol with a HELLO line and
+// falls back to text if the peer does not echo its version. After a failed connect the peer
+// is skipped until an exponential backoff expires.
+class PeerConn{
+private:
+    std::string addr;
+    std::string ip;
+    int port;
+    int fd;
+    std::string rbuf;
+    int backoffMs;
+    int offerProto;
+    int group;
+    std::chrono::steady_clock::time_point retryAt;
+    std::mutex mu;
+
+    std::atomic<bool> up;
+    std::atomic<bool> binary;
+    std::atomic<long long> calls;
+    std::atomic<long long> reused;
+    std::atomic<long long> connects;
+    std::atomic<long long> failures;
+    std::atomic<long long> bytesOut;
+    std::atomic<long long> bytesIn;
+
+    void closefd(){
+        if(fd >= 0) close(fd);
+        fd = -1;
+        up = false;
+        rbuf.clear();
+    }
+
+    bool connectfd(){
+        auto now = std::chrono::steady_clock::now();
+        if(now < retryAt) return false;
+
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if(fd < 0) return false;
+
+        sockaddr_in a;
+        memset(&a,0,sizeof(a));
+        a.sin_family = AF_INET;
+        a.sin_port = htons(port);
+        inet_pton(AF_INET, ip.c_str(), &a.sin_addr);
+
+        struct timeval tv;
+        tv.tv_sec = PEER_TIMEOUT_MS / 1000;
+        tv.tv_usec = (PEER_TIMEOUT_MS % 1000) * 1000;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        if(connect(fd,(sockaddr*)&a,sizeof(a)) < 0){
+            closefd();
+            retryAt = now + std::chrono::milliseconds(backoffMs);
+            backoffMs = std::min(backoffMs * 2, PEER_BACKOFF_MAX_MS);
+            return false;
+        }
+
+        backoffMs = PEER_BACKOFF_MIN_MS;
+        up = true;
+        connects++;
+
+        binary = false;
+        if(offerProto < WIRE_VERSION) return true;
+
+        std::string hello = "HELLO proto=" + std::to_string(WIRE_VERSION) + "\n";
+        std::string line;
+        bool timedout = false;
+        if(!sendall(hello) || !recvline(line, timedout)){
+            closefd();
+            return false;
+        }
+        int v = line.rfind("HELLO proto=", 0) == 0 ? parse_int(line.substr(12)) : 0;
+        binary = v >= WIRE_VERSION;
+        // A peer on an older binary version answers with that version and has switched
+        // its end to frames this side does not speak; start over on text, and stay on
+        // text with this peer
+        if(v > 0 && !binary){
+            closefd();
+            offerProto = 0;
+            return connectfd();
+        }
+        return true;
+    }
+
+    bool sendall(const std::string &out){
+        size_t off = 0;
+        while(off < out.size()){
+            ssize_t n = send(fd, out.data() + off, out.size() - off, MSG_NOSIGNAL);
+            if(n <= 0) return false;
+            off += n;
+        }
+        return true;
+    }
+
+    bool recvline(std::string &line, bool &timedout){
+        size_t pos;
+        char buf[8192];
+        while((pos = rbuf.find('\n')) == std::string::npos){
+            if(rbuf.size() > PEER_MAX_REPLY) return false;
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) timedout = true;
+            if(n <= 0) return false;
+            rbuf.append(buf, n);
+        }
+        line = rbuf.substr(0, pos);
+        rbuf.erase(0, pos + 1);
+        return true;
+    }
+
+    bool recvframe(std::string &frame, bool &timedout){
+        size_t len = 0;
+        char buf[8192];
+        int ready;
+        while((ready = wireFrameReady(rbuf.data(), rbuf.size(), len)) == 0){
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) timedout = true;
+            if(n <= 0) return false;
+            rbuf.append(buf, n);
+        }
+        if(ready < 0) return false;
+        frame = rbuf.substr(0, len);
+        rbuf.erase(0, len);
+        return true;
+    }
+
+public:
+    PeerConn(const std::string &peerAddr)
+      : addr(peerAddr), port(0), fd(-1), backoffMs(PEER_BACKOFF_MIN_MS),
+        offerProto(WIRE_VERSION), group(0),
+        up(false), binary(false), calls(0), reused(0), connects(0), failures(0),
+        bytesOut(0), bytesIn(0)
+    {
+        size_t pos = peerAddr.find(':');
+        if(pos != std::string::npos){
+            ip = peerAddr.substr(0,pos);
+            port = atoi(peerAddr.substr(pos+1).c_str());
+        }
+    }
+
+    ~PeerConn(){ closefd(); }
+
+    // 0 keeps this connection on the text protocol; takes effect on the next connect
+    void setProtocol(int version){
+        std::lock_guard<std::mutex> lk(mu);
+        offerProto = version;
+    }
+
+    // the Raft group requests are for on the peer, tagged on each one
+    void setGroup(int g){
+        std::lock_guard<std::mutex> lk(mu);
+        group = g;
+    }
+
+    // Sends one request and decodes its reply; false if the peer is unreachable or
+    // answered with something unparseable. A reused socket that turns out to be dead
+    // (reset or EOF, not a timeout) is retried once on a fresh connection, since the
+    // peer may simply have restarted.
+    template<class Args, class Reply>
+    bool call(const Args &args, Reply &reply){
+        std::lock_guard<std::mutex> lk(mu);
+        if(port == 0) return false;
+        calls++;
+
+        for(int attempt = 0; attempt < 2; attempt++){
+            bool fresh = false;
+            if(fd < 0){
+                if(!connectfd()) break;
+                fresh = true;
+            } else {
+                reused++;
+            }
+
+            std::string out = binary ? encodeFrame(args) : encodeText(args) + "\n";
+            tagGroup(out, binary, group);
+            std::string in;
+            bool timedout = false;
+            bool got = sendall(out) && (binary ? recvframe(in, timedout) : recvline(in, timedout));
+            if(got){
+                bytesOut += out.size();
+                bytesIn += in.size();
+                if(binary ? decodeFrame(in, reply) : decodeText(in, reply)) return true;
+            }
+
+            // a half-read or garbled reply would desync the stream, so the socket is dropped
+            closefd();
+            if(got || fresh || timedout) break;
+        }
+
+        failures++;
+        return false;
+    }
+
+    // lock-free so a status query never waits behind an RPC in flight
+    PeerConnStats stats() const {
+        long long c = connects;
+        return PeerConnStats{addr, up, binary, calls, reused, c > 0 ? c - 1 : 0, failures, bytesOut, bytesIn};
+    }
+};
+
+#endif
@@ -1,11 +1,26 @@
 #include <iostream>
 #include <string>
 #include <string.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 
-std::string sendQuery(const std::string &ip, int port, const std::string &query) {
+// the last complete line of a reply, without its newline
+static std::string lastLine(const std::string &r) {
+    if(r.empty() || r.back() != '\n') return "";
+    size_t start = r.rfind('\n', r.size() - 2);
+    start = start == std::string::npos ? 0 : start + 1;
+    return r.substr(start, r.size() - 1 - start);
+}
+
+// a paged reply (RANGE, LATEST) is complete once its last line is END, NEXT or an error
+static bool pageComplete(const std::string &r) {
+    std::string l = lastLine(r);
+    return l == "END" || l == "# EOF" || l.compare(0, 5, "NEXT ") == 0 || l.compare(0, 4, "ERR ") == 0;
+}
+
+std::string sendQuery(const std::string &ip, int port, const std::string &query, bool paged = false) {
     int sock = socket(AF_INET, SOCK_STREAM, 0);
     if(sock < 0){
         return "ERROR: Socket creation failed\n";
@@ -44,6 +59,10 @@ std::string sendQuery(const std::string &ip, int port, const std::string &query)
         if(n <= 0) break;
         buffer[n] = '\0';
         response += buffer;
+        if(paged){
+            if(pageComplete(response)) break;
+            continue;
+        }
         if(response.size() > 10000 || response.find("\n\n") != std::string::npos) break;
     }
     
@@ -51,15 +70,65 @@ std::string sendQuery(const std::string &ip, int port, const std::string &query)
     return response;
 }
 
+// Sends the query, and resends it to the leader while the reply is
+// "ERR not_leader leader=<host:port> term=<t>". ip and port end up naming the server
+// that answered, so later pages go straight there.
+static std::string askLeader(std::string &ip, int &port, const std::string &query, bool paged = false) {
+    std::string response = sendQuery(ip, port, query, paged);
+    for(int hops = 0; hops < 3; hops++) {
+        if(response.compare(0, 14, "ERR not_leader") != 0) break;
+        size_t pos = response.find(" leader=");
+        size_t colon = pos == std::string::npos ? pos : response.find(':', pos);
+        if(colon == std::string::npos) break;
+        ip = response.substr(pos + 8, colon - pos - 8);
+        port = atoi(response.c_str() + colon + 1);
+        response = sendQuery(ip, port, query, paged);
+    }
+    return response;
+}
+
+// prints every page of a RANGE or LATEST query, following its NEXT cursors
+static void streamQuery(std::string ip, int port, const std::string &query) {
+    std::string cursor;
+    while(true) {
+        std::string response = askLeader(ip, port, cursor.empty() ? query : query + " " + cursor, true);
+        std::string last = lastLine(response);
+        if(last.compare(0, 5, "NEXT ") != 0) {
+            std::cout << response;
+            return;
+        }
+        std::cout << response.substr(0, response.size() - last.size() - 1);
+        cursor = last.substr(5);
+    }
+}
+
 int main(int argc, char *argv[]) {
     if(argc < 4) {
-        std::cout << "Usage: " << argv[0] << " <server_ip> <port> <option> [node_id]\n\n";
+        std::cout << "Usage: " << argv[0] << " <server_ip> <port> <option> [node_id] [--consistency=MODE]\n\n";
         std::cout << "Options:\n";
         std::cout << "  " << argv[0] << " 127.0.0.1 10035 1       # Cluster stats\n";
         std::cout << "  " << argv[0] << " 127.0.0.1 10035 2 1     # Node 1 data\n";
+        std::cout << "  " << argv[0] << " 127.0.0.1 10035 3 [1]   # Aggregates (cluster or node 1)\n";
+        std::cout << "  " << argv[0] << " 127.0.0.1 10035 4 1 <t0> <t1>  # Node 1 readings in [t0, t1] (ms)\n";
+        std::cout << "  " << argv[0] << " 127.0.0.1 10035 5 <t0>         # Newest reading per node since t0\n";
+        std::cout << "  " << argv[0] << " 127.0.0.1 10035 6       # Election statistics of that server\n";
+        std::cout << "  " << argv[0] << " 127.0.0.1 10035 7       # Metrics of that server (Prometheus text)\n";
+        std::cout << "\nMODE is stale (default), follower or linearizable; a linearizable query sent\n";
+        std::cout << "to a follower is redirected to the leader. A learner answers it itself, so heavy\n";
+        std::cout << "queries can be pointed at learners and leave the voters alone.\n";
         return 1;
     }
 
+    // --consistency=MODE may appear anywhere after the option
+    std::string consistency;
+    for(int i = 4; i < argc; i++) {
+        if(strncmp(argv[i], "--consistency=", 14) != 0) continue;
+        consistency = std::string(" consistency=") + (argv[i] + 14);
+        for(int j = i; j + 1 < argc; j++) argv[j] = argv[j + 1];
+        argc--;
+        break;
+    }
+
     std::string ip = argv[1];
     int port = atoi(argv[2]);
     int option = atoi(argv[3]);
@@ -69,7 +138,7 @@ int main(int argc, char *argv[]) {
     if(option == 1) {
         
         query = "QUERY STATS";
-        std::string response = sendQuery(ip, port, query);
+        std::string response = askLeader(ip, port, query + consistency);
         std::cout << response;
     }
     else if(option == 2) {
@@ -80,13 +149,48 @@ int main(int argc, char *argv[]) {
         }
         int node_id = atoi(argv[4]);
         query = "QUERY NODE " + std::to_string(node_id);
-        std::string response = sendQuery(ip, port, query);
+        std::string response = askLeader(ip, port, query + consistency);
+        std::cout << response;
+    }
+    else if(option == 3) {
+        query = "QUERY AGG";
+        if(argc >= 5) query += " " + std::to_string(atoi(argv[4]));
+        std::string response = askLeader(ip, port, query + consistency);
+        std::cout << response;
+    }
+    else if(option == 4) {
+        if(argc < 7) {
+            std::cout << "Usage: " << argv[0] << " " << ip << " " << port << " 4 <node_id> <t0> <t1>\n";
+            return 1;
+        }
+        query = "QUERY RANGE " + std::string(argv[4]) + " " + argv[5] + " " + argv[6];
+        streamQuery(ip, port, query + consistency);
+    }
+    else if(option == 5) {
+        if(argc < 5) {
+            std::cout << "Usage: " << argv[0] << " " << ip << " " << port << " 5 <t0>\n";
+            return 1;
+        }
+        query = "QUERY LATEST " + std::string(argv[4]);
+        streamQuery(ip, port, query + consistency);
+    }
+    else if(option == 6) {
+        std::string response = sendQuery(ip, port, "QUERY ELECTIONS");
+        std::cout << response;
+    }
+    else if(option == 7) {
+        std::string response = sendQuery(ip, port, "QUERY METRICS", true);
         std::cout << response;
     }
     else {
-        std::cout << "ERROR: Invalid option. Use 1 or 2\n";
+        std::cout << "ERROR: Invalid option. Use 1 to 7\n";
         std::cout << "  1           - Get cluster statistics\n";
         std::cout << "  2 <node_id> - Get sensor data for specific node\n";
+        std::cout << "  3 [node_id] - Get temperature/humidity aggregates\n";
+        std::cout << "  4 <node_id> <t0> <t1> - Get a node's readings in a time range\n";
+        std::cout << "  5 <t0>      - Get the newest reading of every node since t0\n";
+        std::cout << "  6           - Get election statistics of the server queried\n";
+        std::cout << "  7           - Get metrics of the server queried\n";
         return 1;
     }
 
@@ -22,21 +22,107 @@
 #include <sstream>
 #include <atomic>
 #include <algorithm>
+#include <memory>
+#include <deque>
+#include <functional>
+#include <future>
+#include <climits>
+
+#include "rpc.h"
+#include "peerconn.h"
+#include "transport.h"
+#include "wal.h"
+#include "stats.h"
+#include "metrics.h"
+
+#define MAX_APPEND_BATCH 256
+#define HEARTBEAT_INTERVAL_MS 50
+#define ELECTION_TIMEOUT_MIN_MS 150
+#define ELECTION_TIMEOUT_MAX_MS 300
+#define ELECTION_TIMEOUT_CAP_MS 3000  // however slow heartbeats get, a dead leader is replaced by then
+#define ELECTION_HISTORY 32
+#define READ_LEASE_MS 120             // below ELECTION_TIMEOUT_MIN_MS, leaving room for clock drift
+#define READ_TIMEOUT_MS 2000
+#define TRANSFER_TIMEOUT_MS 1000      // writes resume on this leader if the handover stalls
+#define NOOP_COMMAND "NOOP"
+#define COMMIT_TIMEOUT_MS 2000
+#define GROUP_COMMIT_MAX_BATCH 128
+#define GROUP_COMMIT_MAX_WAIT_US 500
+#define WAL_SYNC_INTERVAL_MS 10
+#define APPLY_MAX_BATCH 4096
+#define SNAPSHOT_EVERY 100000
+#define SNAPSHOT_CHUNK_BYTES (256 << 10)
+#define SNAPSHOT_MAGIC 0x33504e53u     // "SNP3"
+#define SNAPSHOT_MAGIC_V2 0x32504e53u  // "SNP2": no timestamp column, still restored
+#define SNAPSHOT_MAGIC_V1 0x50414e53u  // "SNAP": readings row by row, still restored
+#define READING_CHUNK_SIZE 1024
+
+// A follower whose election timer fires first becomes a PreCandidate and asks for
+// pre-votes at currentterm+1. Only with a majority of them does it bump its term and
+// stand as a Candidate, so a server that merely lost touch cannot depose a healthy
+// leader by forcing the cluster onto a higher term.
+enum class role{Follower, PreCandidate, Candidate, Leader};
+
+// Invalid: a HEARTBEAT or DATA command that does not parse, refused before the log
+enum class AppendResult{Committed, NotLeader, NotCommitted, Invalid};
+
+// Stale answers from local state. Linearizable is served by the leader once a quorum
+// has confirmed its leadership (a lease, or else one heartbeat round) and the state
+// machine has applied the commit index seen when the read arrived. Follower is served
+// by any server: a follower asks the leader for that index and waits to apply it.
+enum class ReadMode{Stale, Follower, Linearizable};
+
+enum class ReadResult{Ok, NotLeader, TimedOut};
+
+enum class TransferResult{Done, NotLeader, UnknownPeer, NotVoter, Busy, TimedOut};
+
+// a write waiting for its log index to commit; done() runs with Raft::mu held, so it
+// must be quick and must not call back into Raft
+struct CommitWaiter {
+    int index;
+    int term;
+    std::chrono::steady_clock::time_point deadline;
+    std::function<void(AppendResult)> done;
+};
+
+// takes the encoded reply to an inbound peer RPC; may run on the WAL thread
+typedef std::function<void(std::string)> RpcAnswerFn;
+
+// a query waiting until it may be served; done() runs on the apply thread without mu
+struct ReadWaiter {
+    uint64_t seq;
+    bool leaderRead;
+    int term;           // leader reads: the term the read index was taken in
+    int index;          // -1 while a follower waits for the leader's answer
+    bool confirmed;     // leadership confirmed (leader) or index received (follower)
+    std::chrono::steady_clock::time_point after;    // leader: a quorum must ack a request sent after this
+    std::chrono::steady_clock::time_point deadline;
+    std::function<void(ReadResult)> done;
+};
 
-static inline std::vector<std::string> split_ws(const std::string &s){
-    std::istringstream iss(s);
-    std::vector<std::string> out;
-    std::string token;
-    while(iss >> token) out.push_back(token);
-    return out;
-}
+// reads taken off the waiting list, each with its outcome, to be answered without mu
+typedef std::vector<std::pair<std::function<void(ReadResult)>, ReadResult>> ServedReads;
 
-enum class role{Follower, Candidate, Leader};
+struct ApplyStats {
+    int commitIndex;
+    int lastApplied;
+    int lag;                // commitIndex - lastApplied
+    int maxLag;             // largest lag seen when a batch was taken
+    long long batches;
+    long long entries;
+};
 
-struct Log{
+// election activity as seen by one server. An unavailability window runs from the
+// last time the winner heard from a leader to the moment it became leader itself.
+struct ElectionStats {
     int term;
-    std::string command;
-    Log(int t=0, const std::string &c="") : term(t), command(c) {}
+    int timeoutMs;              // lower end of the randomized election timeout
+    double heartbeatGapMs;      // smoothed, the figure the timeout adapts to
+    long long preVotes;         // pre-vote rounds started
+    long long candidacies;      // terms stood in after winning a pre-vote
+    long long won;
+    long long quorumLost;       // CheckQuorum step-downs
+    std::vector<long long> windowsMs;   // of the last ELECTION_HISTORY wins, oldest first
 };
 
 struct SensorReading {
@@ -44,79 +130,461 @@ struct SensorReading {
     int temperature;
     int humidity;
     int term;
+    int64_t ts;
+};
+
+// A run of up to READING_CHUNK_SIZE readings from one node, stored column by column.
+// Values are kept as int16, the range ingest accepts, and timestamps as ms after the
+// chunk's first reading, so a reading costs 12 bytes.
+struct ReadingChunk {
+    int64_t base = 0;
+    std::vector<uint32_t> offset;
+    std::vector<int16_t> temperature;
+    std::vector<int16_t> humidity;
+    std::vector<int32_t> term;
+
+    // ingest and snapshot restore keep wider readings out, so nothing is lost here
+    static int16_t narrow(int v){
+        assert(fits_int16(v));
+        return (int16_t)v;
+    }
+
+    size_t size() const { return term.size(); }
+    int64_t ts(size_t i) const { return base + offset[i]; }
+    // false once ts is too far past the first reading for a 32-bit offset
+    bool fits(int64_t ts) const { return term.empty() || ts - base <= (int64_t)UINT32_MAX; }
+
+    void push(int temp, int hum, int t, int64_t ts){
+        if(term.empty()) base = ts;
+        offset.push_back((uint32_t)(ts - base));
+        temperature.push_back(narrow(temp));
+        humidity.push_back(narrow(hum));
+        term.push_back(t);
+    }
+
+    // index of the first reading at or after ts
+    size_t lowerBound(int64_t ts) const {
+        if(ts <= base) return 0;
+        uint64_t rel = ts - base;
+        return std::lower_bound(offset.begin(), offset.end(), rel,
+                                [](uint32_t o, uint64_t v){ return o < v; }) - offset.begin();
+    }
+
+    SensorReading at(int node, size_t i) const {
+        return SensorReading{node, temperature[i], humidity[i], term[i], ts(i)};
+    }
+};
+
+typedef std::vector<std::shared_ptr<const ReadingChunk>> ChunkList;
+
+// streaming aggregates for one node or the whole cluster, updated on every apply
+struct SensorAggregate {
+    long long heartbeats = 0;
+    ColumnStats temperature;
+    ColumnStats humidity;
+
+    long long readings() const { return temperature.moments.count; }
+
+    void merge(const SensorAggregate &o){
+        heartbeats += o.heartbeats;
+        temperature.merge(o.temperature);
+        humidity.merge(o.humidity);
+    }
+};
+
+struct AggregateSummary {
+    long long readings;
+    long long heartbeats;
+    ColumnSummary temperature;
+    ColumnSummary humidity;
+};
+
+struct NodeCounts {
+    int node;
+    long long readings;
+    long long heartbeats;
+};
+
+// a consistent view of the state machine as of one log index; reading chunks are
+// shared with the live state, so taking one copies pointers, not readings
+struct StateSnapshot {
+    int index;
+    int term;
+    std::map<int, ChunkList> readings;
+    std::map<int, int> heartbeatCount;
 };
 
 class StateMachine {
 private:
-    std::vector<SensorReading> sensorData;
-    std::map<int, int> heartbeatCount;
+    // Every node's readings, oldest first and in timestamp order. Full chunks are
+    // sealed and never modified again, and the tail is copied before a write if a
+    // snapshot still shares it. sealedStart and sealedLast index the sealed chunks by
+    // position and by newest timestamp, so both kinds of lookup binary search them.
+    struct NodeSeries {
+        ChunkList sealed;
+        std::vector<size_t> sealedStart;
+        std::vector<int64_t> sealedLast;
+        std::shared_ptr<ReadingChunk> tail;
+        size_t count = 0;
+        int64_t lastTs = 0;
+
+        size_t tailStart() const { return count - (tail ? tail->size() : 0); }
+
+        void seal(){
+            sealedStart.push_back(tailStart());
+            sealedLast.push_back(tail->ts(tail->size() - 1));
+            sealed.push_back(std::move(tail));
+            tail.reset();
+        }
+
+        // the chunk holding position i; off receives i's index within it
+        const ReadingChunk &locate(size_t i, size_t &off) const {
+            size_t start = tailStart();
+            if(i >= start){ off = i - start; return *tail; }
+            size_t c = std::upper_bound(sealedStart.begin(), sealedStart.end(), i) - sealedStart.begin() - 1;
+            off = i - sealedStart[c];
+            return *sealed[c];
+        }
+
+        // position of the first reading at or after ts
+        size_t lowerBound(int64_t ts) const {
+            size_t c = std::lower_bound(sealedLast.begin(), sealedLast.end(), ts) - sealedLast.begin();
+            if(c < sealed.size()) return sealedStart[c] + sealed[c]->lowerBound(ts);
+            return tail ? tailStart() + tail->lowerBound(ts) : count;
+        }
+
+        // calls f on positions [from, to)
+        template<class F>
+        void scan(int node, size_t from, size_t to, F f) const {
+            size_t off = 0;
+            const ReadingChunk *c = from < to ? &locate(from, off) : nullptr;
+            for(size_t i = from; i < to; i++, off++){
+                if(off == c->size()) c = &locate(i, off);
+                f(c->at(node, off));
+            }
+        }
+    };
+
+    std::map<int, NodeSeries> series;
+    // aggregates see the stored (int16) values, so a restored snapshot rebuilds them exactly
+    std::map<int, SensorAggregate> aggs;
+    SensorAggregate cluster;
+    int appliedIndex;
+    int appliedTerm;
     std::mutex mu;
 
+    // ts is clamped to the node's newest reading so every series stays sorted even if
+    // a new leader's clock is behind the old one's; the clamp only depends on the log,
+    // so every replica stores the same value
+    void addReading(int node, int temp, int hum, int term, int64_t ts){
+        NodeSeries &s = series[node];
+        ts = std::max(ts, s.lastTs);
+        if(s.tail && !s.tail->fits(ts)) s.seal();
+        if(!s.tail) s.tail = std::make_shared<ReadingChunk>();
+        else if(s.tail.use_count() > 1) s.tail = std::make_shared<ReadingChunk>(*s.tail);
+        s.tail->push(temp, hum, term, ts);
+        s.count++;
+        s.lastTs = ts;
+        const ReadingChunk &c = *s.tail;
+        size_t last = c.size() - 1;
+        SensorAggregate &a = aggs[node];
+        a.temperature.add(c.temperature[last]);
+        a.humidity.add(c.humidity[last]);
+        cluster.temperature.add(c.temperature[last]);
+        cluster.humidity.add(c.humidity[last]);
+        if(s.tail->size() >= READING_CHUNK_SIZE) s.seal();
+    }
+
+public:
+    StateMachine() : appliedIndex(0), appliedTerm(0) {}
+
+    // entries at or below the applied index are already reflected (e.g. by a snapshot
+    // installed while this entry was on its way) and are skipped
+    void apply(int index, const Log &log) {
+        std::lock_guard<std::mutex> lock(mu);
+        applyLocked(index, log);
+    }
+
+    // applies entries first, first + 1, ... under a single lock acquisition
+    void applyBatch(int first, const std::vector<Log> &entries) {
+        std::lock_guard<std::mutex> lock(mu);
+        for(size_t i = 0; i < entries.size(); i++) applyLocked(first + (int)i, entries[i]);
+    }
+
+private:
+    void applyLocked(int index, const Log &log) {
+        if(index <= appliedIndex) return;
+        appliedIndex = index;
+        appliedTerm = log.term;
+        switch(log.kind){
+        case EntryKind::Heartbeat:
+            aggs[log.node].heartbeats++;
+            cluster.heartbeats++;
+            break;
+        case EntryKind::Data:
+            addReading(log.node, log.temp, log.humidity, log.term, log.ts);
+            break;
+        case EntryKind::Opaque:
+            break;
+        }
+    }
+
 public:
-    void apply(const Log &log) {
+    // Holds the lock only long enough to copy chunk pointers and the heartbeat map;
+    // encoding happens outside it.
+    StateSnapshot capture(){
         std::lock_guard<std::mutex> lock(mu);
-        
-        if(log.command.find("HEARTBEAT") != std::string::npos) {
-            size_t pos = log.command.find("node ");
-            if(pos == std::string::npos) pos = log.command.find("node=");
-            if(pos != std::string::npos) {
-                try {
-                    std::string substr = log.command.substr(pos + 5);
-                    int node_id = std::stoi(substr);
-                    heartbeatCount[node_id]++;
-                } catch(...) {}
-            }
-        }
-        else if(log.command.find("DATA") != std::string::npos) {
-            size_t nodePos = log.command.find("node=");
-            size_t tempPos = log.command.find("temp=");
-            size_t humPos = log.command.find("humidity=");
-            
-            if(nodePos != std::string::npos && tempPos != std::string::npos && humPos != std::string::npos) {
-                try {
-                    int node_id = std::stoi(log.command.substr(nodePos + 5));
-                    int temp = std::stoi(log.command.substr(tempPos + 5));
-                    int hum = std::stoi(log.command.substr(humPos + 9));
-                    
-                    SensorReading reading;
-                    reading.node_id = node_id;
-                    reading.temperature = temp;
-                    reading.humidity = hum;
-                    reading.term = log.term;
-                    sensorData.push_back(reading);
-                } catch(...) {}
+        StateSnapshot s;
+        s.index = appliedIndex;
+        s.term = appliedTerm;
+        for(auto &e : series){
+            ChunkList &l = s.readings[e.first];
+            l = e.second.sealed;
+            if(e.second.tail) l.push_back(e.second.tail);
+        }
+        for(auto &a : aggs) if(a.second.heartbeats) s.heartbeatCount[a.first] = a.second.heartbeats;
+        return s;
+    }
+
+    //   u32 magic | index | term | #heartbeats {node, count}
+    //   | #nodes {node, count, ts deltas, temp deltas, humidity deltas, term deltas} | u32 crc32c
+    // Each column is delta-encoded against the previous reading of the same node;
+    // timestamps never decrease within a node, so theirs are unsigned.
+    static std::string encode(const StateSnapshot &s){
+        size_t n = 0;
+        for(auto &e : s.readings) for(auto &c : e.second) n += c->size();
+        std::string out;
+        out.reserve(32 + s.heartbeatCount.size() * 6 + s.readings.size() * 16 + n * 5);
+        put_u32(out, SNAPSHOT_MAGIC);
+        put_varint(out, s.index);
+        put_varint(out, s.term);
+        put_varint(out, s.heartbeatCount.size());
+        for(auto &h : s.heartbeatCount){
+            put_varint(out, zigzag(h.first));
+            put_varint(out, h.second);
+        }
+        put_varint(out, s.readings.size());
+        for(auto &e : s.readings){
+            size_t count = 0;
+            for(auto &c : e.second) count += c->size();
+            put_varint(out, zigzag(e.first));
+            put_varint(out, count);
+            int64_t prevTs = 0;
+            for(auto &c : e.second) for(size_t i = 0; i < c->size(); i++){
+                put_varint64(out, c->ts(i) - prevTs);
+                prevTs = c->ts(i);
+            }
+            int prev = 0;
+            for(auto &c : e.second) for(int16_t v : c->temperature){ put_varint(out, zigzag(v - prev)); prev = v; }
+            prev = 0;
+            for(auto &c : e.second) for(int16_t v : c->humidity){ put_varint(out, zigzag(v - prev)); prev = v; }
+            prev = 0;
+            for(auto &c : e.second) for(int32_t v : c->term){ put_varint(out, zigzag(v - prev)); prev = v; }
+        }
+        put_u32(out, crc32c(out.data(), out.size()));
+        return out;
+    }
+
+    // 3 for the current layout, 2 for "SNP2", 1 for "SNAP", 0 if blob is no snapshot at all
+    static int version(std::string_view blob){
+        if(blob.size() < 8) return 0;
+        uint32_t magic = get_u32(blob.data());
+        if(magic == SNAPSHOT_MAGIC) return 3;
+        return magic == SNAPSHOT_MAGIC_V2 ? 2 : magic == SNAPSHOT_MAGIC_V1 ? 1 : 0;
+    }
+
+    // reads the index and term of an encoded snapshot without decoding it
+    static bool peek(std::string_view blob, int &index, int &term){
+        if(version(blob) == 0) return false;
+        WireReader r(blob.data() + 4, blob.size() - 4);
+        index = r.varint();
+        term = r.varint();
+        return r.ok;
+    }
+
+    // replaces the whole state with an encoded snapshot; false (state untouched) if it is damaged
+    bool restore(std::string_view blob){
+        int v = version(blob);
+        if(v == 0) return false;
+        if(crc32c(blob.data(), blob.size() - 4) != get_u32(blob.data() + blob.size() - 4)) return false;
+        WireReader r(blob.data() + 4, blob.size() - 8);
+
+        StateMachine fresh;
+        fresh.appliedIndex = r.varint();
+        fresh.appliedTerm = r.varint();
+        int hb = r.varint();
+        for(int i = 0; i < hb && r.ok; i++){
+            int node = unzigzag(r.varint());
+            int count = r.varint();
+            fresh.aggs[node].heartbeats = count;
+            fresh.cluster.heartbeats += count;
+        }
+        // older layouts carry no timestamps; their readings are stamped with the restore time
+        int64_t legacyTs = wallClockMs();
+        if(v == 1){
+            uint32_t n = r.varint();
+            for(uint32_t i = 0; i < n && r.ok; i++){
+                int node = unzigzag(r.varint());
+                int temp = unzigzag(r.varint());
+                int hum = unzigzag(r.varint());
+                int term = r.varint();
+                fresh.addReading(node, saturate_int16(temp), saturate_int16(hum), term, legacyTs);
             }
         }
+        int nodes = v == 1 ? 0 : r.varint();
+        std::vector<int> temp, hum, term;
+        std::vector<int64_t> ts;
+        for(int i = 0; i < nodes && r.ok; i++){
+            int node = unzigzag(r.varint());
+            uint32_t count = r.varint();
+            // every value takes at least one byte, which bounds a corrupt count
+            if(!r.ok || count > r.left / (v == 3 ? 4 : 3)) return false;
+            ts.assign(count, legacyTs);
+            int64_t prevTs = 0;
+            if(v == 3) for(uint32_t j = 0; j < count; j++) prevTs = ts[j] = prevTs + (int64_t)r.varint64();
+            for(auto *col : {&temp, &hum, &term}){
+                col->resize(count);
+                int prev = 0;
+                for(uint32_t j = 0; j < count; j++) prev = (*col)[j] = prev + unzigzag(r.varint());
+            }
+            for(uint32_t j = 0; j < count; j++){
+                if(!fits_int16(temp[j]) || !fits_int16(hum[j])) return false;
+                fresh.addReading(node, temp[j], hum[j], term[j], ts[j]);
+            }
+        }
+        if(!r.ok) return false;
+
+        std::lock_guard<std::mutex> lock(mu);
+        series.swap(fresh.series);
+        aggs.swap(fresh.aggs);
+        std::swap(cluster, fresh.cluster);
+        appliedIndex = fresh.appliedIndex;
+        appliedTerm = fresh.appliedTerm;
+        return true;
     }
 
+    // every reading, grouped by node and oldest first within a node
     std::vector<SensorReading> getAllReadings() {
         std::lock_guard<std::mutex> lock(mu);
-        return sensorData;
+        std::vector<SensorReading> res;
+        res.reserve(cluster.readings());
+        for(auto &e : series)
+            e.second.scan(e.first, 0, e.second.count, [&](const SensorReading &r){ res.push_back(r); });
+        return res;
     }
 
     std::vector<SensorReading> getSensorReadingsByNode(int nid) {
+        return getLastReadings(nid, SIZE_MAX, nullptr);
+    }
+
+    // the newest n readings of a node, oldest first; total receives the node's count
+    std::vector<SensorReading> getLastReadings(int nid, size_t n, size_t *total) {
+        std::lock_guard<std::mutex> lock(mu);
+        std::vector<SensorReading> res;
+        auto it = series.find(nid);
+        size_t count = it == series.end() ? 0 : it->second.count;
+        if(total) *total = count;
+        size_t from = count > n ? count - n : 0;
+        res.reserve(count - from);
+        if(count) it->second.scan(nid, from, count, [&](const SensorReading &r){ res.push_back(r); });
+        return res;
+    }
+
+    // One page of the node's readings with t0 <= ts <= t1, oldest first: at most limit
+    // of them, starting at position cursor (0 for the first page). next receives the
+    // cursor of the following page, or 0 once the range is exhausted. Positions never
+    // move, so a cursor stays valid while new readings arrive.
+    std::vector<SensorReading> getRange(int nid, int64_t t0, int64_t t1, size_t cursor, size_t limit, size_t &next) {
         std::lock_guard<std::mutex> lock(mu);
         std::vector<SensorReading> res;
-        for(auto &r : sensorData)
-            if(r.node_id == nid) res.push_back(r);
+        next = 0;
+        auto it = series.find(nid);
+        if(it == series.end() || t1 < t0) return res;
+        const NodeSeries &ns = it->second;
+        size_t from = std::max(cursor, ns.lowerBound(t0));
+        size_t to = t1 == INT64_MAX ? ns.count : ns.lowerBound(t1 + 1);
+        if(from >= to) return res;
+        if(to - from > limit){
+            to = from + limit;
+            next = to;
+        }
+        res.reserve(to - from);
+        ns.scan(nid, from, to, [&](const SensorReading &r){ res.push_back(r); });
+        return res;
+    }
+
+    // One page of the newest reading of every node that has reported at or after t0,
+    // by node id from cursor up. next receives the node id the following page starts
+    // at, or INT_MIN once every node has been covered.
+    std::vector<SensorReading> getLatest(int64_t t0, int cursor, size_t limit, int &next) {
+        std::lock_guard<std::mutex> lock(mu);
+        std::vector<SensorReading> res;
+        next = INT_MIN;
+        for(auto it = series.lower_bound(cursor); it != series.end(); ++it){
+            const NodeSeries &ns = it->second;
+            if(ns.count == 0 || ns.lastTs < t0) continue;
+            if(res.size() == limit){
+                next = it->first;
+                break;
+            }
+            size_t off;
+            res.push_back(ns.locate(ns.count - 1, off).at(it->first, off));
+        }
         return res;
     }
 
     std::map<int,int> getReadingsPerNode() {
         std::lock_guard<std::mutex> lock(mu);
         std::map<int,int> m;
-        for(auto &r : sensorData) m[r.node_id]++;
+        for(auto &e : series) m[e.first] = e.second.count;
         return m;
     }
 
     std::map<int,int> getAllHeartbeats() {
         std::lock_guard<std::mutex> lock(mu);
-        return heartbeatCount;
+        std::map<int,int> m;
+        for(auto &a : aggs) if(a.second.heartbeats) m[a.first] = a.second.heartbeats;
+        return m;
     }
 
     int getTotalReadings() {
         std::lock_guard<std::mutex> lock(mu);
-        return sensorData.size();
+        return cluster.readings();
+    }
+
+    // per-node reading and heartbeat counts plus the cluster totals, in one pass over
+    // the nodes and without touching any reading
+    std::vector<NodeCounts> getNodeCounts(NodeCounts &total) {
+        std::lock_guard<std::mutex> lock(mu);
+        std::vector<NodeCounts> res;
+        res.reserve(aggs.size());
+        for(auto &a : aggs) res.push_back(NodeCounts{a.first, a.second.readings(), a.second.heartbeats});
+        total = NodeCounts{-1, cluster.readings(), cluster.heartbeats};
+        return res;
+    }
+
+    // false if nothing was ever applied for this node
+    bool getAggregate(int nid, AggregateSummary &out) {
+        std::lock_guard<std::mutex> lock(mu);
+        auto it = aggs.find(nid);
+        if(it == aggs.end()) return false;
+        out = summarize(it->second);
+        return true;
+    }
+
+    AggregateSummary getClusterAggregate() {
+        std::lock_guard<std::mutex> lock(mu);
+        return summarize(cluster);
+    }
+
+    // the cluster-wide moments and sketches themselves, for merging across Raft groups
+    SensorAggregate getClusterStats() {
+        std::lock_guard<std::mutex> lock(mu);
+        return cluster;
+    }
+
+    static AggregateSummary summarize(const SensorAggregate &a){
+        return AggregateSummary{a.readings(), a.heartbeats, a.temperature.summary(), a.humidity.summary()};
     }
 };
 
@@ -125,7 +593,16 @@ class Raft{
 private:
     int me;
     int listen_port;
+    int groupId;                    // Raft group on a server hosting several, -1 if it hosts one
+    std::string logName;            // "[Raft <id>]", with the group when there is one
     std::vector<std::string> peer_addrs;
+    // Learners get the log and apply it but never vote, stand for election or count
+    // toward a quorum, so they add read capacity without raising the majority
+    bool learner;                   // this server is one
+    std::vector<int> peerVoter;     // parallel to peer_addrs, 0 for a learner
+    int votingPeers;
+    std::unique_ptr<Transport> transport;
+    Clock *clk;
 
     int currentterm;
     int votedfor;
@@ -134,324 +611,1551 @@ private:
     int commitindex;
     int lastapplied;
 
+    // the apply thread sleeps on applyCv until commitindex passes lastapplied
+    std::condition_variable applyCv;
+    int maxApplyLag;
+    long long applyBatches;
+    long long appliedEntries;
+
+    // compaction: logs[0] holds index snapshotIndex + 1; everything up to
+    // snapshotIndex lives only in the snapshot
+    int snapshotIndex;
+    int snapshotTerm;
+    std::shared_ptr<const std::string> snapshotBlob;    // encoded, for InstallSnapshot
+    int snapshotEvery;
+    bool snapshotting;
+    std::thread snapThread;
+    std::condition_variable snapCv;
+    std::string installBuf;     // follower: chunks of a snapshot being received
+    int installIndex;
+    int installTerm;
+
+    // leader-only replication progress, parallel to peer_addrs
+    std::vector<int> nextIndex;
+    std::vector<int> matchIndex;
+    std::vector<std::chrono::steady_clock::time_point> ackSent;    // send time of the newest request each peer acked this term
+    std::vector<int> sentCommit;    // leaderCommit in the last AppendEntries to each peer
+
+    // reads that skip the log
+    int leaderId;                   // -1 until someone wins (or is heard from in) this term
+    int termStartIndex;             // leader: index of this term's no-op entry
+    std::vector<int> peerIds;       // server id behind each peer address, -1 until learned
+    std::vector<std::chrono::steady_clock::time_point> probeAt;
+    std::mutex hintMutex;           // guards hint alone: replies are built in callbacks run under mu
+    std::string hint;               // " leader=<host:port> term=<t>" for not_leader replies
+    std::deque<ReadWaiter> reads;   // ordered by seq, and so by deadline
+    bool readsDirty;
+    uint64_t nextReadSeq;
+    bool readIndexInFlight;
+
+    // Leadership transfer: new writes are refused while the target catches up, then it
+    // gets TimeoutNow and starts an election at once, one its voters do not resist
+    int transferTarget;             // peer index, -1 when no transfer is running
+    bool timeoutNowSent;
+    // the lease stays off until a quorum acks a request sent after this; set when a
+    // transfer that sent TimeoutNow fails, since the target may still win an election
+    std::chrono::steady_clock::time_point leaseFloor;
+    std::chrono::steady_clock::time_point transferDeadline;
+    std::vector<std::function<void(TransferResult)>> transferWaiters;
+    int handoffTo;                  // peer index clients are pointed at until a new leader is heard
+    bool transferElection;          // this server's current candidacy came from TimeoutNow
+
+    // one sender thread per peer so a slow or dead peer only delays itself
+    std::vector<std::thread> peerThreads;
+    std::condition_variable peerCv;
+    std::vector<int> inFlight;          // an exchange with the peer is outstanding
+    std::vector<int> voteRequested;     // term of the last ReqVote sent to each peer
+    std::vector<long long> preVoteRequested;    // pre-vote round last asked of each peer
+    std::vector<std::chrono::steady_clock::time_point> nextSend;
+    std::vector<std::chrono::steady_clock::time_point> retryAt;
+    std::vector<int> snapSentIndex;     // snapshot being streamed to each peer
+    std::vector<int> snapOffset;        // and how much of it the peer holds
+    int votesGranted;
+    int preVotesGranted;
+    long long preVoteRound;
+    // Election timeouts follow the gap between contacts with the leader: as a follower,
+    // between its AppendEntries; as leader, from sending one request to a peer until
+    // the ack of the next. Slow heartbeats under load then stretch the timeout instead
+    // of triggering elections.
+    LatencyEstimator heartbeatGap;
+    int heartbeatFrom;                  // leader the last contact came from
+    std::chrono::steady_clock::time_point lastLeaderContact;
+
+    // group commit: entries past releasedIndex wait until a batch fills or its timer fires
+    std::deque<CommitWaiter> waiters;   // ordered by index
+    std::condition_variable timerCv;
+    int releasedIndex;
+    int groupMaxBatch;
+    int groupMaxWaitUs;
+    bool batchArmed;
+    std::chrono::steady_clock::time_point batchDeadline;
+
+    // durability: nothing is acked or voted on until the WAL holds it
+    std::unique_ptr<Wal> wal;
+    std::thread walThread;
+    std::condition_variable walCv;
+    bool walDirty;
+    int walSyncMs;
+    int durableIndex;       // local log prefix known to be in the WAL
+    int walTruncGen;        // bumped when a conflicting suffix is overwritten
+    std::vector<std::pair<RpcAnswerFn, std::string>> durableReplies;  // sent after the next sync
+
     role role1;
     std::mutex mu;
     std::thread raftThread;
     std::thread applyThread;
     std::atomic<bool> stopflag;
     std::chrono::steady_clock::time_point lastHeartbeat;
+    int electionTimeout;                    // ms, drawn afresh after every timeout
     std::mt19937 rng;
 
-    int totalMessages;
-    int totalElections;
-    std::vector<long long> electionTimes;
+    Counter totalMessages;                  // peer RPCs served
+    Counter totalElections;
+    Counter preVoteRounds;
+    Counter candidacies;
+    Counter quorumLossStepDowns;
+    Histogram electionWindows;              // µs, every win, where electionTimes keeps the latest
+    std::vector<std::unique_ptr<Histogram>> peerRtt;    // µs per answered request, parallel to peer_addrs
 
-    std::mutex metricsMutex;
+    std::mutex metricsMutex;                // guards electionTimes
+    std::vector<long long> electionTimes;   // unavailability windows in ms, see ElectionStats
 
     StateMachine stateMachine;
 
 public:
     Raft(int id, int port, const std::vector<std::string>& peers)
-      : me(id), listen_port(port), peer_addrs(peers),
+      : me(id), listen_port(port), groupId(-1), logName("[Raft " + std::to_string(id) + "]"),
+        peer_addrs(peers), learner(false), peerVoter(peers.size(), 1), votingPeers(peers.size()),
+        transport(new TcpTransport(peers)), clk(&systemClock()),
         currentterm(0), votedfor(-1),
-        commitindex(0), lastapplied(0),
-        role1(role::Follower), stopflag(false),
-        totalMessages(0), totalElections(0)
+        commitindex(0), lastapplied(0), maxApplyLag(0), applyBatches(0), appliedEntries(0),
+        snapshotIndex(0), snapshotTerm(0), snapshotEvery(SNAPSHOT_EVERY), snapshotting(false),
+        installIndex(0), installTerm(0),
+        leaderId(-1), termStartIndex(0), hint(" term=0"), readsDirty(false), nextReadSeq(0), readIndexInFlight(false),
+        transferTarget(-1), timeoutNowSent(false), handoffTo(-1), transferElection(false),
+        votesGranted(0), preVotesGranted(0), preVoteRound(0), heartbeatFrom(-1),
+        releasedIndex(0), groupMaxBatch(GROUP_COMMIT_MAX_BATCH),
+        groupMaxWaitUs(GROUP_COMMIT_MAX_WAIT_US), batchArmed(false),
+        walDirty(false), walSyncMs(WAL_SYNC_INTERVAL_MS), durableIndex(0), walTruncGen(0),
+        role1(role::Follower), stopflag(false)
     {
+        for(size_t i = 0; i < peer_addrs.size(); i++) peerRtt.emplace_back(new Histogram());
+        inFlight.assign(peer_addrs.size(), 0);
+        voteRequested.assign(peer_addrs.size(), 0);
+        preVoteRequested.assign(peer_addrs.size(), 0);
+        nextSend.assign(peer_addrs.size(), std::chrono::steady_clock::time_point());
+        retryAt.assign(peer_addrs.size(), std::chrono::steady_clock::time_point());
+        snapSentIndex.assign(peer_addrs.size(), 0);
+        snapOffset.assign(peer_addrs.size(), 0);
+        peerIds.assign(peer_addrs.size(), -1);
+        probeAt.assign(peer_addrs.size(), std::chrono::steady_clock::time_point());
         rng.seed(std::random_device{}());
-        lastHeartbeat = std::chrono::steady_clock::now();
+        lastHeartbeat = clk->now();
+        lastLeaderContact = lastHeartbeat;
+        electionTimeout = drawElectionTimeout();
     }
 
     ~Raft() { stop(); }
 
+    // log indices are 1-based; index 0 is the empty prefix with term 0. Terms of
+    // compacted entries below snapshotIndex are unknown (-1)
+    int lastLogIndex() const { return snapshotIndex + logs.size(); }
+    int logTermAt(int idx) const {
+        if(idx > snapshotIndex) return logs[idx-snapshotIndex-1].term;
+        return idx == snapshotIndex ? snapshotTerm : -1;
+    }
+    const Log &entryAt(int idx) const { return logs[idx-snapshotIndex-1]; }
+    int majority() const { return (votingPeers+1)/2 + 1; }
+
+    // applied entries between automatic snapshots; 0 turns snapshots off
+    void setSnapshotEvery(int n){
+        std::lock_guard<std::mutex> lk(mu);
+        snapshotEvery = std::max(0, n);
+    }
+
+    // The simulator's hooks, all to be called before start() or poll(): peers reached
+    // through t instead of TCP, time read from c, and a fixed seed for the election
+    // timeouts so that a run can be replayed.
+    void setTransport(std::unique_ptr<Transport> t){
+        std::lock_guard<std::mutex> lk(mu);
+        transport = std::move(t);
+    }
+
+    void setClock(Clock *c){
+        std::lock_guard<std::mutex> lk(mu);
+        clk = c;
+        lastHeartbeat = lastLeaderContact = clk->now();
+    }
+
+    void setSeed(uint32_t seed){
+        std::lock_guard<std::mutex> lk(mu);
+        rng.seed(seed);
+        electionTimeout = drawElectionTimeout();
+    }
+
+    // Makes this Raft group g of several on the server: its requests to peers are
+    // tagged so they reach the same group there, and its metrics carry the group
+    void setGroup(int g){
+        std::lock_guard<std::mutex> lk(mu);
+        groupId = g;
+        logName = "[Raft " + std::to_string(me) + " group " + std::to_string(g) + "]";
+        transport->setGroup(g);
+    }
+
+    // Membership, to be set before start() or poll(): this server is a learner, or
+    // peer i is one. Every server must agree on who the voters are.
+    void setLearner(bool on){
+        std::lock_guard<std::mutex> lk(mu);
+        learner = on;
+    }
+
+    void setPeerLearner(size_t i){
+        std::lock_guard<std::mutex> lk(mu);
+        if(i >= peerVoter.size() || !peerVoter[i]) return;
+        peerVoter[i] = 0;
+        votingPeers--;
+    }
+
+    bool isLearner(){
+        std::lock_guard<std::mutex> lk(mu);
+        return learner;
+    }
+
+    void setGroupCommit(int maxBatch, int maxWaitUs){
+        std::lock_guard<std::mutex> lk(mu);
+        groupMaxBatch = std::max(1, maxBatch);
+        groupMaxWaitUs = std::max(0, maxWaitUs);
+    }
+
+    // Replays the WAL in dir into the log, hard state and state machine. Call before
+    // start(); without it the server keeps everything in memory as before.
+    bool openWal(const std::string &dir, WalSync policy, int syncMs){
+        using namespace std::chrono;
+        auto t0 = steady_clock::now();
+        std::unique_ptr<Wal> w(new Wal(dir, policy));
+        WalRecovery r;
+        if(!w->recover(r)) return false;
+        auto t1 = steady_clock::now();
+
+        std::lock_guard<std::mutex> lk(mu);
+        if(!r.snapshot.empty()){
+            if(StateMachine::version(r.snapshot) == 0){
+                std::cerr << "ERROR: snapshot at index " << r.base << " has an unsupported version" << std::endl;
+                return false;
+            }
+            if(!stateMachine.restore(r.snapshot)){
+                std::cerr << "ERROR: snapshot at index " << r.base << " is corrupt" << std::endl;
+                return false;
+            }
+            snapshotBlob = std::make_shared<const std::string>(std::move(r.snapshot));
+        }
+        wal = std::move(w);
+        walSyncMs = std::max(1, syncMs);
+        snapshotIndex = r.base;
+        snapshotTerm = r.baseTerm;
+        logs = std::move(r.logs);
+        currentterm = r.term;
+        votedfor = r.vote;
+        publishLeader();
+        commitindex = r.commit;
+        durableIndex = lastLogIndex();
+        for(int i = snapshotIndex + 1; i <= commitindex; i++) stateMachine.apply(i, entryAt(i));
+        lastapplied = commitindex;
+        auto t2 = steady_clock::now();
+
+        std::cout << logName << " WAL recovered snapshot@" << snapshotIndex << " + " << logs.size() << " entries ("
+                  << r.bytes << " bytes in " << r.segments << " segments) term=" << currentterm
+                  << " commit=" << commitindex << " replay=" << duration_cast<milliseconds>(t1 - t0).count()
+                  << "ms apply=" << duration_cast<milliseconds>(t2 - t1).count() << "ms" << std::endl;
+        return true;
+    }
+
+    // caller holds mu; buffers log entries [from, lastLogIndex()] for the WAL
+    void persistEntries(int from){
+        if(!wal) return;
+        for(int i = std::max(from, snapshotIndex + 1); i <= lastLogIndex(); i++) wal->appendEntry(i, entryAt(i));
+        walDirty = true;
+        walCv.notify_one();
+    }
+
+    // caller holds mu
+    void persistState(){
+        if(!wal) return;
+        wal->setState(currentterm, votedfor);
+        walDirty = true;
+        walCv.notify_one();
+    }
+
+    // caller holds mu; the leader counts itself toward a quorum only for what it has on disk
+    int selfMatchIndex() const { return wal ? durableIndex : lastLogIndex(); }
+
+    // Follower side of persistence: makes everything this RPC changed durable before
+    // the reply goes out. Runs without mu so other RPCs are not stalled on the fsync.
+    void syncBeforeReply(){
+        if(!wal) return;
+        int idx, gen;
+        {
+            std::lock_guard<std::mutex> lk(mu);
+            idx = lastLogIndex();
+            gen = walTruncGen;
+        }
+        wal->sync();
+        std::lock_guard<std::mutex> lk(mu);
+        if(gen == walTruncGen) durableIndex = std::max(durableIndex, idx);
+    }
+
+    // The same guarantee for callers that must not block: out goes to reply from
+    // walloop() once the sync covering this RPC is done. Replies still pending at
+    // stop() are dropped with their connections.
+    void replyWhenDurable(RpcAnswerFn reply, std::string out){
+        if(!wal){
+            reply(std::move(out));
+            return;
+        }
+        std::lock_guard<std::mutex> lk(mu);
+        durableReplies.emplace_back(std::move(reply), std::move(out));
+        walDirty = true;
+        walCv.notify_one();
+    }
+
+    // caller holds mu
+    void stepDown(int term){
+        if(role1 == role::Leader) lastLeaderContact = clk->now();
+        currentterm = term;
+        role1 = role::Follower;
+        votedfor = -1;
+        leaderId = -1;
+        heartbeatFrom = -1;
+        publishLeader();
+        batchArmed = false;
+        persistState();
+        failWaiters(AppendResult::NotLeader);
+        wakeReads();
+        if(transferTarget >= 0) finishTransfer(timeoutNowSent ? TransferResult::Done : TransferResult::NotLeader);
+    }
+
+    // caller holds mu; ends the running transfer. Unless it succeeded, clients are no
+    // longer pointed at the target.
+    void finishTransfer(TransferResult res){
+        if(timeoutNowSent && res != TransferResult::Done) leaseFloor = clk->now();
+        transferTarget = -1;
+        timeoutNowSent = false;
+        if(res != TransferResult::Done) handoffTo = -1;
+        publishLeader();
+        std::vector<std::function<void(TransferResult)>> done;
+        done.swap(transferWaiters);
+        for(auto &d : done) d(res);
+    }
+
+    // caller holds mu. CheckQuorum: a leader that has not heard from a majority for as
+    // long as a follower would wait before an election stops taking writes, so clients
+    // move to whoever the majority side elects. The term and vote stay as they are.
+    void loseLeadership(){
+        auto now = clk->now();
+        role1 = role::Follower;
+        leaderId = -1;
+        publishLeader();
+        batchArmed = false;
+        lastHeartbeat = now;
+        lastLeaderContact = now;
+        failWaiters(AppendResult::NotLeader);
+        wakeReads();
+        if(transferTarget >= 0) finishTransfer(TransferResult::NotLeader);
+        quorumLossStepDowns.add();
+        std::cout << logName << " lost quorum, stepping down term=" << currentterm << std::endl;
+    }
+
+    // caller holds mu; the lower end of the randomized election timeout: three smoothed
+    // heartbeat gaps plus four deviations, within [ELECTION_TIMEOUT_MIN_MS, _CAP_MS]
+    int electionTimeoutMs(){
+        if(!heartbeatGap.primed) return ELECTION_TIMEOUT_MIN_MS;
+        double t = 3 * heartbeatGap.smoothed + 4 * heartbeatGap.deviation;
+        return std::max(ELECTION_TIMEOUT_MIN_MS, std::min(ELECTION_TIMEOUT_CAP_MS, (int)t));
+    }
+
+    // caller holds mu; a follower heard from leader id. Gaps are only measured between
+    // contacts with the same leader, so an election in between is never a sample.
+    void noteLeaderContact(int id){
+        auto now = clk->now();
+        if(id == heartbeatFrom)
+            heartbeatGap.add(std::chrono::duration<double, std::milli>(now - lastLeaderContact).count());
+        heartbeatFrom = id;
+        lastLeaderContact = now;
+    }
+
+    // caller holds mu
+    void startPreVote(){
+        role1 = role::PreCandidate;
+        leaderId = -1;
+        heartbeatFrom = -1;     // the gap that timed out is not a heartbeat gap
+        publishLeader();
+        preVoteRound++;
+        preVotesGranted = 1;
+        preVoteRounds.add();
+        if(preVotesGranted >= majority()) startElection();
+    }
+
+    // caller holds mu
+    void startElection(bool transfer = false){
+        transferElection = transfer;
+        role1 = role::Candidate;
+        currentterm++;
+        votedfor = me;
+        leaderId = -1;
+        publishLeader();
+        persistState();
+        votesGranted = 1;
+        lastHeartbeat = clk->now();
+        candidacies.add();
+        if(votesGranted >= majority()) becomeLeader();
+        peerCv.notify_all();
+    }
+
+    // caller holds mu
+    void setLeader(int id){
+        if(id == leaderId) return;
+        leaderId = id;
+        if(id >= 0) handoffTo = -1;
+        publishLeader();
+    }
+
+    // caller holds mu; the address is known once a probe has matched the leader's id to
+    // one of peer_addrs, which clients can dial since peers and clients share a port
+    // During a transfer, and after it until the new leader is heard from, clients are
+    // sent to the target.
+    void publishLeader(){
+        std::string h;
+        if((leaderId < 0 || leaderId == me) && handoffTo >= 0) h = " leader=" + peer_addrs[handoffTo];
+        else for(size_t i = 0; i < peerIds.size(); i++)
+            if(leaderId >= 0 && leaderId != me && peerIds[i] == leaderId) h = " leader=" + peer_addrs[i];
+        h += " term=" + std::to_string(currentterm);
+        std::lock_guard<std::mutex> lk(hintMutex);
+        hint = std::move(h);
+    }
+
+    // caller holds mu
+    void completeWaiters(){
+        while(!waiters.empty() && waiters.front().index <= commitindex){
+            CommitWaiter w = std::move(waiters.front());
+            waiters.pop_front();
+            w.done(logTermAt(w.index) == w.term ? AppendResult::Committed : AppendResult::NotLeader);
+        }
+    }
+
+    // caller holds mu
+    void failWaiters(AppendResult why){
+        std::deque<CommitWaiter> failed;
+        failed.swap(waiters);
+        for(auto &w : failed) w.done(why);
+    }
+
+    // caller holds mu; lets the peer senders ship everything appended so far
+    void releaseBatch(){
+        batchArmed = false;
+        releasedIndex = lastLogIndex();
+        advanceCommitIndex();
+        peerCv.notify_all();
+    }
+
+    // caller holds mu
+    // A new leader appends a no-op right away: entries from earlier terms only commit
+    // behind one from the current term, and until it commits the leader cannot know
+    // the commit index a read has to wait for.
+    void becomeLeader(){
+        role1 = role::Leader;
+        leaderId = me;
+        handoffTo = -1;
+        publishLeader();
+        lastHeartbeat = clk->now();
+        int64_t ts = clk->wallMs();
+        if(!logs.empty()) ts = std::max(ts, logs.back().ts);
+        logs.emplace_back(currentterm, NOOP_COMMAND, ts);
+        termStartIndex = lastLogIndex();
+        persistEntries(termStartIndex);
+        releasedIndex = lastLogIndex();
+        batchArmed = false;
+        nextIndex.assign(peer_addrs.size(), termStartIndex);
+        matchIndex.assign(peer_addrs.size(), 0);
+        ackSent.assign(peer_addrs.size(), std::chrono::steady_clock::time_point());
+        sentCommit.assign(peer_addrs.size(), 0);
+        nextSend.assign(peer_addrs.size(), std::chrono::steady_clock::time_point());
+        retryAt.assign(peer_addrs.size(), std::chrono::steady_clock::time_point());
+        snapSentIndex.assign(peer_addrs.size(), 0);
+        snapOffset.assign(peer_addrs.size(), 0);
+        totalElections.add();
+        electionWindows.record(std::chrono::duration_cast<std::chrono::microseconds>(lastHeartbeat - lastLeaderContact).count());
+        {
+            std::lock_guard<std::mutex> mm(metricsMutex);
+            electionTimes.push_back(std::chrono::duration_cast<std::chrono::milliseconds>(lastHeartbeat - lastLeaderContact).count());
+            if(electionTimes.size() > ELECTION_HISTORY) electionTimes.erase(electionTimes.begin());
+        }
+        advanceCommitIndex();
+        peerCv.notify_all();
+        wakeReads();
+        std::cout << logName << " BECAME LEADER term=" << currentterm << std::endl;
+    }
+
+    // caller holds mu; the newest time at which a majority, counting this leader, is
+    // known to have still followed it: the send time of the request each peer acked
+    std::chrono::steady_clock::time_point quorumContact(){
+        auto now = clk->now();
+        int need = majority() - 1;
+        if(need <= 0) return now;
+        std::vector<std::chrono::steady_clock::time_point> t;
+        for(size_t i = 0; i < ackSent.size(); i++) if(peerVoter[i]) t.push_back(ackSent[i]);
+        std::nth_element(t.begin(), t.begin() + (need - 1), t.end(), std::greater<std::chrono::steady_clock::time_point>());
+        return t[need - 1];
+    }
+
+    // caller holds mu. A transfer suspends the lease: the target's voters ignore the
+    // stickiness the lease relies on. After a failed one it returns only with acks to
+    // requests sent later, as the votes for the target may predate them.
+    bool leaseHolds(std::chrono::steady_clock::time_point now){
+        auto contact = quorumContact();
+        return transferTarget < 0 && contact > leaseFloor && contact >= now - std::chrono::milliseconds(READ_LEASE_MS);
+    }
+
+    // caller holds mu; peer i answered a request of this term sent at `sent`
+    void noteAck(size_t i, std::chrono::steady_clock::time_point sent){
+        if(ackSent[i] != std::chrono::steady_clock::time_point())
+            heartbeatGap.add(std::chrono::duration<double, std::milli>(clk->now() - ackSent[i]).count());
+        if(sent > ackSent[i]) ackSent[i] = sent;
+        if(!reads.empty()) wakeReads();
+    }
+
+    // caller holds mu; true while a leader is known to be alive. Such a server ignores
+    // vote requests, which is what makes a leader's READ_LEASE_MS lease safe: no
+    // majority can elect anyone else until it has gone ELECTION_TIMEOUT_MIN_MS unheard.
+    bool leaderRecentlyHeard(){
+        using namespace std::chrono;
+        auto now = clk->now();
+        if(role1 == role::Leader) return now - quorumContact() < milliseconds(ELECTION_TIMEOUT_MIN_MS);
+        return leaderId >= 0 && now - lastHeartbeat < milliseconds(ELECTION_TIMEOUT_MIN_MS);
+    }
+
+    // caller holds mu; has the apply thread re-check the waiting reads
+    void wakeReads(){
+        readsDirty = true;
+        applyCv.notify_one();
+    }
+
+    // caller holds mu; moves every read that is now ready, failed or expired into out
+    void takeReads(ServedReads &out){
+        if(reads.empty()) return;
+        auto now = clk->now();
+        bool leader = role1 == role::Leader;
+        auto contact = leader ? quorumContact() : std::chrono::steady_clock::time_point();
+        for(auto it = reads.begin(); it != reads.end(); ){
+            ReadWaiter &w = *it;
+            bool finished = true;
+            ReadResult res = ReadResult::Ok;
+            if(w.leaderRead && (!leader || currentterm != w.term)) res = ReadResult::NotLeader;
+            else {
+                if(w.leaderRead && !w.confirmed && contact >= w.after) w.confirmed = true;
+                if(w.confirmed && lastapplied >= w.index) res = ReadResult::Ok;
+                else if(now >= w.deadline) res = ReadResult::TimedOut;
+                else finished = false;
+            }
+            if(finished){
+                out.emplace_back(std::move(w.done), res);
+                it = reads.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    // caller holds mu; only entries from the current term are committed by counting replicas
+    void advanceCommitIndex(){
+        for(int n = lastLogIndex(); n > commitindex; n--){
+            if(logTermAt(n) != currentterm) break;
+            int acks = selfMatchIndex() >= n ? 1 : 0;
+            for(size_t i = 0; i < matchIndex.size(); i++) if(peerVoter[i] && matchIndex[i] >= n) acks++;
+            if(acks >= majority()){
+                setCommitIndex(n);
+                completeWaiters();
+                break;
+            }
+        }
+    }
+
+    // caller holds mu; commit only moves forward, and each step wakes the apply thread
+    // and (on a leader) the peer senders, which pass it on without waiting for the next
+    // heartbeat so follower reads waiting on it are not held up
+    void setCommitIndex(int n){
+        if(n <= commitindex) return;
+        commitindex = n;
+        if(wal) wal->setCommit(commitindex);
+        applyCv.notify_one();
+        if(role1 == role::Leader) peerCv.notify_all();
+    }
+
+    // Applies committed entries in batches: each wakeup copies the whole committed
+    // range (up to APPLY_MAX_BATCH) out of the log under mu, then hands it to the state
+    // machine in one call with mu released, so appends and replication carry on.
+    // Reads waiting on leadership or on the apply index are served from here too, once
+    // per wakeup, with mu released.
     void applyCommittedEntries(){
+        std::vector<Log> batch;
+        ServedReads served;
+        std::unique_lock<std::mutex> lk(mu);
         while(!stopflag){
-            std::this_thread::sleep_for(std::chrono::milliseconds(20));
-            std::lock_guard<std::mutex> lk(mu);
-            while(lastapplied < commitindex && lastapplied < (int)logs.size()){
-                lastapplied++;
-                Log log = logs[lastapplied-1];
-                lk.~lock_guard();
-                stateMachine.apply(log);
-                new (&lk) std::lock_guard<std::mutex>(mu);
+            auto wake = reads.empty() ? clk->now() + std::chrono::hours(1) : reads.front().deadline;
+            applyCv.wait_until(lk, wake, [this]{
+                return stopflag || readsDirty || lastapplied < snapshotIndex ||
+                       (lastapplied < commitindex && lastapplied < lastLogIndex());
+            });
+            if(stopflag) break;
+            applyStep(lk, batch, served);
+        }
+    }
+
+    // caller holds lk on mu; one wakeup of the apply thread. batch and served are
+    // scratch space kept by the caller. True if anything was applied or answered.
+    bool applyStep(std::unique_lock<std::mutex> &lk, std::vector<Log> &batch, ServedReads &served){
+        bool busy = false;
+        readsDirty = false;
+        // an installed snapshot already covers everything up to snapshotIndex
+        if(lastapplied < snapshotIndex) lastapplied = snapshotIndex;
+        int first = lastapplied + 1;
+        int last = std::min(std::min(commitindex, lastLogIndex()), lastapplied + APPLY_MAX_BATCH);
+        if(first <= last){
+            maxApplyLag = std::max(maxApplyLag, commitindex - lastapplied);
+            batch.assign(logs.begin() + (first - snapshotIndex - 1), logs.begin() + (last - snapshotIndex));
+            lk.unlock();
+            stateMachine.applyBatch(first, batch);
+            batch.clear();
+            lk.lock();
+            // a snapshot installed meanwhile may have moved lastapplied further
+            lastapplied = std::max(lastapplied, last);
+            applyBatches++;
+            appliedEntries += last - first + 1;
+            busy = true;
+        }
+        takeReads(served);
+        if(!served.empty()){
+            lk.unlock();
+            for(auto &r : served) r.first(r.second);
+            served.clear();
+            lk.lock();
+            busy = true;
+        }
+        if(snapshotEvery > 0 && !snapshotting && lastapplied - snapshotIndex >= snapshotEvery){
+            snapshotting = true;
+            snapCv.notify_one();
+        }
+        return busy;
+    }
+
+    // caller holds mu; drops the log prefix a snapshot covers. The suffix is kept only
+    // if it continues the snapshot; otherwise the whole log is replaced.
+    bool compactTo(int index, int term, std::shared_ptr<const std::string> blob){
+        if(index <= snapshotIndex) return true;
+        bool keep = index <= lastLogIndex() && logTermAt(index) == term;
+        if(keep) logs.erase(logs.begin(), logs.begin() + (index - snapshotIndex));
+        else logs.clear();
+        snapshotIndex = index;
+        snapshotTerm = term;
+        snapshotBlob = std::move(blob);
+        durableIndex = std::max(durableIndex, index);
+        if(!keep) durableIndex = index;
+        return keep;
+    }
+
+    // Snapshots run on their own thread: the state machine is captured in one short
+    // critical section (chunk pointers, not readings), and encoding, the disk write
+    // and dropping the covered WAL segments all happen while apply() carries on.
+    void snaploop(){
+        std::unique_lock<std::mutex> lk(mu);
+        while(!stopflag){
+            snapCv.wait(lk, [this]{ return snapshotting || stopflag; });
+            if(stopflag) break;
+            takeSnapshot(lk);
+        }
+    }
+
+    // caller holds lk on mu and has set snapshotting
+    void takeSnapshot(std::unique_lock<std::mutex> &lk){
+        lk.unlock();
+        auto t0 = std::chrono::steady_clock::now();
+        StateSnapshot st = stateMachine.capture();
+        auto blob = std::make_shared<const std::string>(StateMachine::encode(st));
+        bool saved = !wal || wal->saveSnapshot(*blob, st.index, st.term);
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - t0).count();
+
+        lk.lock();
+        if(saved){
+            int before = lastLogIndex() - snapshotIndex;
+            compactTo(st.index, st.term, blob);
+            std::cout << logName << " snapshot@" << st.index << " " << blob->size() << " bytes in "
+                      << ms << "ms, log " << before << " -> " << logs.size() << " entries" << std::endl;
+        }
+        snapshotting = false;
+    }
+
+    // Leader side of persistence: writes out whatever the log gained since the last
+    // round in one batch, so the fsync overlaps with replication to the peers and every
+    // entry appended meanwhile rides on the same sync.
+    void walloop(){
+        using namespace std::chrono;
+        auto nextFlush = steady_clock::now() + milliseconds(walSyncMs);
+        std::unique_lock<std::mutex> lk(mu);
+        while(!stopflag){
+            if(!walDirty){
+                if(wal->syncPolicy() == WalSync::Interval) walCv.wait_until(lk, nextFlush);
+                else walCv.wait(lk);
+            }
+            bool work = walDirty;
+            walDirty = false;
+            int idx = lastLogIndex();
+            int gen = walTruncGen;
+            std::vector<std::pair<RpcAnswerFn, std::string>> replies;
+            replies.swap(durableReplies);
+            lk.unlock();
+
+            if(work) wal->sync();
+            auto now = steady_clock::now();
+            if(wal->syncPolicy() == WalSync::Interval && now >= nextFlush){
+                wal->flushInterval();
+                nextFlush = now + milliseconds(walSyncMs);
+            }
+            for(auto &r : replies) r.first(std::move(r.second));
+
+            lk.lock();
+            if(work && gen == walTruncGen && idx > durableIndex){
+                durableIndex = idx;
+                if(role1 == role::Leader) advanceCommitIndex();
             }
         }
     }
 
     bool start(){
+        if(wal) walThread = std::thread(&Raft::walloop, this);
+        snapThread = std::thread(&Raft::snaploop, this);
         raftThread = std::thread(&Raft::raftloop, this);
         applyThread = std::thread(&Raft::applyCommittedEntries, this);
+        for(size_t i = 0; i < peer_addrs.size(); i++)
+            peerThreads.emplace_back(&Raft::peerloop, this, i);
         return true;
     }
 
     void stop(){
-        stopflag = true;
+        {
+            std::lock_guard<std::mutex> lk(mu);
+            stopflag = true;
+        }
+        peerCv.notify_all();
+        timerCv.notify_all();
+        walCv.notify_all();
+        snapCv.notify_all();
+        applyCv.notify_all();
+        std::deque<ReadWaiter> unserved;
+        {
+            std::lock_guard<std::mutex> lk(mu);
+            failWaiters(AppendResult::NotLeader);
+            if(transferTarget >= 0) finishTransfer(TransferResult::NotLeader);
+            unserved.swap(reads);
+        }
+        for(auto &r : unserved) r.done(ReadResult::NotLeader);
         if(raftThread.joinable()) raftThread.join();
         if(applyThread.joinable()) applyThread.join();
+        if(walThread.joinable()) walThread.join();
+        if(snapThread.joinable()) snapThread.join();
+        for(auto &t : peerThreads) if(t.joinable()) t.join();
+        if(wal) wal->sync();
     }
 
-    
-    
-    std::string peerstring(const std::string &msg){
-        auto t = split_ws(msg);
-        if(t.empty()) return "ERR\n";
+    ReqVoteReply handleReqVote(const ReqVoteArgs &a){
+        ReqVoteReply r = voteLocked(a);
+        if(!a.preVote) syncBeforeReply();
+        return r;
+    }
 
-        
-        
-        if(t[0] == "ReqVote"){
-            int term = stoi(t[1]);
-            int candidate = stoi(t[2]);
-            int lastLogIndex = stoi(t[3]);
-            int lastLogTerm  = stoi(t[4]);
+    // caller holds mu
+    bool logUpToDate(const ReqVoteArgs &a){
+        int myLastIdx = lastLogIndex();
+        int myLastTerm = logTermAt(myLastIdx);
+        return (a.lastLogTerm > myLastTerm) ||
+               (a.lastLogTerm == myLastTerm && a.lastLogIndex >= myLastIdx);
+    }
 
-            std::lock_guard<std::mutex> lk(mu);
+    ReqVoteReply voteLocked(const ReqVoteArgs &a){
+        std::lock_guard<std::mutex> lk(mu);
+        if(learner) return ReqVoteReply{currentterm, false};
+
+        // a pre-vote changes nothing here; it is granted when the real vote would be
+        if(a.preVote)
+            return ReqVoteReply{currentterm, a.term > currentterm && !leaderRecentlyHeard() && logUpToDate(a)};
+
+        // not even the term is taken from a candidate while a live leader is known, unless
+        // that leader asked for the election
+        if(a.term > currentterm && leaderRecentlyHeard() && !a.transfer) return ReqVoteReply{currentterm, false};
+        if(a.term > currentterm) stepDown(a.term);
 
-            if(term > currentterm){
-                currentterm = term;
-                role1 = role::Follower;
-                votedfor = -1;
+        bool grant = false;
+
+        if(a.term >= currentterm &&
+          (votedfor == -1 || votedfor == a.candidate)){
+
+            if(logUpToDate(a)){
+                grant = true;
+                votedfor = a.candidate;
+                persistState();
+                lastHeartbeat = clk->now();
             }
+        }
 
-            bool grant = false;
+        return ReqVoteReply{currentterm, grant};
+    }
 
-            if(term >= currentterm &&
-              (votedfor == -1 || votedfor == candidate)){
+    AppendEntriesReply handleAppendEntries(AppendEntriesArgs &a){
+        AppendEntriesReply r = appendLocked(a);
+        syncBeforeReply();
+        return r;
+    }
 
-                int myLastIdx = logs.size();
-                int myLastTerm = (myLastIdx>0 ? logs[myLastIdx-1].term : 0);
+    AppendEntriesReply appendLocked(AppendEntriesArgs &a){
+        std::lock_guard<std::mutex> lk(mu);
+        AppendEntriesReply r{0, true, 0, 0};
+
+        if(a.term < currentterm){
+            r.success = false;
+        } else {
+            if(a.term > currentterm) stepDown(a.term);
+            lastHeartbeat = clk->now();
+            role1 = role::Follower;
+            setLeader(a.leader);
+            noteLeaderContact(a.leader);
+
+            // entries at or below our snapshot are committed, so they match by definition
+            if(a.prevIdx < snapshotIndex){
+                int skip = std::min((int)a.entries.size(), snapshotIndex - a.prevIdx);
+                a.entries.erase(a.entries.begin(), a.entries.begin() + skip);
+                a.prevIdx += skip;
+                if(a.prevIdx < snapshotIndex) a.entries.clear();
+                a.prevIdx = std::max(a.prevIdx, snapshotIndex);
+                a.prevTerm = snapshotTerm;
+            }
 
-                bool uptodate =
-                    (lastLogTerm > myLastTerm) ||
-                    (lastLogTerm == myLastTerm && lastLogIndex >= myLastIdx);
+            if(a.prevIdx > lastLogIndex()){
+                r.success = false;
+                r.conflictIndex = lastLogIndex() + 1;
+            }
+            else if(a.prevIdx > 0 && logTermAt(a.prevIdx) != a.prevTerm){
+                // hint the leader to skip the whole conflicting term in one round
+                r.success = false;
+                r.conflictTerm = logTermAt(a.prevIdx);
+                r.conflictIndex = a.prevIdx;
+                while(r.conflictIndex > snapshotIndex + 1 && logTermAt(r.conflictIndex-1) == r.conflictTerm) r.conflictIndex--;
+            }
 
-                if(uptodate){
-                    grant = true;
-                    votedfor = candidate;
-                    lastHeartbeat = std::chrono::steady_clock::now();
+            if(r.success){
+                int count = a.entries.size();
+                int firstNew = 0;
+                for(int i = 0; i < count; i++){
+                    int idx = a.prevIdx + 1 + i;
+
+                    if(idx <= lastLogIndex()){
+                        if(logTermAt(idx) == a.entries[i].term) continue;
+                        logs.erase(logs.begin() + (idx-snapshotIndex-1), logs.end());
+                        durableIndex = std::min(durableIndex, idx - 1);
+                        walTruncGen++;
+                    }
+                    if(firstNew == 0) firstNew = idx;
+                    logs.push_back(std::move(a.entries[i]));
                 }
-            }
+                if(firstNew > 0) persistEntries(firstNew);
 
-            std::ostringstream out;
-            out << "ReqVote_RESP " << currentterm << " " << (grant?1:0);
-            return out.str();
+                int lastNew = a.prevIdx + count;
+                setCommitIndex(std::min(a.leaderCommit, lastNew));
+            }
         }
 
-        
-        
-        if(t[0] == "AppendEntries"){
-            int term = stoi(t[1]);
-            int leader = stoi(t[2]);
-            int prevIdx = stoi(t[3]);
-            int prevTerm = stoi(t[4]);
-            int leaderCommit = stoi(t[5]);
-            int count = stoi(t[6]);
+        r.term = currentterm;
+        return r;
+    }
 
-            std::lock_guard<std::mutex> lk(mu);
-            bool success = true;
+    InstallSnapshotReply handleInstallSnapshot(InstallSnapshotArgs &a){
+        InstallSnapshotReply r = installLocked(a);
+        syncBeforeReply();
+        return r;
+    }
 
-            if(term < currentterm){
-                success = false;
-            } else {
-                if(term > currentterm){
-                    currentterm = term;
-                    role1 = role::Follower;
-                    votedfor = -1;
-                }
-                lastHeartbeat = std::chrono::steady_clock::now();
-                role1 = role::Follower;
+    // Collects snapshot chunks in order; on the last one replaces the state machine
+    // and the log. nextOffset tells the leader where to resume after a lost chunk.
+    InstallSnapshotReply installLocked(InstallSnapshotArgs &a){
+        std::lock_guard<std::mutex> lk(mu);
+        InstallSnapshotReply r{currentterm, 0};
+        if(a.term < currentterm) return r;
+        if(a.term > currentterm) stepDown(a.term);
+        lastHeartbeat = clk->now();
+        role1 = role::Follower;
+        setLeader(a.leader);
+        noteLeaderContact(a.leader);
+        r.term = currentterm;
+
+        // already applied past it; accept every chunk without storing anything
+        if(a.lastIndex <= lastapplied){
+            r.nextOffset = a.offset + a.data.size();
+            return r;
+        }
 
-                
-                if(prevIdx == -1){
-                    logs.clear();
-                }
-                else {
-                    if(prevIdx > (int)logs.size()) success = false;
-                    else if(prevIdx > 0 && logs[prevIdx-1].term != prevTerm) success = false;
-                }
+        if(installIndex != a.lastIndex || installTerm != a.lastTerm){
+            installBuf.clear();
+            installIndex = a.lastIndex;
+            installTerm = a.lastTerm;
+        }
+        if(a.offset != (int)installBuf.size()){
+            r.nextOffset = installBuf.size();
+            return r;
+        }
+        installBuf += a.data;
+        r.nextOffset = installBuf.size();
+        if(!a.done) return r;
+
+        auto blob = std::make_shared<const std::string>(std::move(installBuf));
+        installBuf.clear();
+        installIndex = installTerm = 0;
+        int idx, term;
+        if(!StateMachine::peek(*blob, idx, term) || idx != a.lastIndex || !stateMachine.restore(*blob)){
+            std::cerr << logName << " rejected damaged snapshot@" << a.lastIndex << std::endl;
+            r.nextOffset = 0;
+            return r;
+        }
+        // the snapshot file must be durable before the WAL says the log was replaced
+        if(wal && !wal->saveSnapshot(*blob, a.lastIndex, a.lastTerm)){
+            r.nextOffset = 0;
+            return r;
+        }
+        bool kept = compactTo(a.lastIndex, a.lastTerm, blob);
+        if(wal && !kept){
+            wal->reset(a.lastIndex, a.lastTerm);
+            walTruncGen++;
+            walDirty = true;
+        }
+        lastapplied = std::max(lastapplied, a.lastIndex);
+        setCommitIndex(a.lastIndex);
+        std::cout << logName << " installed snapshot@" << a.lastIndex << " (" << blob->size() << " bytes)" << std::endl;
+        return r;
+    }
 
-                if(success){
-                    if(prevIdx >= 0 && prevIdx < (int)logs.size()){
-                        logs.erase(logs.begin() + prevIdx, logs.end());
-                    }
+    // inbound peer RPC in the text protocol
+    std::string peerstring(std::string_view msg){
+        totalMessages.add();
+        if(starts_with(msg, "ReqVote")){
+            ReqVoteArgs a;
+            if(!decodeText(msg, a)) return "ERR\n";
+            return encodeText(handleReqVote(a));
+        }
 
-                    for(int i = 0; i < count; i++){
-                        std::string e = t[7+i];
-                        auto pos = e.find('|');
-                        int et = stoi(e.substr(0,pos));
-                        std::string cmd = e.substr(pos+1);
-                        logs.emplace_back(et, cmd);
-                    }
+        if(starts_with(msg, "AppendEntries")){
+            AppendEntriesArgs a;
+            if(!decodeText(msg, a)) return "ERR\n";
+            return encodeText(handleAppendEntries(a));
+        }
 
-                    if(leaderCommit > commitindex){
-                        commitindex = std::min(leaderCommit, (int)logs.size());
-                    }
-                }
-            }
+        if(starts_with(msg, "InstallSnapshot")){
+            InstallSnapshotArgs a;
+            if(!decodeText(msg, a)) return "ERR\n";
+            return encodeText(handleInstallSnapshot(a));
+        }
 
-            std::ostringstream out;
-            out << "AppendEntries_RESP " << currentterm << " " << (success?1:0);
-            return out.str();
+        if(starts_with(msg, "ReadIndex")){
+            ReadIndexArgs a;
+            if(!decodeText(msg, a)) return "ERR\n";
+            return encodeText(handleReadIndex(a));
+        }
+
+        if(starts_with(msg, "TimeoutNow")){
+            TimeoutNowArgs a;
+            if(!decodeText(msg, a)) return "ERR\n";
+            return encodeText(handleTimeoutNow(a));
         }
 
         return "ERR\n";
     }
 
-    
-    
+    // inbound peer RPC as one binary frame; an empty reply means the frame was malformed
+    std::string peerframe(std::string_view frame){
+        totalMessages.add();
+        switch(wireFrameType(frame.data())){
+        case WIRE_REQVOTE: {
+            ReqVoteArgs a;
+            if(!decodeFrame(frame, a)) return "";
+            return encodeFrame(handleReqVote(a));
+        }
+        case WIRE_APPEND: {
+            AppendEntriesArgs a;
+            if(!decodeFrame(frame, a)) return "";
+            return encodeFrame(handleAppendEntries(a));
+        }
+        case WIRE_SNAPSHOT: {
+            InstallSnapshotArgs a;
+            if(!decodeFrame(frame, a)) return "";
+            return encodeFrame(handleInstallSnapshot(a));
+        }
+        case WIRE_READINDEX: {
+            ReadIndexArgs a;
+            if(!decodeFrame(frame, a)) return "";
+            return encodeFrame(handleReadIndex(a));
+        }
+        case WIRE_TIMEOUTNOW: {
+            TimeoutNowArgs a;
+            if(!decodeFrame(frame, a)) return "";
+            return encodeFrame(handleTimeoutNow(a));
+        }
+        default:
+            return "";
+        }
+    }
+
+    // peerstring() for callers that serve many connections on one thread: a vote,
+    // append or snapshot chunk is answered through reply once it is durable rather
+    // than after an fsync on the calling thread
+    void peerstring(std::string_view msg, RpcAnswerFn reply){
+        if(starts_with(msg, "ReqVote")){
+            totalMessages.add();
+            ReqVoteArgs a;
+            if(!decodeText(msg, a)){
+                reply("ERR\n");
+                return;
+            }
+            ReqVoteReply r = voteLocked(a);
+            // a pre-vote changes no term or vote, so nothing needs to be durable first
+            if(a.preVote) reply(encodeText(r));
+            else replyWhenDurable(std::move(reply), encodeText(r));
+        }
+        else if(starts_with(msg, "AppendEntries")){
+            totalMessages.add();
+            AppendEntriesArgs a;
+            if(!decodeText(msg, a)){
+                reply("ERR\n");
+                return;
+            }
+            replyWhenDurable(std::move(reply), encodeText(appendLocked(a)));
+        }
+        else if(starts_with(msg, "InstallSnapshot")){
+            totalMessages.add();
+            InstallSnapshotArgs a;
+            if(!decodeText(msg, a)){
+                reply("ERR\n");
+                return;
+            }
+            replyWhenDurable(std::move(reply), encodeText(installLocked(a)));
+        }
+        else reply(peerstring(msg));
+    }
+
+    // the same for binary frames; false, with reply never called, if the frame is malformed
+    bool peerframe(std::string_view frame, RpcAnswerFn reply){
+        switch(wireFrameType(frame.data())){
+        case WIRE_REQVOTE: {
+            totalMessages.add();
+            ReqVoteArgs a;
+            if(!decodeFrame(frame, a)) return false;
+            ReqVoteReply r = voteLocked(a);
+            // a pre-vote changes no term or vote, so nothing needs to be durable first
+            if(a.preVote) reply(encodeFrame(r));
+            else replyWhenDurable(std::move(reply), encodeFrame(r));
+            return true;
+        }
+        case WIRE_APPEND: {
+            totalMessages.add();
+            AppendEntriesArgs a;
+            if(!decodeFrame(frame, a)) return false;
+            replyWhenDurable(std::move(reply), encodeFrame(appendLocked(a)));
+            return true;
+        }
+        case WIRE_SNAPSHOT: {
+            totalMessages.add();
+            InstallSnapshotArgs a;
+            if(!decodeFrame(frame, a)) return false;
+            replyWhenDurable(std::move(reply), encodeFrame(installLocked(a)));
+            return true;
+        }
+        default: {
+            std::string out = peerframe(frame);
+            if(out.empty()) return false;
+            reply(std::move(out));
+            return true;
+        }
+        }
+    }
+
+    // election and group-commit timers; all peer RPCs are issued concurrently by peerloop()
     void raftloop(){
+        std::unique_lock<std::mutex> lk(mu);
+        while(!stopflag){
+            auto wake = std::min(timerStep(), clk->now() + std::chrono::milliseconds(10));
+            timerCv.wait_until(lk, wake);
+        }
+    }
+
+    // caller holds mu; each timeout is drawn from [base, 2 * base], base adapting to
+    // heartbeat gaps
+    int drawElectionTimeout(){
+        int base = electionTimeoutMs();
+        return std::uniform_int_distribution<int>(base, 2 * base)(rng);
+    }
+
+    // caller holds mu; fires whichever timers are due and returns when the next one is
+    std::chrono::steady_clock::time_point timerStep(){
         using namespace std::chrono;
+        auto now = clk->now();
+
+        if(role1 == role::Leader){
+            // lastHeartbeat holds the time this server became leader
+            auto quorumDeadline = std::max(quorumContact(), lastHeartbeat) + milliseconds(2 * electionTimeoutMs());
+            if(now > quorumDeadline){
+                loseLeadership();
+                electionTimeout = drawElectionTimeout();
+                return lastHeartbeat + milliseconds(electionTimeout);
+            }
+            if(transferTarget >= 0 && now >= transferDeadline){
+                std::cout << logName << " leadership transfer timed out" << std::endl;
+                finishTransfer(TransferResult::TimedOut);
+            }
+            if(batchArmed && now >= batchDeadline) releaseBatch();
+            while(!waiters.empty() && waiters.front().deadline <= now){
+                CommitWaiter w = std::move(waiters.front());
+                waiters.pop_front();
+                w.done(AppendResult::NotCommitted);
+            }
+            auto wake = quorumDeadline + milliseconds(1);
+            if(transferTarget >= 0) wake = std::min(wake, transferDeadline);
+            if(batchArmed) wake = std::min(wake, batchDeadline);
+            if(!waiters.empty()) wake = std::min(wake, waiters.front().deadline);
+            return wake;
+        }
 
-        std::uniform_int_distribution<int> dist(150,300);
-        int timeoutMs = dist(rng);
+        if(learner) return now + milliseconds(ELECTION_TIMEOUT_MAX_MS);
+        if(now - lastHeartbeat >= milliseconds(electionTimeout)){
+            lastHeartbeat = now;
+            electionTimeout = drawElectionTimeout();
+            startPreVote();
+            peerCv.notify_all();
+        }
+        return lastHeartbeat + milliseconds(electionTimeout);
+    }
 
+    void peerloop(size_t i){
+        std::unique_lock<std::mutex> lk(mu);
         while(!stopflag){
-            std::this_thread::sleep_for(milliseconds(10));
-            auto now = steady_clock::now();
+            auto wake = clk->now() + std::chrono::hours(1);
+            if(peerStep(i, lk, wake)) continue;
+            peerCv.wait_until(lk, wake);
+        }
+    }
 
-            std::unique_lock<std::mutex> lk(mu);
+    // caller holds lk on mu, released while a request goes out. Starts at most one
+    // exchange with peer i and returns true if it did; otherwise lowers wake to when
+    // there may be something to send.
+    bool peerStep(size_t i, std::unique_lock<std::mutex> &lk, std::chrono::steady_clock::time_point &wake){
+        using namespace std::chrono;
+        if(inFlight[i]) return false;
 
-            
-            if(role1 == role::Leader){
-               
-                std::vector<Log> copy = logs;
-                int commit = commitindex;
-                int term   = currentterm;
+        if(role1 == role::PreCandidate && peerVoter[i] && preVoteRequested[i] != preVoteRound){
+            preVoteRequested[i] = preVoteRound;
+            lk.unlock();
+            requestVoteFrom(i, true);
+            lk.lock();
+            return true;
+        }
+        if(role1 == role::Candidate && peerVoter[i] && voteRequested[i] != currentterm){
+            voteRequested[i] = currentterm;
+            lk.unlock();
+            requestVoteFrom(i, false);
+            lk.lock();
+            return true;
+        }
 
-                auto peers = peer_addrs;
+        auto now = clk->now();
+        if(role1 == role::Leader){
+            if((int)i == transferTarget && !timeoutNowSent && matchIndex[i] == lastLogIndex()){
+                timeoutNowSent = true;
                 lk.unlock();
+                sendTimeoutNow(i);
+                lk.lock();
+                return true;
+            }
+            bool pending = (nextIndex[i] <= releasedIndex || sentCommit[i] < commitindex) && now >= retryAt[i];
+            if(pending || now >= nextSend[i]){
+                bool needSnapshot = nextIndex[i] <= snapshotIndex;
+                lk.unlock();
+                if(needSnapshot) sendSnapshotTo(i);
+                else replicateTo(i);
+                lk.lock();
+                return true;
+            }
+            // the leader needs peer ids too, to find a transfer target
+            if(peerIds[i] < 0 && now >= probeAt[i]){
+                lk.unlock();
+                askReadIndex(i, false);
+                lk.lock();
+                return true;
+            }
+            wake = std::min(wake, std::min(nextSend[i], peerIds[i] < 0 ? probeAt[i] : nextSend[i]));
+            return false;
+        }
 
-                for(auto &p : peers){
-                    std::ostringstream req;
+        // a follower learns which server id is behind each address, and fetches read
+        // indexes from the leader for queries waiting on one
+        bool forward = !readIndexInFlight && leaderId >= 0 && peerIds[i] == leaderId && followerReadsWaiting();
+        if(role1 == role::Follower && now >= probeAt[i] && (peerIds[i] < 0 || forward)){
+            lk.unlock();
+            askReadIndex(i, forward);
+            lk.lock();
+            return true;
+        }
+        wake = std::min(wake, now + milliseconds(HEARTBEAT_INTERVAL_MS));
+        return false;
+    }
 
-                    req << "AppendEntries " 
-                        << term << " " << me << " "
-                        << -1 << " " << 0 << " "
-                        << commit << " " << (int)copy.size();
+    // caller holds mu; peer i's sender may go again, at once if the peer answered and
+    // at the next heartbeat if not, so an unreachable peer is not retried in a spin
+    void sendFinished(size_t i, bool ok){
+        inFlight[i] = 0;
+        auto after = clk->now();
+        nextSend[i] = after + std::chrono::milliseconds(HEARTBEAT_INTERVAL_MS);
+        retryAt[i] = ok ? after : nextSend[i];
+    }
 
-                    for (auto &entry : copy) {
-                          
-                      std::string safeCmd = entry.command;
-                      std::replace(safeCmd.begin(), safeCmd.end(), ' ', '~');
-                      req << " " << entry.term << "|" << safeCmd;
-                    }
+    // Does on the calling thread what start()'s threads would do, until nothing is left
+    // to do right now, and returns when to call it again. This is how the simulator
+    // runs a server without threads; a server driven this way has no WAL.
+    std::chrono::steady_clock::time_point poll(){
+        std::vector<Log> batch;
+        ServedReads served;
+        std::unique_lock<std::mutex> lk(mu);
+        while(true){
+            auto wake = timerStep();
+            bool busy = applyStep(lk, batch, served);
+            if(snapshotting){
+                takeSnapshot(lk);
+                busy = true;
+            }
+            for(size_t i = 0; i < peer_addrs.size(); i++)
+                if(peerStep(i, lk, wake)) busy = true;
+            if(!reads.empty()) wake = std::min(wake, reads.front().deadline);
+            if(!busy) return wake;
+        }
+    }
 
-                    std::string resp = msgtopeer(p, req.str());
-                    
-                }
+    // caller holds mu
+    bool followerReadsWaiting(){
+        for(auto &w : reads) if(!w.leaderRead && w.index < 0) return true;
+        return false;
+    }
+
+    // One ReadIndex round trip to peer i. When forwarding, every follower read that
+    // arrived before the request went out gets the index the leader answers with.
+    void askReadIndex(size_t i, bool forward){
+        ReadIndexArgs req;
+        uint64_t upto;
+        {
+            std::lock_guard<std::mutex> lk(mu);
+            req = ReadIndexArgs{currentterm, me};
+            upto = nextReadSeq;
+            if(forward) readIndexInFlight = true;
+            inFlight[i] = 1;
+        }
 
-                std::this_thread::sleep_for(milliseconds(100));
-                continue;
+        transport->call(i, req, [this, i, forward, upto](bool ok, ReadIndexReply &resp){
+            using namespace std::chrono;
+            std::lock_guard<std::mutex> lk(mu);
+            inFlight[i] = 0;
+            if(forward) readIndexInFlight = false;
+            if(!ok){
+                probeAt[i] = clk->now() + milliseconds(ELECTION_TIMEOUT_MAX_MS);
+                return;
+            }
+            if(peerIds[i] != resp.id){
+                peerIds[i] = resp.id;
+                publishLeader();
             }
+            if(!forward) return;
+            if(resp.index < 0){
+                // the leader is still confirming its lease; it is heartbeating meanwhile
+                probeAt[i] = clk->now() + milliseconds(HEARTBEAT_INTERVAL_MS / 5);
+                return;
+            }
+            for(auto &w : reads){
+                if(!w.leaderRead && w.index < 0 && w.seq < upto){
+                    w.index = resp.index;
+                    w.confirmed = true;
+                }
+            }
+            wakeReads();
+        });
+    }
 
-          
-            auto msSince = duration_cast<milliseconds>(now - lastHeartbeat).count();
+    // A leader hands out its commit index (at least this term's no-op) while its lease
+    // holds. Otherwise it answers -1 and heartbeats at once, so a retry soon succeeds.
+    ReadIndexReply handleReadIndex(const ReadIndexArgs &a){
+        (void)a;
+        using namespace std::chrono;
+        std::lock_guard<std::mutex> lk(mu);
+        ReadIndexReply r{currentterm, me, role1 == role::Leader ? me : leaderId, -1};
+        if(role1 != role::Leader) return r;
+        auto now = clk->now();
+        if(leaseHolds(now)){
+            r.index = std::max(commitindex, termStartIndex);
+        } else {
+            for(auto &t : nextSend) t = now;
+            peerCv.notify_all();
+        }
+        return r;
+    }
 
-            if(msSince >= timeoutMs){
-                role1 = role::Candidate;
-                currentterm++;
-                votedfor = me;
-                int thisTerm = currentterm;
+    // The leader's last step of a transfer: peer i holds the whole log, so it can win.
+    void sendTimeoutNow(size_t i){
+        TimeoutNowArgs req;
+        {
+            std::lock_guard<std::mutex> lk(mu);
+            if(role1 != role::Leader || (int)i != transferTarget) return;
+            req = TimeoutNowArgs{currentterm, me};
+            inFlight[i] = 1;
+        }
+        transport->call(i, req, [this, i](bool ok, TimeoutNowReply &resp){
+            std::lock_guard<std::mutex> lk(mu);
+            inFlight[i] = 0;
+            if(ok && resp.term > currentterm) stepDown(resp.term);
+        });
+    }
 
-                lk.unlock();
+    // skips the pre-vote: the leader itself asked, so there is nobody to protect
+    TimeoutNowReply handleTimeoutNow(const TimeoutNowArgs &a){
+        std::lock_guard<std::mutex> lk(mu);
+        if(a.term == currentterm && role1 != role::Leader && !learner && !stopflag){
+            std::cout << logName << " TimeoutNow from " << a.leader << ", standing for term " << currentterm + 1 << std::endl;
+            startElection(true);
+        }
+        return TimeoutNowReply{currentterm};
+    }
 
-                int votes = 1;
-                auto peers = peer_addrs;
-                auto electionStart = steady_clock::now();
-                int need = (peers.size()+1)/2 + 1;
-
-                int lastIdx = logs.size();
-                int lastTerm = (lastIdx>0 ? logs[lastIdx-1].term : 0);
-
-                for(auto &p : peers){
-                    std::ostringstream req;
-                    req << "ReqVote " << thisTerm << " " << me
-                        << " " << lastIdx << " " << lastTerm;
-
-                    auto resp = msgtopeer(p, req.str());
-                    auto tok = split_ws(resp);
-
-                    if(tok.size() >= 3 && tok[0] == "ReqVote_RESP"){
-                        int rterm = stoi(tok[1]);
-                        int granted = stoi(tok[2]);
-
-                        std::lock_guard<std::mutex> lk2(mu);
-                        if(rterm > currentterm){
-                            currentterm = rterm;
-                            role1 = role::Follower;
-                            votedfor = -1;
-                        }
-                        else if(rterm == thisTerm && role1 == role::Candidate && granted==1){
-                            votes++;
-                        }
-
-                        if(votes >= need && role1 == role::Candidate && currentterm==thisTerm){
-                            
-                            role1 = role::Leader;
-                            lastHeartbeat = steady_clock::now();
-                            {
-                                std::lock_guard<std::mutex> mm(metricsMutex);
-                                totalElections++;
-                            }
-                        }
-                    }
-                }
+    void requestVoteFrom(size_t i, bool pre){
+        // our own term and vote must be on disk before anyone can count on them; a
+        // pre-vote has changed neither
+        if(!pre && wal) wal->sync();
 
-                lk.lock();
-                timeoutMs = dist(rng);
+        ReqVoteArgs req;
+        long long round;
+        {
+            std::lock_guard<std::mutex> lk(mu);
+            if(role1 != (pre ? role::PreCandidate : role::Candidate)) return;
+            req = ReqVoteArgs{pre ? currentterm + 1 : currentterm, me, lastLogIndex(), logTermAt(lastLogIndex()), pre, !pre && transferElection};
+            round = preVoteRound;
+            inFlight[i] = 1;
+        }
+
+        int term = req.term;
+        transport->call(i, req, [this, i, pre, term, round](bool ok, ReqVoteReply &resp){
+            std::lock_guard<std::mutex> lk(mu);
+            inFlight[i] = 0;
+            if(!ok) return;
+            if(resp.term > currentterm){
+                stepDown(resp.term);
+                return;
             }
+            if(pre){
+                if(role1 != role::PreCandidate || preVoteRound != round || !resp.granted) return;
+                if(++preVotesGranted >= majority()) startElection();
+                return;
+            }
+            if(role1 != role::Candidate || currentterm != term || !resp.granted) return;
 
-            lk.unlock();
+            votesGranted++;
+            if(votesGranted >= majority()) becomeLeader();
+        });
+    }
+
+    // sends the entries peer i is missing (or an empty heartbeat) and folds the reply
+    // into nextIndex/matchIndex; only the suffix past nextIndex is copied under mu
+    void replicateTo(size_t i){
+        AppendEntriesArgs req;
+        {
+            std::lock_guard<std::mutex> lk(mu);
+            // a peer behind the snapshot is sendSnapshotTo's job
+            if(role1 != role::Leader || nextIndex[i] <= snapshotIndex){
+                sendFinished(i, true);
+                return;
+            }
+
+            int prevIdx = nextIndex[i] - 1;
+            int count = std::max(0, std::min(releasedIndex - prevIdx, MAX_APPEND_BATCH));
+            req.term = currentterm;
+            req.leader = me;
+            req.prevIdx = prevIdx;
+            req.prevTerm = logTermAt(prevIdx);
+            req.leaderCommit = commitindex;
+            sentCommit[i] = commitindex;
+            auto first = logs.begin() + (prevIdx - snapshotIndex);
+            req.entries.assign(first, first + count);
+            inFlight[i] = 1;
         }
+
+        auto sent = clk->now();
+        int term = req.term, prevIdx = req.prevIdx, count = req.entries.size();
+        transport->call(i, req, [this, i, sent, term, prevIdx, count](bool ok, AppendEntriesReply &resp){
+            std::lock_guard<std::mutex> lk(mu);
+            sendFinished(i, ok);
+            if(!ok) return;
+            notePeerRtt(i, sent);
+            if(resp.term > currentterm){
+                stepDown(resp.term);
+                return;
+            }
+            if(role1 != role::Leader || currentterm != term) return;
+            noteAck(i, sent);
+
+            if(resp.success){
+                matchIndex[i] = std::max(matchIndex[i], prevIdx + count);
+                nextIndex[i] = matchIndex[i] + 1;
+                advanceCommitIndex();
+                return;
+            }
+
+            int next = resp.conflictIndex;
+            if(resp.conflictTerm > 0){
+                for(int idx = std::min(prevIdx, lastLogIndex()); idx > snapshotIndex; idx--){
+                    if(logTermAt(idx) == resp.conflictTerm){ next = idx + 1; break; }
+                    if(logTermAt(idx) < resp.conflictTerm) break;
+                }
+            }
+            nextIndex[i] = std::max(1, std::min(next, lastLogIndex() + 1));
+            nextIndex[i] = std::max(nextIndex[i], matchIndex[i] + 1);
+        });
     }
 
-    
-    std::string msgtopeer(const std::string &peerAddr, const std::string &msg){
-        size_t pos = peerAddr.find(':');
-        if(pos == std::string::npos) return "";
+    // Streams the latest snapshot to a peer that needs entries already compacted away,
+    // one SNAPSHOT_CHUNK_BYTES chunk per call; the peer loop keeps calling while the
+    // peer is behind, so chunks go out back to back. A newer snapshot restarts the
+    // transfer.
+    void sendSnapshotTo(size_t i){
+        InstallSnapshotArgs req;
+        {
+            std::lock_guard<std::mutex> lk(mu);
+            if(role1 != role::Leader || !snapshotBlob){
+                sendFinished(i, true);
+                return;
+            }
+            if(snapSentIndex[i] != snapshotIndex){
+                snapSentIndex[i] = snapshotIndex;
+                snapOffset[i] = 0;
+            }
+            const std::string &b = *snapshotBlob;
+            size_t off = std::min((size_t)snapOffset[i], b.size());
+            size_t n = std::min((size_t)SNAPSHOT_CHUNK_BYTES, b.size() - off);
+            req.term = currentterm;
+            req.leader = me;
+            req.lastIndex = snapshotIndex;
+            req.lastTerm = snapshotTerm;
+            req.offset = off;
+            req.done = off + n == b.size();
+            req.data.assign(b, off, n);
+            inFlight[i] = 1;
+        }
 
-        std::string ip = peerAddr.substr(0,pos);
-        int port = stoi(peerAddr.substr(pos+1));
+        auto sent = clk->now();
+        int term = req.term, lastIndex = req.lastIndex, end = req.offset + (int)req.data.size();
+        bool done = req.done;
+        transport->call(i, req, [this, i, sent, term, lastIndex, end, done](bool ok, InstallSnapshotReply &resp){
+            std::lock_guard<std::mutex> lk(mu);
+            sendFinished(i, ok);
+            if(!ok) return;
+            notePeerRtt(i, sent);
+            if(resp.term > currentterm){
+                stepDown(resp.term);
+                return;
+            }
+            if(role1 != role::Leader || currentterm != term) return;
+            noteAck(i, sent);
+            if(snapSentIndex[i] != lastIndex) return;
+
+            if(done && resp.nextOffset == end){
+                matchIndex[i] = std::max(matchIndex[i], lastIndex);
+                nextIndex[i] = matchIndex[i] + 1;
+                snapOffset[i] = 0;
+                advanceCommitIndex();
+                return;
+            }
+            snapOffset[i] = resp.nextOffset;
+        });
+    }
 
-        int s = socket(AF_INET, SOCK_STREAM, 0);
-        if(s < 0) return "";
+    // caller holds mu
+    void notePeerRtt(size_t i, std::chrono::steady_clock::time_point sent){
+        peerRtt[i]->record(std::chrono::duration_cast<std::chrono::microseconds>(clk->now() - sent).count());
+    }
 
-        sockaddr_in a;
-        memset(&a,0,sizeof(a));
-        a.sin_family = AF_INET;
-        a.sin_port = htons(port);
-        inet_pton(AF_INET, ip.c_str(), &a.sin_addr);
+    void setPeerProtocol(int version){
+        transport->setProtocol(version);
+    }
 
-        struct timeval tv; tv.tv_sec=1; tv.tv_usec=0;
-        setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-        setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    std::vector<PeerConnStats> getPeerStats(){
+        return transport->stats();
+    }
 
-        if(connect(s,(sockaddr*)&a,sizeof(a)) < 0){
-            close(s);
-            return "";
+    // Appends cmd and calls done once a majority holds it, or with NotLeader /
+    // NotCommitted if leadership is lost or COMMIT_TIMEOUT_MS passes first. Concurrent
+    // callers are grouped: the batch ships once groupMaxBatch entries are waiting or
+    // the oldest has waited groupMaxWaitUs, so one replication round acks them all.
+    // Sensor commands are parsed here, once, and a malformed one is refused with
+    // Invalid; only other commands are copied into the log as text.
+    void appendCommandAsync(std::string_view cmd, std::function<void(AppendResult)> done){
+        std::vector<Log> one(1);
+        if(!parseCommand(cmd, one[0])){
+            done(AppendResult::Invalid);
+            return;
         }
+        if(one[0].kind == EntryKind::Opaque) one[0].command.assign(cmd.data(), cmd.size());
+        appendEntriesAsync(std::move(one), std::move(done));
+    }
 
-        std::string out = msg;
-        if(out.back() != '\n') out.push_back('\n');
-        send(s, out.c_str(), out.size(), 0);
+    // appends already parsed entries as consecutive log entries, stamped with this
+    // leader's term and time; done fires once for the whole run
+    void appendEntriesAsync(std::vector<Log> entries, std::function<void(AppendResult)> done){
+        std::lock_guard<std::mutex> lk(mu);
+        if(role1 != role::Leader || stopflag || transferTarget >= 0){
+            done(AppendResult::NotLeader);
+            return;
+        }
+        if(entries.empty()){
+            done(AppendResult::Committed);
+            return;
+        }
 
-        char buf[8192];
-        int r = recv(s, buf, sizeof(buf)-1, 0);
-        if(r <= 0){
-            close(s);
-            return "";
+        int term = currentterm;
+        int first = lastLogIndex() + 1;
+        // entries are stamped once, here, so every replica sees the same time; the log
+        // never goes backwards even if this leader's clock is behind the last one's
+        int64_t ts = clk->wallMs();
+        if(!logs.empty()) ts = std::max(ts, logs.back().ts);
+        for(auto &e : entries){
+            e.term = term;
+            e.ts = ts;
+            logs.push_back(std::move(e));
+        }
+        persistEntries(first);
+        int idx = lastLogIndex();
+        auto now = clk->now();
+        waiters.push_back(CommitWaiter{idx, term, now + std::chrono::milliseconds(COMMIT_TIMEOUT_MS), std::move(done)});
+
+        if(groupMaxWaitUs == 0 || idx - releasedIndex >= groupMaxBatch){
+            releaseBatch();
+        } else if(!batchArmed){
+            batchArmed = true;
+            batchDeadline = now + std::chrono::microseconds(groupMaxWaitUs);
+            timerCv.notify_all();
         }
-        buf[r] = '\0';
-        close(s);
-        return std::string(buf);
     }
 
-   
-    bool appendCommand(const std::string &cmd){
-        std::lock_guard<std::mutex> lk(mu);
-        if(role1 != role::Leader) return false;
-        logs.emplace_back(currentterm, cmd);
-        commitindex = logs.size();
-        return true;
+    // blocking form of appendCommandAsync for thread-per-connection callers
+    AppendResult appendCommand(std::string_view cmd){
+        std::promise<AppendResult> p;
+        auto f = p.get_future();
+        appendCommandAsync(cmd, [&p](AppendResult r){ p.set_value(r); });
+        return f.get();
     }
 
     std::vector<SensorReading> getSensorReadings() {
@@ -460,6 +2164,15 @@ public:
     std::vector<SensorReading> getSensorReadingsByNode(int nid){
         return stateMachine.getSensorReadingsByNode(nid);
     }
+    std::vector<SensorReading> getLastReadings(int nid, size_t n, size_t &total){
+        return stateMachine.getLastReadings(nid, n, &total);
+    }
+    std::vector<SensorReading> getRange(int nid, int64_t t0, int64_t t1, size_t cursor, size_t limit, size_t &next){
+        return stateMachine.getRange(nid, t0, t1, cursor, limit, next);
+    }
+    std::vector<SensorReading> getLatest(int64_t t0, int cursor, size_t limit, int &next){
+        return stateMachine.getLatest(t0, cursor, limit, next);
+    }
     std::map<int,int> getReadingsPerNode(){
         return stateMachine.getReadingsPerNode();
     }
@@ -469,14 +2182,236 @@ public:
     std::map<int,int> getHeartbeats(){
         return stateMachine.getAllHeartbeats();
     }
+    std::vector<NodeCounts> getNodeCounts(NodeCounts &total){
+        return stateMachine.getNodeCounts(total);
+    }
+    bool getAggregate(int nid, AggregateSummary &out){
+        return stateMachine.getAggregate(nid, out);
+    }
+    SensorAggregate getClusterStats(){
+        return stateMachine.getClusterStats();
+    }
+    AggregateSummary getClusterAggregate(){
+        return stateMachine.getClusterAggregate();
+    }
+    // Calls done once a query in this mode may be answered from local state: at once
+    // for Stale, otherwise from the apply thread once the read index is applied.
+    // NotLeader if a Linearizable read reaches a follower or leadership is lost first.
+    // A learner, there to take reads off the voters, serves a Linearizable read itself
+    // the Follower way.
+    void readBarrier(ReadMode mode, std::function<void(ReadResult)> done){
+        using namespace std::chrono;
+        std::unique_lock<std::mutex> lk(mu);
+        if(learner && mode == ReadMode::Linearizable) mode = ReadMode::Follower;
+        if(mode == ReadMode::Stale || stopflag || (mode == ReadMode::Linearizable && role1 != role::Leader)){
+            lk.unlock();
+            done(mode == ReadMode::Stale ? ReadResult::Ok : ReadResult::NotLeader);
+            return;
+        }
+
+        auto now = clk->now();
+        ReadWaiter w;
+        w.seq = nextReadSeq++;
+        w.term = currentterm;
+        w.deadline = now + milliseconds(READ_TIMEOUT_MS);
+        w.done = std::move(done);
+        if(role1 == role::Leader){
+            // within the lease no round trip is needed; otherwise one heartbeat round
+            // sent from now on has to come back from a quorum
+            w.leaderRead = true;
+            w.index = std::max(commitindex, termStartIndex);
+            w.after = now - milliseconds(READ_LEASE_MS);
+            w.confirmed = leaseHolds(now);
+            if(!w.confirmed){
+                w.after = now;
+                for(auto &t : nextSend) t = now;
+                peerCv.notify_all();
+            }
+        } else {
+            w.leaderRead = false;
+            w.index = -1;
+            w.confirmed = false;
+            peerCv.notify_all();
+        }
+        reads.push_back(std::move(w));
+        wakeReads();
+    }
+
+    // appended to "ERR not_leader" so a client can go straight to the leader; safe to
+    // call with or without mu held
+    std::string leaderHint(){
+        std::lock_guard<std::mutex> lk(hintMutex);
+        return hint;
+    }
+
+    ApplyStats getApplyStats(){
+        std::lock_guard<std::mutex> lk(mu);
+        return ApplyStats{commitindex, lastapplied, commitindex - lastapplied, maxApplyLag, applyBatches, appliedEntries};
+    }
     int getLogCount(){
         std::lock_guard<std::mutex> lk(mu);
-        return logs.size();
+        return lastLogIndex();
     }
     bool isLeader(){
         std::lock_guard<std::mutex> lk(mu);
         return role1 == role::Leader;
     }
+    int getTerm(){
+        std::lock_guard<std::mutex> lk(mu);
+        return currentterm;
+    }
+
+    // every voter's id, this server's included if it votes, in ascending order; empty
+    // until the id behind each voting peer's address has been learned
+    std::vector<int> getServerIds(){
+        std::lock_guard<std::mutex> lk(mu);
+        std::vector<int> ids;
+        if(!learner) ids.push_back(me);
+        for(size_t i = 0; i < peerIds.size(); i++){
+            if(!peerVoter[i]) continue;
+            if(peerIds[i] < 0) return std::vector<int>();
+            ids.push_back(peerIds[i]);
+        }
+        std::sort(ids.begin(), ids.end());
+        return ids;
+    }
+
+    // leader only: whether server id holds everything committed and has acked within
+    // the lease, so that handing it leadership would hold writes up only briefly
+    bool peerCaughtUp(int id){
+        std::lock_guard<std::mutex> lk(mu);
+        if(role1 != role::Leader) return false;
+        for(size_t i = 0; i < peerIds.size(); i++)
+            if(peerIds[i] == id)
+                return matchIndex[i] >= commitindex &&
+                       clk->now() - ackSent[i] < std::chrono::milliseconds(READ_LEASE_MS);
+        return false;
+    }
+
+    // Hands leadership to server id; done runs with mu held, once the target has been
+    // sent TimeoutNow and this server has seen the higher term, or on failure. Writes
+    // get NotLeader, pointing at the target, in the meantime.
+    void transferLeadership(int id, std::function<void(TransferResult)> done){
+        using namespace std::chrono;
+        std::lock_guard<std::mutex> lk(mu);
+        if(role1 != role::Leader || stopflag){
+            done(TransferResult::NotLeader);
+            return;
+        }
+        if(id == me){
+            done(TransferResult::Done);
+            return;
+        }
+        int target = -1;
+        for(size_t i = 0; i < peerIds.size(); i++) if(peerIds[i] == id) target = i;
+        if(target < 0){
+            done(TransferResult::UnknownPeer);
+            return;
+        }
+        if(!peerVoter[target]){
+            done(TransferResult::NotVoter);
+            return;
+        }
+        if(transferTarget >= 0 && transferTarget != target){
+            done(TransferResult::Busy);
+            return;
+        }
+        transferWaiters.push_back(std::move(done));
+        if(transferTarget == target) return;
+
+        std::cout << logName << " transferring leadership to " << id << std::endl;
+        transferTarget = target;
+        timeoutNowSent = false;
+        transferDeadline = clk->now() + milliseconds(TRANSFER_TIMEOUT_MS);
+        handoffTo = target;
+        publishLeader();
+        if(batchArmed) releaseBatch();
+        nextSend[target] = clk->now();
+        peerCv.notify_all();
+    }
+
+    // Raft's part of QUERY METRICS: log, commit and apply positions, replication per
+    // peer and elections, labelled with the group if there are several. Levels are
+    // read under mu, histograms and counters without it.
+    void writeMetrics(MetricsText &m){
+        int term, commit, applied, maxLag, last, inMemory, snapIdx, durable, writes, readsWaiting, timeout;
+        long long batches, entries;
+        size_t snapBytes;
+        bool leader;
+        std::vector<int> match;
+        {
+            std::lock_guard<std::mutex> lk(mu);
+            term = currentterm;
+            leader = role1 == role::Leader;
+            commit = commitindex;
+            applied = lastapplied;
+            maxLag = maxApplyLag;
+            batches = applyBatches;
+            entries = appliedEntries;
+            last = lastLogIndex();
+            inMemory = logs.size();
+            snapIdx = snapshotIndex;
+            snapBytes = snapshotBlob ? snapshotBlob->size() : 0;
+            durable = durableIndex;
+            writes = waiters.size();
+            readsWaiting = reads.size();
+            timeout = electionTimeoutMs();
+            if(leader) match = matchIndex;
+        }
+
+        std::string g = groupId < 0 ? "" : "group=\"" + std::to_string(groupId) + "\"";
+
+        m.gauge("raft_term", "Current term", term, g);
+        m.gauge("raft_is_leader", "1 while this server is the leader", leader ? 1 : 0, g);
+        m.gauge("raft_is_learner", "1 if this server is a non-voting learner", learner ? 1 : 0, g);
+        m.gauge("raft_log_last_index", "Index of the last log entry", last, g);
+        m.gauge("raft_log_entries", "Log entries held in memory after the snapshot", inMemory, g);
+        m.gauge("raft_log_durable_index", "Last log index known to be in the WAL", durable, g);
+        m.gauge("raft_snapshot_index", "Last index covered by the snapshot", snapIdx, g);
+        m.gauge("raft_snapshot_bytes", "Size of the encoded snapshot", snapBytes, g);
+        m.gauge("raft_commit_index", "Highest committed index", commit, g);
+        m.gauge("raft_applied_index", "Highest index applied to the state machine", applied, g);
+        m.gauge("raft_commit_lag_entries", "Entries in the log but not committed", last - commit, g);
+        m.gauge("raft_apply_lag_entries", "Entries committed but not applied", commit - applied, g);
+        m.gauge("raft_apply_lag_max_entries", "Largest apply lag seen", maxLag, g);
+        m.counter("raft_apply_batches_total", "Batches taken by the apply thread", batches, g);
+        m.counter("raft_applied_entries_total", "Entries applied", entries, g);
+        m.gauge("raft_pending_writes", "Writes waiting to commit", writes, g);
+        m.gauge("raft_pending_reads", "Reads waiting on a read index", readsWaiting, g);
+        m.counter("raft_peer_messages_total", "Peer RPCs served", totalMessages.value(), g);
+
+        auto peer = [this, &g](size_t i){ return (g.empty() ? "" : g + ",") + "peer=\"" + peer_addrs[i] + "\""; };
+        for(size_t i = 0; i < match.size(); i++)
+            m.gauge("raft_peer_match_lag_entries", "Entries the leader has that the peer is not known to hold", last - match[i], peer(i));
+        for(size_t i = 0; i < peerRtt.size(); i++)
+            m.histogram("raft_peer_rtt_seconds", "Round trip of answered replication requests", *peerRtt[i], peer(i));
+        std::vector<PeerConnStats> conns = getPeerStats();
+        for(size_t i = 0; i < conns.size(); i++)
+            m.gauge("raft_peer_connected", "1 while the connection to the peer is up", conns[i].connected ? 1 : 0, peer(i));
+        for(size_t i = 0; i < conns.size(); i++)
+            m.counter("raft_peer_calls_total", "RPCs sent to the peer", conns[i].calls, peer(i));
+        for(size_t i = 0; i < conns.size(); i++)
+            m.counter("raft_peer_failures_total", "RPCs to the peer that got no reply", conns[i].failures, peer(i));
+        for(size_t i = 0; i < conns.size(); i++)
+            m.counter("raft_peer_sent_bytes_total", "Bytes sent to the peer", conns[i].bytesOut, peer(i));
+        for(size_t i = 0; i < conns.size(); i++)
+            m.counter("raft_peer_received_bytes_total", "Bytes received from the peer", conns[i].bytesIn, peer(i));
+
+        m.gauge("raft_election_timeout_seconds", "Lower end of the randomized election timeout", timeout / 1e3, g);
+        m.counter("raft_prevote_rounds_total", "Pre-vote rounds started", preVoteRounds.value(), g);
+        m.counter("raft_candidacies_total", "Elections stood in", candidacies.value(), g);
+        m.counter("raft_elections_won_total", "Elections won", totalElections.value(), g);
+        m.counter("raft_quorum_loss_stepdowns_total", "Times this leader stepped down on losing quorum", quorumLossStepDowns.value(), g);
+        m.histogram("raft_election_unavailability_seconds", "From the winner last hearing a leader to it leading", electionWindows, g);
+    }
+
+    ElectionStats getElectionStats(){
+        std::lock_guard<std::mutex> lk(mu);
+        std::lock_guard<std::mutex> mm(metricsMutex);
+        return ElectionStats{currentterm, electionTimeoutMs(), heartbeatGap.smoothed,
+                             (long long)preVoteRounds.value(), (long long)candidacies.value(),
+                             (long long)totalElections.value(), (long long)quorumLossStepDowns.value(), electionTimes};
+    }
 };
 
 #endif
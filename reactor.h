@@ -0,0 +1,363 @@
+#ifndef __REACTOR_H__
+#define __REACTOR_H__
+
+#include <iostream>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string>
+#include <map>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <algorithm>
+#include <unordered_map>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "rpc.h"
+#include "linebuf.h"
+#include "metrics.h"
+
+#define REACTOR_MAX_EVENTS  256
+#define REACTOR_READ_CHUNK  16384
+#define REACTOR_MAX_OUTBUF  (1 << 20)
+
+// Completes one request: called exactly once with the reply bytes, from any thread.
+typedef std::function<void(std::string)> ReplyFn;
+// Handles one request line (sensor, query or text-protocol peer RPC). The view
+// points into the connection's receive buffer and is only valid during the call.
+typedef std::function<void(std::string_view, ReplyFn)> LineHandler;
+// Handles one binary peer frame, answering through the ReplyFn like a line; false if
+// the frame is malformed, which closes the connection.
+typedef std::function<bool(std::string_view, ReplyFn)> FrameHandler;
+
+struct ReactorStats {
+    long long accepted;
+    long long open;
+    long long requests;
+};
+
+// Edge-triggered epoll loop serving every connection on one thread. Requests whose
+// reply is not ready yet (writes waiting for a quorum) complete later through a
+// ReplyFn, which queues the reply and wakes the loop through an eventfd. Replies are
+// written back in request order even when they complete out of order.
+class Reactor{
+private:
+    struct Conn {
+        int fd;
+        LineBuffer in;
+        std::string out;
+        bool binary;
+        bool paused;
+        bool eof;
+        uint64_t nextSeq;
+        uint64_t flushSeq;
+        std::map<uint64_t, std::string> ready;
+    };
+
+    struct Completion {
+        uint64_t conn;
+        uint64_t seq;
+        std::string reply;
+    };
+
+    // epoll user data for the two non-connection descriptors
+    static const uint64_t LISTEN_ID = 0;
+    static const uint64_t WAKE_ID = 1;
+
+    int epfd;
+    int listenfd;
+    int wakefd;
+    uint64_t nextId;
+    std::unordered_map<uint64_t, std::unique_ptr<Conn>> conns;
+    std::thread::id loopThread;
+    // connections given replies on the loop thread, flushed once the current batch of
+    // events is handled: flushing in post() itself could close or read a connection
+    // that is still being processed further up the stack
+    std::vector<uint64_t> dirty;
+
+    std::mutex doneMu;
+    std::vector<Completion> done;
+
+    LineHandler onLine;
+    FrameHandler onFrame;
+
+    std::atomic<long long> accepted;
+    std::atomic<long long> open;
+    std::atomic<long long> requests;
+
+    void acceptAll(){
+        while(true){
+            int fd = accept4(listenfd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if(fd < 0){
+                if(errno == EINTR) continue;
+                if(errno != EAGAIN && errno != EWOULDBLOCK) perror("ERROR: failed to accept");
+                return;
+            }
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+            uint64_t id = nextId++;
+            std::unique_ptr<Conn> c(new Conn());
+            c->fd = fd;
+            c->binary = false;
+            c->paused = false;
+            c->eof = false;
+            c->nextSeq = 0;
+            c->flushSeq = 0;
+
+            epoll_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            ev.data.u64 = id;
+            if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0){
+                close(fd);
+                continue;
+            }
+            conns[id] = std::move(c);
+            accepted++;
+            open++;
+            serverMetrics().accepted.add();
+            serverMetrics().open.add(1);
+        }
+    }
+
+    void closeConn(uint64_t id){
+        auto it = conns.find(id);
+        if(it == conns.end()) return;
+        epoll_ctl(epfd, EPOLL_CTL_DEL, it->second->fd, nullptr);
+        close(it->second->fd);
+        conns.erase(it);
+        open--;
+        serverMetrics().open.add(-1);
+    }
+
+    // returns false if the connection was closed
+    bool readAll(uint64_t id, Conn &c){
+        while(!c.paused && !c.eof){
+            char *buf = c.in.space(REACTOR_READ_CHUNK);
+            ssize_t n = recv(c.fd, buf, c.in.room(), 0);
+            if(n > 0){
+                c.in.commit(n);
+                serverMetrics().bytesIn.add(n);
+                if(!process(id, c)) return false;
+                continue;
+            }
+            if(n < 0 && errno == EINTR) continue;
+            if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+            if(n < 0){
+                closeConn(id);
+                return false;
+            }
+            // half-closed: answer what was already asked, then close in flush()
+            c.eof = true;
+        }
+        return true;
+    }
+
+    // splits c.in into requests and dispatches them; false if the connection was closed
+    bool process(uint64_t id, Conn &c){
+        while(c.in.size() > 0){
+            if(c.binary){
+                std::string_view d = c.in.data();
+                size_t frameLen = 0;
+                int r = wireFrameReady(d.data(), d.size(), frameLen);
+                if(r == 0) break;
+                requests++;
+                uint64_t seq = c.nextSeq++;
+                if(r < 0 || !onFrame(d.substr(0, frameLen), [this, id, seq](std::string reply){ post(id, seq, std::move(reply)); })){
+                    closeConn(id);
+                    return false;
+                }
+                c.in.consume(frameLen);
+                continue;
+            }
+
+            std::string_view msg;
+            if(!c.in.nextLine(msg)) break;
+            if(msg.empty()) continue;
+
+            requests++;
+            uint64_t seq = c.nextSeq++;
+            std::string hello;
+            if(negotiateHello(msg, hello, c.binary)){
+                complete(c, seq, std::move(hello));
+                continue;
+            }
+            onLine(msg, [this, id, seq](std::string reply){ post(id, seq, std::move(reply)); });
+        }
+
+        if(c.out.size() > REACTOR_MAX_OUTBUF) c.paused = true;
+        return true;
+    }
+
+    // queues a reply and writes out every reply that is now next in order
+    void complete(Conn &c, uint64_t seq, std::string reply){
+        if(seq == c.flushSeq){
+            c.out += reply;
+            c.flushSeq++;
+            auto it = c.ready.begin();
+            while(it != c.ready.end() && it->first == c.flushSeq){
+                c.out += it->second;
+                c.flushSeq++;
+                it = c.ready.erase(it);
+            }
+        } else {
+            c.ready[seq] = std::move(reply);
+        }
+    }
+
+    // returns false if the connection was closed
+    bool flush(uint64_t id, Conn &c){
+        while(!c.out.empty()){
+            ssize_t n = send(c.fd, c.out.data(), c.out.size(), MSG_NOSIGNAL);
+            if(n > 0){
+                c.out.erase(0, n);
+                serverMetrics().bytesOut.add(n);
+                continue;
+            }
+            if(n < 0 && errno == EINTR) continue;
+            if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+            closeConn(id);
+            return false;
+        }
+        if(c.eof && c.flushSeq == c.nextSeq){
+            closeConn(id);
+            return false;
+        }
+        if(c.paused){
+            c.paused = false;
+            return readAll(id, c);
+        }
+        return true;
+    }
+
+    void post(uint64_t id, uint64_t seq, std::string reply){
+        if(std::this_thread::get_id() == loopThread){
+            auto it = conns.find(id);
+            if(it == conns.end()) return;
+            complete(*it->second, seq, std::move(reply));
+            dirty.push_back(id);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lk(doneMu);
+            done.push_back(Completion{id, seq, std::move(reply)});
+        }
+        uint64_t one = 1;
+        ssize_t w = write(wakefd, &one, sizeof(one));
+        (void)w;
+    }
+
+    void drainCompletions(){
+        uint64_t v;
+        ssize_t r = read(wakefd, &v, sizeof(v));
+        (void)r;
+
+        std::vector<Completion> batch;
+        {
+            std::lock_guard<std::mutex> lk(doneMu);
+            batch.swap(done);
+        }
+        for(auto &d : batch){
+            auto it = conns.find(d.conn);
+            if(it == conns.end()) continue;
+            complete(*it->second, d.seq, std::move(d.reply));
+            dirty.push_back(d.conn);
+        }
+    }
+
+    // a flush may resume reading a paused connection, which can complete more
+    // replies, so this runs until nothing is left
+    void flushDirty(){
+        while(!dirty.empty()){
+            std::vector<uint64_t> ids;
+            ids.swap(dirty);
+            std::sort(ids.begin(), ids.end());
+            ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+            for(uint64_t id : ids){
+                auto it = conns.find(id);
+                if(it != conns.end()) flush(id, *it->second);
+            }
+        }
+    }
+
+public:
+    Reactor(LineHandler lineFn, FrameHandler frameFn)
+      : epfd(-1), listenfd(-1), wakefd(-1), nextId(16),
+        onLine(lineFn), onFrame(frameFn),
+        accepted(0), open(0), requests(0) {}
+
+    ~Reactor(){
+        for(auto &c : conns) close(c.second->fd);
+        if(wakefd >= 0) close(wakefd);
+        if(epfd >= 0) close(epfd);
+    }
+
+    // takes a bound, listening socket; it is switched to non-blocking here
+    int Init(int lfd){
+        listenfd = lfd;
+        fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL, 0) | O_NONBLOCK);
+
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(epfd < 0 || wakefd < 0){
+            perror("ERROR: failed to create epoll instance");
+            return 0;
+        }
+
+        epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.u64 = LISTEN_ID;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev);
+        ev.data.u64 = WAKE_ID;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev);
+        return 1;
+    }
+
+    void run(){
+        loopThread = std::this_thread::get_id();
+        epoll_event events[REACTOR_MAX_EVENTS];
+
+        while(true){
+            int n = epoll_wait(epfd, events, REACTOR_MAX_EVENTS, -1);
+            if(n < 0){
+                if(errno == EINTR) continue;
+                perror("ERROR: epoll_wait failed");
+                return;
+            }
+
+            for(int i = 0; i < n; i++){
+                uint64_t id = events[i].data.u64;
+                if(id == LISTEN_ID){ acceptAll(); continue; }
+                if(id == WAKE_ID){ drainCompletions(); continue; }
+
+                auto it = conns.find(id);
+                if(it == conns.end()) continue;
+                Conn &c = *it->second;
+
+                if(events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)){
+                    if(!readAll(id, c)) continue;
+                }
+                flush(id, c);
+            }
+            flushDirty();
+        }
+    }
+
+    ReactorStats stats() const {
+        return ReactorStats{accepted, open, requests};
+    }
+};
+
+#endif
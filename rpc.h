@@ -0,0 +1,894 @@
+#ifndef __RPC_H__
+#define __RPC_H__
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <sstream>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+
+// Peer RPCs travel either as the original space-separated text lines or, once both
+// ends agree with "HELLO proto=<v>", as binary frames:
+//
+//   u8 magic | u8 version | u8 type | u8 flags | u32 payload length | payload
+//
+// The header length is a little-endian u32; payload integers are LEB128 varints, so
+// the small terms and indices of a heartbeat cost a byte each. AppendEntries payloads
+// carry their entries as a counted batch of (term, ts, kind, fields) records: sensor
+// entries travel as their parsed fields and anything else as (length, bytes), so
+// commands need no escaping. Version 2 peers, which sent every entry as text, fall
+// back to the text protocol. InstallSnapshot carries one chunk of a snapshot the
+// same way. ReadIndex asks a peer for the index a linearizable read must wait for.
+// ReqVote ends in an optional flags field, absent (0) from older peers: a pre-vote
+// asks whether a vote would be granted, without anyone changing term; a transfer vote
+// was started by TimeoutNow, which a leader handing over leadership sends its target.
+//
+// A server may host several Raft groups (see multiraft.h). A request for group g > 0
+// carries g in the header's flags byte, or starts with "GROUP <g> " as text; group 0
+// goes untagged, so a server hosting one group talks to older peers as before.
+
+#define WIRE_MAGIC        0xFB
+#define WIRE_VERSION      3
+#define WIRE_HEADER_SIZE  8
+#define WIRE_MAX_FRAME    (64 << 20)
+
+enum WireType : uint8_t {
+    WIRE_REQVOTE = 1,
+    WIRE_REQVOTE_RESP = 2,
+    WIRE_APPEND = 3,
+    WIRE_APPEND_RESP = 4,
+    WIRE_SNAPSHOT = 5,
+    WIRE_SNAPSHOT_RESP = 6,
+    WIRE_READINDEX = 7,
+    WIRE_READINDEX_RESP = 8,
+    WIRE_TIMEOUTNOW = 9,
+    WIRE_TIMEOUTNOW_RESP = 10,
+};
+
+#define REQVOTE_PRE       1
+#define REQVOTE_TRANSFER  2
+
+// What a log entry holds. The leader parses a sensor command once, when it appends
+// it (see parseCommand), and the typed fields are what is replicated, logged and
+// applied. Anything else, such as the leader's no-op or a CMD payload, stays text.
+enum class EntryKind : uint8_t { Opaque = 0, Heartbeat = 1, Data = 2 };
+
+// ts is the leader's wall clock (ms since the epoch) when the entry was appended.
+// node is set for Heartbeat and Data, temp and humidity for Data, command for Opaque.
+struct Log{
+    int term;
+    EntryKind kind;
+    int16_t temp;
+    int16_t humidity;
+    int node;
+    int64_t ts;
+    std::string command;
+    Log(int t=0, std::string c="", int64_t when=0)
+      : term(t), kind(EntryKind::Opaque), temp(0), humidity(0), node(0), ts(when), command(std::move(c)) {}
+};
+
+// wall-clock milliseconds since the epoch, the unit of Log::ts
+static inline int64_t wallClockMs(){
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+struct ReqVoteArgs {
+    int term;
+    int candidate;
+    int lastLogIndex;
+    int lastLogTerm;
+    bool preVote;       // term is the one the candidate would stand in
+    bool transfer;      // the leader asked for this election; voters drop their stickiness
+};
+
+struct ReqVoteReply {
+    int term;
+    bool granted;
+};
+
+struct AppendEntriesArgs {
+    int term;
+    int leader;
+    int prevIdx;
+    int prevTerm;
+    int leaderCommit;
+    std::vector<Log> entries;
+};
+
+struct AppendEntriesReply {
+    int term;
+    bool success;
+    int conflictTerm;
+    int conflictIndex;
+};
+
+// one chunk of the leader's latest snapshot, sent in order from offset 0
+struct InstallSnapshotArgs {
+    int term;
+    int leader;
+    int lastIndex;      // last log index the snapshot covers
+    int lastTerm;
+    int offset;
+    bool done;          // this chunk ends the snapshot
+    std::string data;
+};
+
+struct InstallSnapshotReply {
+    int term;
+    int nextOffset;     // bytes of this snapshot the follower holds; resume from here
+};
+
+// a follower asking for a read index; also how servers learn each other's ids
+struct ReadIndexArgs {
+    int term;
+    int from;
+};
+
+struct ReadIndexReply {
+    int term;
+    int id;             // the responder's server id
+    int leader;         // who the responder believes leads, -1 if unknown
+    int index;          // commit index a read may be served at, -1 if the responder
+                        // is not a leader with a confirmed lease right now
+};
+
+// the leader handing leadership to the receiver, which is fully caught up by now
+struct TimeoutNowArgs {
+    int term;
+    int leader;
+};
+
+struct TimeoutNowReply {
+    int term;
+};
+
+static inline int reqVoteFlags(const ReqVoteArgs &a){
+    return (a.preVote ? REQVOTE_PRE : 0) | (a.transfer ? REQVOTE_TRANSFER : 0);
+}
+
+static inline bool is_ws(char c){
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+}
+
+static inline std::vector<std::string> split_ws(std::string_view s){
+    std::vector<std::string> out;
+    size_t i = 0;
+    while(i < s.size()){
+        while(i < s.size() && is_ws(s[i])) i++;
+        size_t start = i;
+        while(i < s.size() && !is_ws(s[i])) i++;
+        if(i > start) out.emplace_back(s.substr(start, i - start));
+    }
+    return out;
+}
+
+static inline int parse_int(std::string_view s){
+    long v = 0;
+    size_t i = 0;
+    bool neg = false;
+    if(i < s.size() && (s[i] == '-' || s[i] == '+')) neg = s[i++] == '-';
+    while(i < s.size() && s[i] >= '0' && s[i] <= '9') v = v * 10 + (s[i++] - '0');
+    return (int)(neg ? -v : v);
+}
+
+// the range the state machine stores temperature and humidity in
+static inline bool fits_int16(long v){
+    return v >= -32768 && v <= 32767;
+}
+
+// Log entries and "SNAP" snapshots written before ingest checked the int16 range may
+// hold wider readings; those are saturated with this, explicitly, and nowhere else.
+static inline int saturate_int16(int v){
+    return std::max(-32768, std::min(32767, v));
+}
+
+static inline bool starts_with(std::string_view s, std::string_view prefix){
+    return s.substr(0, prefix.size()) == prefix;
+}
+
+// the next whitespace-separated token of s, which is advanced past it; empty at the end
+static inline std::string_view next_token(std::string_view &s){
+    size_t i = 0;
+    while(i < s.size() && is_ws(s[i])) i++;
+    size_t start = i;
+    while(i < s.size() && !is_ws(s[i])) i++;
+    std::string_view t = s.substr(start, i - start);
+    s.remove_prefix(i);
+    return t;
+}
+
+// unlike parse_int, the whole of s must be an integer in int range
+static inline bool parse_int_strict(std::string_view s, int &out){
+    size_t i = 0;
+    bool neg = false;
+    if(i < s.size() && (s[i] == '-' || s[i] == '+')) neg = s[i++] == '-';
+    if(i == s.size()) return false;
+    long long v = 0;
+    for(; i < s.size(); i++){
+        if(s[i] < '0' || s[i] > '9') return false;
+        v = v * 10 + (s[i] - '0');
+        if(v > (long long)INT32_MAX + 1) return false;
+    }
+    if(neg) v = -v;
+    if(v > INT32_MAX) return false;
+    out = (int)v;
+    return true;
+}
+
+// Fills e's typed fields from a sensor command:
+//   HEARTBEAT node=<id>                      (or the older "HEARTBEAT node <id>")
+//   DATA node=<id> temp=<t> humidity=<h>     (keys in any order)
+// Returns false if cmd starts with HEARTBEAT or DATA but is malformed, a reading
+// outside int16 included unless legacy is set, which saturates it instead. Any other
+// command leaves e Opaque, and the caller keeps its text.
+static inline bool parseCommand(std::string_view cmd, Log &e, bool legacy = false){
+    e.kind = EntryKind::Opaque;
+    std::string_view rest = cmd;
+    std::string_view verb = next_token(rest);
+    bool heartbeat = verb == "HEARTBEAT";
+    if(!heartbeat && verb != "DATA") return true;
+
+    int node = 0, temp = 0, hum = 0;
+    int seen = 0;
+    for(std::string_view t = next_token(rest); !t.empty(); t = next_token(rest)){
+        int bit, *val;
+        std::string_view v;
+        if(starts_with(t, "node=")){ bit = 1; val = &node; v = t.substr(5); }
+        else if(heartbeat && t == "node"){ bit = 1; val = &node; v = next_token(rest); }
+        else if(!heartbeat && starts_with(t, "temp=")){ bit = 2; val = &temp; v = t.substr(5); }
+        else if(!heartbeat && starts_with(t, "humidity=")){ bit = 4; val = &hum; v = t.substr(9); }
+        else return false;
+        if((seen & bit) || !parse_int_strict(v, *val)) return false;
+        seen |= bit;
+    }
+    if(seen != (heartbeat ? 1 : 7)) return false;
+    if(legacy){
+        temp = saturate_int16(temp);
+        hum = saturate_int16(hum);
+    }
+    if(!fits_int16(temp) || !fits_int16(hum)) return false;
+
+    e.kind = heartbeat ? EntryKind::Heartbeat : EntryKind::Data;
+    e.node = node;
+    e.temp = temp;
+    e.humidity = hum;
+    return true;
+}
+
+// An entry for a command that is already in some log, arriving from a text-protocol
+// peer or an older WAL record. A malformed sensor command was accepted back then, so
+// it stays as text, and a reading outside int16 saturates as it did then.
+static inline Log commandEntry(int term, std::string cmd, int64_t ts){
+    Log e(term, std::string(), ts);
+    parseCommand(cmd, e, true);
+    if(e.kind == EntryKind::Opaque) e.command = std::move(cmd);
+    return e;
+}
+
+// an entry as its command line, for the text peer protocol
+static inline std::string commandText(const Log &e){
+    switch(e.kind){
+    case EntryKind::Heartbeat:
+        return "HEARTBEAT node=" + std::to_string(e.node);
+    case EntryKind::Data:
+        return "DATA node=" + std::to_string(e.node) + " temp=" + std::to_string(e.temp) +
+               " humidity=" + std::to_string(e.humidity);
+    default:
+        return e.command;
+    }
+}
+
+// Answers a "HELLO proto=<v>" line and reports whether the connection switches to
+// binary frames, which it does only if the peer offers this version. Otherwise the
+// answer is proto=0, which keeps a peer of any version on text. False if msg is not
+// a HELLO.
+static inline bool negotiateHello(std::string_view msg, std::string &reply, bool &binary){
+    if(!starts_with(msg, "HELLO proto=")) return false;
+    binary = parse_int(msg.substr(12)) >= WIRE_VERSION;
+    reply = "HELLO proto=" + std::to_string(binary ? WIRE_VERSION : 0) + "\n";
+    return true;
+}
+
+// ---- text encoding ----
+
+// entry commands are percent-escaped so they survive whitespace tokenizing
+static inline std::string text_escape(const std::string &in){
+    static const char hex[] = "0123456789ABCDEF";
+    std::string out;
+    out.reserve(in.size());
+    for(unsigned char c : in){
+        if(c == '%' || c <= ' '){
+            out.push_back('%');
+            out.push_back(hex[c >> 4]);
+            out.push_back(hex[c & 15]);
+        } else {
+            out.push_back(c);
+        }
+    }
+    return out;
+}
+
+static inline std::string text_unescape(const std::string &in){
+    std::string out;
+    out.reserve(in.size());
+    for(size_t i = 0; i < in.size(); i++){
+        if(in[i] == '%' && i + 2 < in.size()){
+            char h[3] = {in[i+1], in[i+2], 0};
+            out.push_back((char)strtol(h, nullptr, 16));
+            i += 2;
+        } else {
+            out.push_back(in[i]);
+        }
+    }
+    return out;
+}
+
+static inline std::string encodeText(const ReqVoteArgs &a){
+    std::ostringstream out;
+    out << "ReqVote " << a.term << " " << a.candidate
+        << " " << a.lastLogIndex << " " << a.lastLogTerm;
+    if(reqVoteFlags(a)) out << " " << reqVoteFlags(a);
+    return out.str();
+}
+
+static inline std::string encodeText(const ReqVoteReply &r){
+    std::ostringstream out;
+    out << "ReqVote_RESP " << r.term << " " << (r.granted?1:0);
+    return out.str();
+}
+
+static inline std::string encodeText(const AppendEntriesArgs &a){
+    std::ostringstream out;
+    out << "AppendEntries "
+        << a.term << " " << a.leader << " "
+        << a.prevIdx << " " << a.prevTerm << " "
+        << a.leaderCommit << " " << a.entries.size();
+    for(auto &e : a.entries) out << " " << e.term << "|" << e.ts << "|" << text_escape(commandText(e));
+    return out.str();
+}
+
+static inline std::string encodeText(const AppendEntriesReply &r){
+    std::ostringstream out;
+    out << "AppendEntries_RESP " << r.term << " " << (r.success?1:0)
+        << " " << r.conflictTerm << " " << r.conflictIndex;
+    return out.str();
+}
+
+static inline std::string encodeText(const InstallSnapshotArgs &a){
+    std::ostringstream out;
+    out << "InstallSnapshot " << a.term << " " << a.leader << " "
+        << a.lastIndex << " " << a.lastTerm << " " << a.offset << " " << (a.done?1:0)
+        << " " << text_escape(a.data);
+    return out.str();
+}
+
+static inline std::string encodeText(const InstallSnapshotReply &r){
+    std::ostringstream out;
+    out << "InstallSnapshot_RESP " << r.term << " " << r.nextOffset;
+    return out.str();
+}
+
+static inline std::string encodeText(const ReadIndexArgs &a){
+    std::ostringstream out;
+    out << "ReadIndex " << a.term << " " << a.from;
+    return out.str();
+}
+
+static inline std::string encodeText(const ReadIndexReply &r){
+    std::ostringstream out;
+    out << "ReadIndex_RESP " << r.term << " " << r.id << " " << r.leader << " " << r.index;
+    return out.str();
+}
+
+static inline std::string encodeText(const TimeoutNowArgs &a){
+    std::ostringstream out;
+    out << "TimeoutNow " << a.term << " " << a.leader;
+    return out.str();
+}
+
+static inline std::string encodeText(const TimeoutNowReply &r){
+    std::ostringstream out;
+    out << "TimeoutNow_RESP " << r.term;
+    return out.str();
+}
+
+static inline bool decodeText(std::string_view msg, ReqVoteArgs &a){
+    auto t = split_ws(msg);
+    if(t.size() < 5 || t[0] != "ReqVote") return false;
+    a.term = parse_int(t[1]);
+    a.candidate = parse_int(t[2]);
+    a.lastLogIndex = parse_int(t[3]);
+    a.lastLogTerm = parse_int(t[4]);
+    int flags = t.size() > 5 ? parse_int(t[5]) : 0;
+    a.preVote = flags & REQVOTE_PRE;
+    a.transfer = flags & REQVOTE_TRANSFER;
+    return true;
+}
+
+static inline bool decodeText(std::string_view msg, ReqVoteReply &r){
+    auto t = split_ws(msg);
+    if(t.size() < 3 || t[0] != "ReqVote_RESP") return false;
+    r.term = parse_int(t[1]);
+    r.granted = parse_int(t[2]) == 1;
+    return true;
+}
+
+static inline bool decodeText(std::string_view msg, AppendEntriesArgs &a){
+    auto t = split_ws(msg);
+    if(t.size() < 7 || t[0] != "AppendEntries") return false;
+    a.term = parse_int(t[1]);
+    a.leader = parse_int(t[2]);
+    a.prevIdx = parse_int(t[3]);
+    a.prevTerm = parse_int(t[4]);
+    a.leaderCommit = parse_int(t[5]);
+    int count = parse_int(t[6]);
+    if(count < 0 || (int)t.size() < 7 + count) return false;
+
+    a.entries.clear();
+    a.entries.reserve(count);
+    for(int i = 0; i < count; i++){
+        const std::string &e = t[7+i];
+        size_t pos = e.find('|');
+        size_t pos2 = pos == std::string::npos ? pos : e.find('|', pos + 1);
+        if(pos2 == std::string::npos) return false;
+        a.entries.push_back(commandEntry(parse_int(e.substr(0,pos)), text_unescape(e.substr(pos2+1)),
+                                         strtoll(e.c_str() + pos + 1, nullptr, 10)));
+    }
+    return true;
+}
+
+static inline bool decodeText(std::string_view msg, AppendEntriesReply &r){
+    auto t = split_ws(msg);
+    if(t.size() < 5 || t[0] != "AppendEntries_RESP") return false;
+    r.term = parse_int(t[1]);
+    r.success = parse_int(t[2]) == 1;
+    r.conflictTerm = parse_int(t[3]);
+    r.conflictIndex = parse_int(t[4]);
+    return true;
+}
+
+static inline bool decodeText(std::string_view msg, InstallSnapshotArgs &a){
+    auto t = split_ws(msg);
+    if(t.size() < 7 || t[0] != "InstallSnapshot") return false;
+    a.term = parse_int(t[1]);
+    a.leader = parse_int(t[2]);
+    a.lastIndex = parse_int(t[3]);
+    a.lastTerm = parse_int(t[4]);
+    a.offset = parse_int(t[5]);
+    a.done = parse_int(t[6]) == 1;
+    a.data = t.size() > 7 ? text_unescape(t[7]) : std::string();
+    return true;
+}
+
+static inline bool decodeText(std::string_view msg, InstallSnapshotReply &r){
+    auto t = split_ws(msg);
+    if(t.size() < 3 || t[0] != "InstallSnapshot_RESP") return false;
+    r.term = parse_int(t[1]);
+    r.nextOffset = parse_int(t[2]);
+    return true;
+}
+
+static inline bool decodeText(std::string_view msg, ReadIndexArgs &a){
+    auto t = split_ws(msg);
+    if(t.size() < 3 || t[0] != "ReadIndex") return false;
+    a.term = parse_int(t[1]);
+    a.from = parse_int(t[2]);
+    return true;
+}
+
+static inline bool decodeText(std::string_view msg, ReadIndexReply &r){
+    auto t = split_ws(msg);
+    if(t.size() < 5 || t[0] != "ReadIndex_RESP") return false;
+    r.term = parse_int(t[1]);
+    r.id = parse_int(t[2]);
+    r.leader = parse_int(t[3]);
+    r.index = parse_int(t[4]);
+    return true;
+}
+
+static inline bool decodeText(std::string_view msg, TimeoutNowArgs &a){
+    auto t = split_ws(msg);
+    if(t.size() < 3 || t[0] != "TimeoutNow") return false;
+    a.term = parse_int(t[1]);
+    a.leader = parse_int(t[2]);
+    return true;
+}
+
+static inline bool decodeText(std::string_view msg, TimeoutNowReply &r){
+    auto t = split_ws(msg);
+    if(t.size() < 2 || t[0] != "TimeoutNow_RESP") return false;
+    r.term = parse_int(t[1]);
+    return true;
+}
+
+// ---- binary encoding ----
+
+static inline void put_u32(std::string &out, uint32_t v){
+    char b[4] = {(char)(v & 0xff), (char)((v >> 8) & 0xff), (char)((v >> 16) & 0xff), (char)((v >> 24) & 0xff)};
+    out.append(b, 4);
+}
+
+static inline uint32_t get_u32(const char *p){
+    const unsigned char *u = (const unsigned char*)p;
+    return (uint32_t)u[0] | ((uint32_t)u[1] << 8) | ((uint32_t)u[2] << 16) | ((uint32_t)u[3] << 24);
+}
+
+static inline void put_varint(std::string &out, uint32_t v){
+    while(v >= 0x80){
+        out.push_back((char)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((char)v);
+}
+
+static inline void put_varint64(std::string &out, uint64_t v){
+    while(v >= 0x80){
+        out.push_back((char)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((char)v);
+}
+
+// bounds-checked reader over one frame payload
+struct WireReader {
+    const char *p;
+    size_t left;
+    bool ok;
+
+    WireReader(const char *data, size_t n) : p(data), left(n), ok(true) {}
+
+    int varint(){
+        uint32_t v = 0;
+        for(int shift = 0; shift < 35; shift += 7){
+            if(left == 0){ ok = false; return 0; }
+            unsigned char b = *p++;
+            left--;
+            v |= (uint32_t)(b & 0x7f) << shift;
+            if(!(b & 0x80)) return (int)v;
+        }
+        ok = false;
+        return 0;
+    }
+
+    uint64_t varint64(){
+        uint64_t v = 0;
+        for(int shift = 0; shift < 70; shift += 7){
+            if(left == 0){ ok = false; return 0; }
+            unsigned char b = *p++;
+            left--;
+            v |= (uint64_t)(b & 0x7f) << shift;
+            if(!(b & 0x80)) return v;
+        }
+        ok = false;
+        return 0;
+    }
+
+    bool bytes(std::string &out, size_t n){
+        if(left < n){ ok = false; return false; }
+        out.assign(p, n);
+        p += n; left -= n;
+        return true;
+    }
+};
+
+static inline uint32_t zigzag(int v){ return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31); }
+static inline int unzigzag(uint32_t v){ return (int)(v >> 1) ^ -(int)(v & 1); }
+
+// an entry's kind and what it holds, after its term and ts: Opaque (length, bytes),
+// Heartbeat (node) or Data (node, temp, humidity), signed values zigzagged
+static inline void put_entry_body(std::string &out, const Log &e){
+    put_varint(out, (uint32_t)e.kind);
+    switch(e.kind){
+    case EntryKind::Heartbeat:
+        put_varint(out, zigzag(e.node));
+        break;
+    case EntryKind::Data:
+        put_varint(out, zigzag(e.node));
+        put_varint(out, zigzag(e.temp));
+        put_varint(out, zigzag(e.humidity));
+        break;
+    default:
+        put_varint(out, e.command.size());
+        out.append(e.command);
+    }
+}
+
+static inline bool get_entry_body(WireReader &r, Log &e){
+    e.kind = (EntryKind)r.varint();
+    switch(e.kind){
+    case EntryKind::Heartbeat:
+        e.node = unzigzag(r.varint());
+        break;
+    case EntryKind::Data: {
+        e.node = unzigzag(r.varint());
+        int temp = unzigzag(r.varint());
+        int hum = unzigzag(r.varint());
+        if(!fits_int16(temp) || !fits_int16(hum)) return false;
+        e.temp = temp;
+        e.humidity = hum;
+        break;
+    }
+    case EntryKind::Opaque: {
+        size_t len = (uint32_t)r.varint();
+        if(!r.ok) return false;
+        r.bytes(e.command, len);
+        break;
+    }
+    default:
+        return false;
+    }
+    return r.ok;
+}
+
+static inline std::string wire_begin(WireType type, size_t reserve){
+    std::string out;
+    out.reserve(WIRE_HEADER_SIZE + reserve);
+    out.push_back((char)WIRE_MAGIC);
+    out.push_back((char)WIRE_VERSION);
+    out.push_back((char)type);
+    out.push_back(0);
+    put_u32(out, 0);
+    return out;
+}
+
+static inline void wire_finish(std::string &out){
+    uint32_t len = out.size() - WIRE_HEADER_SIZE;
+    for(int i = 0; i < 4; i++) out[4+i] = (char)((len >> (8*i)) & 0xff);
+}
+
+// Returns 1 if buf starts with a whole frame (its size in frameLen), 0 if more bytes
+// are needed, and -1 if the bytes cannot be a valid frame.
+static inline int wireFrameReady(const char *buf, size_t n, size_t &frameLen){
+    if(n < WIRE_HEADER_SIZE) return 0;
+    if((unsigned char)buf[0] != WIRE_MAGIC || (unsigned char)buf[1] != WIRE_VERSION) return -1;
+    uint32_t len = get_u32(buf + 4);
+    if(len > WIRE_MAX_FRAME) return -1;
+    if(n < WIRE_HEADER_SIZE + (size_t)len) return 0;
+    frameLen = WIRE_HEADER_SIZE + len;
+    return 1;
+}
+
+static inline WireType wireFrameType(const char *frame){
+    return (WireType)(unsigned char)frame[2];
+}
+
+static inline int wireFrameGroup(const char *frame){
+    return (unsigned char)frame[3];
+}
+
+// marks an encoded request, frame or text line, for Raft group g
+static inline void tagGroup(std::string &out, bool binary, int g){
+    if(g == 0) return;
+    if(binary) out[3] = (char)g;
+    else out.insert(0, "GROUP " + std::to_string(g) + " ");
+}
+
+// strips a "GROUP <g> " prefix from a text request and returns g: 0 if there is
+// none, -1 if it is malformed
+static inline int takeTextGroup(std::string_view &msg){
+    if(!starts_with(msg, "GROUP ")) return 0;
+    msg.remove_prefix(6);
+    int g;
+    if(!parse_int_strict(next_token(msg), g) || g < 0) return -1;
+    while(!msg.empty() && msg.front() == ' ') msg.remove_prefix(1);
+    return g;
+}
+
+static inline std::string encodeFrame(const ReqVoteArgs &a){
+    std::string out = wire_begin(WIRE_REQVOTE, 16);
+    put_varint(out, a.term);
+    put_varint(out, a.candidate);
+    put_varint(out, a.lastLogIndex);
+    put_varint(out, a.lastLogTerm);
+    if(reqVoteFlags(a)) put_varint(out, reqVoteFlags(a));
+    wire_finish(out);
+    return out;
+}
+
+static inline std::string encodeFrame(const ReqVoteReply &r){
+    std::string out = wire_begin(WIRE_REQVOTE_RESP, 8);
+    put_varint(out, r.term);
+    put_varint(out, r.granted ? 1 : 0);
+    wire_finish(out);
+    return out;
+}
+
+static inline std::string encodeFrame(const AppendEntriesArgs &a){
+    size_t payload = 30;
+    for(auto &e : a.entries) payload += 20 + e.command.size();
+
+    std::string out = wire_begin(WIRE_APPEND, payload);
+    put_varint(out, a.term);
+    put_varint(out, a.leader);
+    put_varint(out, a.prevIdx);
+    put_varint(out, a.prevTerm);
+    put_varint(out, a.leaderCommit);
+    put_varint(out, a.entries.size());
+    for(auto &e : a.entries){
+        put_varint(out, e.term);
+        put_varint64(out, e.ts);
+        put_entry_body(out, e);
+    }
+    wire_finish(out);
+    return out;
+}
+
+static inline std::string encodeFrame(const AppendEntriesReply &r){
+    std::string out = wire_begin(WIRE_APPEND_RESP, 16);
+    put_varint(out, r.term);
+    put_varint(out, r.success ? 1 : 0);
+    put_varint(out, r.conflictTerm);
+    put_varint(out, r.conflictIndex);
+    wire_finish(out);
+    return out;
+}
+
+static inline std::string encodeFrame(const InstallSnapshotArgs &a){
+    std::string out = wire_begin(WIRE_SNAPSHOT, 32 + a.data.size());
+    put_varint(out, a.term);
+    put_varint(out, a.leader);
+    put_varint(out, a.lastIndex);
+    put_varint(out, a.lastTerm);
+    put_varint(out, a.offset);
+    put_varint(out, a.done ? 1 : 0);
+    put_varint(out, a.data.size());
+    out.append(a.data);
+    wire_finish(out);
+    return out;
+}
+
+static inline std::string encodeFrame(const InstallSnapshotReply &r){
+    std::string out = wire_begin(WIRE_SNAPSHOT_RESP, 8);
+    put_varint(out, r.term);
+    put_varint(out, r.nextOffset);
+    wire_finish(out);
+    return out;
+}
+
+static inline std::string encodeFrame(const ReadIndexArgs &a){
+    std::string out = wire_begin(WIRE_READINDEX, 8);
+    put_varint(out, a.term);
+    put_varint(out, a.from);
+    wire_finish(out);
+    return out;
+}
+
+// leader and index go out shifted by one so that -1 stays a single byte
+static inline std::string encodeFrame(const ReadIndexReply &r){
+    std::string out = wire_begin(WIRE_READINDEX_RESP, 16);
+    put_varint(out, r.term);
+    put_varint(out, r.id);
+    put_varint(out, r.leader + 1);
+    put_varint(out, r.index + 1);
+    wire_finish(out);
+    return out;
+}
+
+static inline std::string encodeFrame(const TimeoutNowArgs &a){
+    std::string out = wire_begin(WIRE_TIMEOUTNOW, 8);
+    put_varint(out, a.term);
+    put_varint(out, a.leader);
+    wire_finish(out);
+    return out;
+}
+
+static inline std::string encodeFrame(const TimeoutNowReply &r){
+    std::string out = wire_begin(WIRE_TIMEOUTNOW_RESP, 4);
+    put_varint(out, r.term);
+    wire_finish(out);
+    return out;
+}
+
+static inline bool decodeFrame(std::string_view f, ReqVoteArgs &a){
+    if(f.size() < WIRE_HEADER_SIZE || wireFrameType(f.data()) != WIRE_REQVOTE) return false;
+    WireReader r(f.data() + WIRE_HEADER_SIZE, f.size() - WIRE_HEADER_SIZE);
+    a.term = r.varint();
+    a.candidate = r.varint();
+    a.lastLogIndex = r.varint();
+    a.lastLogTerm = r.varint();
+    int flags = r.left > 0 ? r.varint() : 0;
+    a.preVote = flags & REQVOTE_PRE;
+    a.transfer = flags & REQVOTE_TRANSFER;
+    return r.ok;
+}
+
+static inline bool decodeFrame(std::string_view f, ReqVoteReply &rep){
+    if(f.size() < WIRE_HEADER_SIZE || wireFrameType(f.data()) != WIRE_REQVOTE_RESP) return false;
+    WireReader r(f.data() + WIRE_HEADER_SIZE, f.size() - WIRE_HEADER_SIZE);
+    rep.term = r.varint();
+    rep.granted = r.varint() == 1;
+    return r.ok;
+}
+
+static inline bool decodeFrame(std::string_view f, AppendEntriesArgs &a){
+    if(f.size() < WIRE_HEADER_SIZE || wireFrameType(f.data()) != WIRE_APPEND) return false;
+    WireReader r(f.data() + WIRE_HEADER_SIZE, f.size() - WIRE_HEADER_SIZE);
+    a.term = r.varint();
+    a.leader = r.varint();
+    a.prevIdx = r.varint();
+    a.prevTerm = r.varint();
+    a.leaderCommit = r.varint();
+    int count = r.varint();
+    if(!r.ok || count < 0 || (size_t)count > r.left / 2) return false;
+
+    a.entries.clear();
+    a.entries.resize(count);
+    for(auto &e : a.entries){
+        e.term = r.varint();
+        e.ts = r.varint64();
+        if(!get_entry_body(r, e)) return false;
+    }
+    return r.ok;
+}
+
+static inline bool decodeFrame(std::string_view f, AppendEntriesReply &rep){
+    if(f.size() < WIRE_HEADER_SIZE || wireFrameType(f.data()) != WIRE_APPEND_RESP) return false;
+    WireReader r(f.data() + WIRE_HEADER_SIZE, f.size() - WIRE_HEADER_SIZE);
+    rep.term = r.varint();
+    rep.success = r.varint() == 1;
+    rep.conflictTerm = r.varint();
+    rep.conflictIndex = r.varint();
+    return r.ok;
+}
+
+static inline bool decodeFrame(std::string_view f, InstallSnapshotArgs &a){
+    if(f.size() < WIRE_HEADER_SIZE || wireFrameType(f.data()) != WIRE_SNAPSHOT) return false;
+    WireReader r(f.data() + WIRE_HEADER_SIZE, f.size() - WIRE_HEADER_SIZE);
+    a.term = r.varint();
+    a.leader = r.varint();
+    a.lastIndex = r.varint();
+    a.lastTerm = r.varint();
+    a.offset = r.varint();
+    a.done = r.varint() == 1;
+    size_t len = (uint32_t)r.varint();
+    if(!r.ok || !r.bytes(a.data, len)) return false;
+    return r.ok;
+}
+
+static inline bool decodeFrame(std::string_view f, InstallSnapshotReply &rep){
+    if(f.size() < WIRE_HEADER_SIZE || wireFrameType(f.data()) != WIRE_SNAPSHOT_RESP) return false;
+    WireReader r(f.data() + WIRE_HEADER_SIZE, f.size() - WIRE_HEADER_SIZE);
+    rep.term = r.varint();
+    rep.nextOffset = r.varint();
+    return r.ok;
+}
+
+static inline bool decodeFrame(std::string_view f, ReadIndexArgs &a){
+    if(f.size() < WIRE_HEADER_SIZE || wireFrameType(f.data()) != WIRE_READINDEX) return false;
+    WireReader r(f.data() + WIRE_HEADER_SIZE, f.size() - WIRE_HEADER_SIZE);
+    a.term = r.varint();
+    a.from = r.varint();
+    return r.ok;
+}
+
+static inline bool decodeFrame(std::string_view f, ReadIndexReply &rep){
+    if(f.size() < WIRE_HEADER_SIZE || wireFrameType(f.data()) != WIRE_READINDEX_RESP) return false;
+    WireReader r(f.data() + WIRE_HEADER_SIZE, f.size() - WIRE_HEADER_SIZE);
+    rep.term = r.varint();
+    rep.id = r.varint();
+    rep.leader = r.varint() - 1;
+    rep.index = r.varint() - 1;
+    return r.ok;
+}
+
+static inline bool decodeFrame(std::string_view f, TimeoutNowArgs &a){
+    if(f.size() < WIRE_HEADER_SIZE || wireFrameType(f.data()) != WIRE_TIMEOUTNOW) return false;
+    WireReader r(f.data() + WIRE_HEADER_SIZE, f.size() - WIRE_HEADER_SIZE);
+    a.term = r.varint();
+    a.leader = r.varint();
+    return r.ok;
+}
+
+static inline bool decodeFrame(std::string_view f, TimeoutNowReply &rep){
+    if(f.size() < WIRE_HEADER_SIZE || wireFrameType(f.data()) != WIRE_TIMEOUTNOW_RESP) return false;
+    WireReader r(f.data() + WIRE_HEADER_SIZE, f.size() - WIRE_HEADER_SIZE);
+    rep.term = r.varint();
+    return r.ok;
+}
+
+#endif
@@ -4,191 +4,609 @@
 #include <string.h>
 #include <unistd.h>
 #include <vector>
+#include <map>
 #include <arpa/inet.h>
 #include <net/if.h>
 #include <netdb.h>
 #include <netinet/tcp.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <thread>
 #include <sstream>
+#include <future>
+#include <signal.h>
 
 #include "server.h"
 #include "raft.h"
+#include "multiraft.h"
+#include "reactor.h"
+#include "linebuf.h"
 
+extern RaftGroups *ggroups;
 
-void* connection(void* socket_ptr){
-    int c_sock = *(int*)socket_ptr;
-    free(socket_ptr);
+// readings (RANGE) or nodes (LATEST) per reply; the last line of a page is
+// "NEXT <cursor>" to pass back for the following page, or "END"
+#define QUERY_PAGE_SIZE 1000
 
-    char buffer[2048];
-    std::string accumulated = "";
-    
-    while(true){
-        int bytes = recv(c_sock, buffer, sizeof(buffer)-1, 0);
-        if(bytes <= 0){
-            close(c_sock);
-            return nullptr;
-        }
-        buffer[bytes] = '\0';
-        accumulated += std::string(buffer);
-        
-        size_t pos;
-       
-        while((pos = accumulated.find('\n')) != std::string::npos) {
-            
-            std::string msg = accumulated.substr(0, pos);
-            accumulated = accumulated.substr(pos + 1);
-            
-            if(msg.empty()) continue;
+// a not_leader reply names the group's leader when this server knows it:
+// "ERR not_leader leader=<host:port> term=<t>"
+static std::string notLeader(Raft &r){
+    return "ERR not_leader" + r.leaderHint() + "\n";
+}
+
+static std::string appendReply(Raft &r, AppendResult res, const char *ok){
+    if(res == AppendResult::Committed) return ok;
+    if(res == AppendResult::NotLeader) return notLeader(r);
+    if(res == AppendResult::Invalid) return "ERR invalid_command\n";
+    return "ERR not_committed\n";
+}
 
-           
-            if (msg.rfind("ReqVote", 0) == 0 || msg.rfind("AppendEntries", 0) == 0) {
-                extern Raft *graft;
+// Pipelined sensors tag each message with a trailing "seq=N". The tag is stripped
+// before the command reaches the log and echoed back in the reply: "ACK upto=N" once
+// the message is committed, or "ERR <reason> seq=N" so the sensor knows what to
+// resend. Nothing is kept per sensor, so a resent message is appended again.
+static std::string_view takeSeq(std::string_view &msg){
+    size_t pos = msg.rfind(" seq=");
+    if(pos == std::string_view::npos) return std::string_view();
+    std::string_view seq = msg.substr(pos + 5);
+    msg = msg.substr(0, pos);
+    return seq;
+}
 
-                if (graft) {
-                    std::string reply = graft->peerstring(msg);
+static std::string seqReply(Raft &r, AppendResult res, std::string_view seq){
+    std::string reply;
+    if(res == AppendResult::Committed){
+        reply = "ACK upto=";
+    } else {
+        reply = appendReply(r, res, "");
+        reply.pop_back();
+        reply += " seq=";
+    }
+    reply.append(seq.data(), seq.size());
+    reply.push_back('\n');
+    return reply;
+}
 
-                    
-                    if (!reply.empty() && reply.back() != '\n')
-                        reply.push_back('\n');
+// Queries take an optional "consistency=stale|follower|linearizable" token anywhere
+// after QUERY; it is removed here. Stale, the default, answers from local state.
+static bool takeConsistency(std::string &q, ReadMode &mode){
+    mode = ReadMode::Stale;
+    size_t pos = q.find(" consistency=");
+    if(pos == std::string::npos) return true;
+    size_t end = q.find(' ', pos + 1);
+    if(end == std::string::npos) end = q.size();
+    std::string v = q.substr(pos + 13, end - pos - 13);
+    q.erase(pos, end - pos);
+    if(v == "linearizable") mode = ReadMode::Linearizable;
+    else if(v == "follower") mode = ReadMode::Follower;
+    else if(v != "stale") return false;
+    return true;
+}
 
-                    send(c_sock, reply.c_str(), reply.size(), 0);
-                }
+// "DATA_BATCH node=<id> <temp>,<humidity> ..." carries many readings in one line; it
+// becomes one Data entry per reading, without going through text again. Empty if the
+// line is malformed or any reading is outside int16.
+static std::vector<Log> expandBatch(std::string_view msg){
+    std::vector<Log> entries;
+    std::string_view rest = msg;
+    next_token(rest);
+    std::string_view nodeTok = next_token(rest);
+    int node, temp, hum;
+    if(!starts_with(nodeTok, "node=") || !parse_int_strict(nodeTok.substr(5), node)) return entries;
+    for(std::string_view t = next_token(rest); !t.empty(); t = next_token(rest)){
+        size_t comma = t.find(',');
+        if(comma == std::string_view::npos || !parse_int_strict(t.substr(0, comma), temp) ||
+           !parse_int_strict(t.substr(comma + 1), hum) || !fits_int16(temp) || !fits_int16(hum))
+            return std::vector<Log>();
+        entries.emplace_back();
+        Log &e = entries.back();
+        e.kind = EntryKind::Data;
+        e.node = node;
+        e.temp = temp;
+        e.humidity = hum;
+    }
+    return entries;
+}
 
-                
-                continue;
-            }
+static void writeColumn(std::ostream &out, const char *name, const ColumnSummary &c){
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s: min=%.0f max=%.0f mean=%.2f stddev=%.2f p50=%.1f p90=%.1f p99=%.1f\n",
+             name, c.min, c.max, c.mean, c.stddev, c.p50, c.p90, c.p99);
+    out << buf;
+}
+
+// " (group <g>)" after a section title when the server hosts several groups
+static std::string groupTitle(int g){
+    return ggroups->size() > 1 ? " (group " + std::to_string(g) + ")" : "";
+}
 
+std::string query(std::string_view msg){
+    auto tokens = split_ws(msg);
+    std::ostringstream response;
+    
+    if(tokens.size() < 2){
+        response << "ERR invalid_query\n";
+    } else {
+        std::string query_type = tokens[1];
+        
+        if(query_type == "STATS"){
+            // every node lives in exactly one group, so the groups' counts just add up
+            NodeCounts total{-1, 0, 0};
+            std::vector<NodeCounts> perNode;
+            for(int g = 0; g < ggroups->size(); g++){
+                NodeCounts t;
+                auto part = ggroups->at(g).getNodeCounts(t);
+                total.readings += t.readings;
+                total.heartbeats += t.heartbeats;
+                perNode.insert(perNode.end(), part.begin(), part.end());
+            }
+            if(ggroups->size() > 1)
+                std::sort(perNode.begin(), perNode.end(),
+                          [](const NodeCounts &a, const NodeCounts &b){ return a.node < b.node; });
             
-            if (msg.rfind("HEARTBEAT", 0) == 0 || msg.rfind("DATA", 0) == 0) { 
-                extern Raft *graft; 
-                
-                if (graft) { 
-                    bool appended = graft->appendCommand(msg);
-                    
-                    if (appended) { 
-                        std::string ack = "OK replicated\n"; 
-                        send(c_sock, ack.c_str(), ack.size(), 0); 
-                    } else { 
-                        std::string nack = "ERR not_leader\n"; 
-                        send(c_sock, nack.c_str(), nack.size(), 0);
-                    } 
+            response << "=== CLUSTER STATISTICS ===\n";
+            response << "Total Sensor Readings: " << total.readings << "\n";
+            response << "Total Heartbeats: " << total.heartbeats << "\n\n";
+            
+            response << "Per-Node Summary:\n";
+            for(auto &p : perNode) {
+                if(p.readings == 0) continue;
+                response << "  Node " << p.node << ": " << p.readings << " readings, " 
+                         << p.heartbeats << " heartbeats\n";
+            }
+        }
+        else if(query_type == "AGG"){
+            AggregateSummary a;
+            bool perNode = tokens.size() >= 3;
+            int node_id = perNode ? atoi(tokens[2].c_str()) : 0;
+            if(perNode && !ggroups->forNode(node_id).getAggregate(node_id, a)){
+                response << "ERR unknown_node\n";
+            } else {
+                if(perNode){
+                    response << "=== AGGREGATES FOR NODE " << tokens[2] << " ===\n";
                 } else {
-                    std::string nack = "ERR no_raft\n";
-                    send(c_sock, nack.c_str(), nack.size(), 0);
+                    SensorAggregate all;
+                    for(int g = 0; g < ggroups->size(); g++) all.merge(ggroups->at(g).getClusterStats());
+                    a = StateMachine::summarize(all);
+                    response << "=== CLUSTER AGGREGATES ===\n";
+                }
+                response << "Readings: " << a.readings << "\n";
+                response << "Heartbeats: " << a.heartbeats << "\n";
+                if(a.readings > 0){
+                    writeColumn(response, "Temperature", a.temperature);
+                    writeColumn(response, "Humidity", a.humidity);
                 }
             }
+        }
+        else if(query_type == "NODE" && tokens.size() >= 3){
+            int node_id = atoi(tokens[2].c_str());
+            size_t total = 0;
+            auto last = ggroups->forNode(node_id).getLastReadings(node_id, 5, total);
             
-            else if(msg.rfind("QUERY", 0) == 0){
-                extern Raft *graft;
-                
-                if(!graft){
-                    std::string resp = "ERR no_raft\n";
-                    send(c_sock, resp.c_str(), resp.size(), 0);
-                    continue;
-                }
-                
-                auto tokens = split_ws(msg);
-                std::ostringstream response;
-                
-                if(tokens.size() < 2){
-                    response << "ERR invalid_query\n";
-                } else {
-                    std::string query_type = tokens[1];
-                    
-                    if(query_type == "STATS"){
-                        auto heartbeats = graft->getHeartbeats();
-                        auto perNode = graft->getReadingsPerNode();
-                        int totalReadings = graft->getTotalSensorReadings();
-                        
-                        response << "=== CLUSTER STATISTICS ===\n";
-                        response << "Total Sensor Readings: " << totalReadings << "\n";
-                        
-                        int totalHB = 0;
-                        for(auto &h : heartbeats) totalHB += h.second;
-                        response << "Total Heartbeats: " << totalHB << "\n\n";
-                        
-                        response << "Per-Node Summary:\n";
-                        for(auto &p : perNode) {
-                            int nid = p.first;
-                            int count = p.second;
-                            auto it = heartbeats.find(nid);
-                            int hbCount = (it != heartbeats.end()) ? it->second : 0;
-                            
-                            response << "  Node " << nid << ": " << count << " readings, " 
-                                     << hbCount << " heartbeats\n";
-                        }
-                    }
-                    else if(query_type == "NODE" && tokens.size() >= 3){
-                        int node_id = atoi(tokens[2].c_str());
-                        auto allReadings = graft->getSensorReadingsByNode(node_id);
-                        
-                        response << "LAST 5 READINGS FOR NODE " << node_id << "\n";
-                        response << "Total Readings: " << allReadings.size() << "\n\n";
-                        
-                        int start = allReadings.size() > 5 ? allReadings.size() - 5 : 0;
-                        for(size_t i = start; i < allReadings.size(); i++){
-                            response << "  [" << (i - start + 1) << "] Temperature=" 
-                                     << allReadings[i].temperature 
-                                     << "°C, Humidity=" << allReadings[i].humidity << "%\n";
-                        }
-                    }
-                    else if(query_type == "STATUS"){
-                        int logCount = graft->getLogCount();
-                        bool isLeader = graft->isLeader();
-                        response << "Logs=" << logCount;
-                        response << ", Leader=" << (isLeader ? "Yes" : "No") << "\n";
-                    }
-                    else {
-                        response << "ERR unknown_query_type\n";
-                    }
+            response << "LAST 5 READINGS FOR NODE " << node_id << "\n";
+            response << "Total Readings: " << total << "\n\n";
+            
+            for(size_t i = 0; i < last.size(); i++){
+                response << "  [" << (i + 1) << "] Temperature=" 
+                         << last[i].temperature 
+                         << "°C, Humidity=" << last[i].humidity << "%\n";
+            }
+        }
+        else if(query_type == "RANGE" && tokens.size() >= 5){
+            int node_id = atoi(tokens[2].c_str());
+            int64_t t0 = strtoll(tokens[3].c_str(), nullptr, 10);
+            int64_t t1 = strtoll(tokens[4].c_str(), nullptr, 10);
+            size_t cursor = tokens.size() >= 6 ? strtoull(tokens[5].c_str(), nullptr, 10) : 0;
+            size_t next = 0;
+            auto page = ggroups->forNode(node_id).getRange(node_id, t0, t1, cursor, QUERY_PAGE_SIZE, next);
+            
+            response << "RANGE node=" << node_id << " from=" << t0 << " to=" << t1
+                     << " readings=" << page.size() << "\n";
+            for(auto &r : page){
+                response << "  ts=" << r.ts << " temp=" << r.temperature
+                         << " humidity=" << r.humidity << "\n";
+            }
+            if(next) response << "NEXT " << next << "\n";
+            else response << "END\n";
+        }
+        else if(query_type == "LATEST" && tokens.size() >= 3){
+            int64_t t0 = strtoll(tokens[2].c_str(), nullptr, 10);
+            int cursor = tokens.size() >= 4 ? atoi(tokens[3].c_str()) : INT_MIN;
+            int next = INT_MIN;
+            std::vector<SensorReading> page;
+            // Each group pages through its own nodes. The merged page stops short of
+            // the first node a group left for later, and at the page size.
+            for(int g = 0; g < ggroups->size(); g++){
+                int gnext;
+                auto part = ggroups->at(g).getLatest(t0, cursor, QUERY_PAGE_SIZE, gnext);
+                page.insert(page.end(), part.begin(), part.end());
+                if(gnext != INT_MIN) next = next == INT_MIN ? gnext : std::min(next, gnext);
+            }
+            if(ggroups->size() > 1){
+                std::sort(page.begin(), page.end(),
+                          [](const SensorReading &a, const SensorReading &b){ return a.node_id < b.node_id; });
+                if(next != INT_MIN)
+                    page.erase(std::lower_bound(page.begin(), page.end(), next,
+                                                [](const SensorReading &r, int n){ return r.node_id < n; }),
+                               page.end());
+                if(page.size() > QUERY_PAGE_SIZE){
+                    next = page[QUERY_PAGE_SIZE].node_id;
+                    page.resize(QUERY_PAGE_SIZE);
                 }
-                
-                std::string resp_str = response.str();
-                send(c_sock, resp_str.c_str(), resp_str.size(), 0);
             }
             
-            else if(msg.rfind("CMD ",0)==0){
-                extern Raft *graft;
-                if(graft){
-                    if(graft->appendCommand(msg.substr(4))){
-                        std::string ack = "OK appended\n";
-                        send(c_sock, ack.c_str(), ack.size(), 0);
-                    } else {
-                        std::string nack = "ERR not_leader\n";
-                        send(c_sock, nack.c_str(), nack.size(), 0);
-                    }
-                } else {
-                    std::string r = "ERR no_raft\n";
-                    send(c_sock, r.c_str(), r.size(), 0);
+            response << "LATEST since=" << t0 << " nodes=" << page.size() << "\n";
+            for(auto &r : page){
+                response << "  node=" << r.node_id << " ts=" << r.ts << " temp=" << r.temperature
+                         << " humidity=" << r.humidity << "\n";
+            }
+            if(next != INT_MIN) response << "NEXT " << next << "\n";
+            else response << "END\n";
+        }
+        else if(query_type == "STATUS"){
+            // one line per group, led by "Group=<g>, " when there are several
+            for(int g = 0; g < ggroups->size(); g++){
+                Raft &r = ggroups->at(g);
+                int logCount = r.getLogCount();
+                bool isLeader = r.isLeader();
+                ApplyStats ap = r.getApplyStats();
+                if(ggroups->size() > 1) response << "Group=" << g << ", ";
+                response << "Logs=" << logCount;
+                response << ", Leader=" << (isLeader ? "Yes" : "No");
+                response << ", Commit=" << ap.commitIndex << ", Applied=" << ap.lastApplied
+                         << ", ApplyLag=" << ap.lag << ", MaxApplyLag=" << ap.maxLag
+                         << ", ApplyBatches=" << ap.batches;
+                ElectionStats el = r.getElectionStats();
+                response << ", Term=" << el.term << ", ElectionTimeoutMs=" << el.timeoutMs;
+                if(r.isLearner()) response << ", Learner=Yes";
+                response << "\n";
+            }
+        }
+        else if(query_type == "ELECTIONS"){
+            for(int g = 0; g < ggroups->size(); g++){
+                ElectionStats el = ggroups->at(g).getElectionStats();
+                response << "=== ELECTIONS" << groupTitle(g) << " ===\n";
+                response << "Term: " << el.term << "\n";
+                response << "Election Timeout: " << el.timeoutMs << "-" << 2 * el.timeoutMs
+                         << " ms (heartbeat gap " << el.heartbeatGapMs << " ms)\n";
+                response << "Pre-votes: " << el.preVotes << ", Candidacies: " << el.candidacies
+                         << ", Won: " << el.won << ", Quorum-loss step-downs: " << el.quorumLost << "\n";
+                if(!el.windowsMs.empty()){
+                    long long sum = 0, worst = 0;
+                    for(long long w : el.windowsMs){ sum += w; worst = std::max(worst, w); }
+                    response << "Unavailability: last=" << el.windowsMs.back() << " ms, avg="
+                             << sum / (long long)el.windowsMs.size() << " ms, max=" << worst
+                             << " ms over the last " << el.windowsMs.size() << " wins\n";
                 }
-            } 
-            else {
-                std::string ok = "OK\n";
-                send(c_sock, ok.c_str(), ok.size(), 0);
             }
         }
+        else if(query_type == "PEERS"){
+            for(int g = 0; g < ggroups->size(); g++){
+                response << "=== PEER CONNECTIONS" << groupTitle(g) << " ===\n";
+                for(auto &p : ggroups->at(g).getPeerStats()){
+                    response << "  " << p.addr
+                             << ": connected=" << (p.connected ? 1 : 0)
+                             << " proto=" << (p.binary ? "binary" : "text")
+                             << " calls=" << p.calls
+                             << " reused=" << p.reused
+                             << " reconnects=" << p.reconnects
+                             << " failures=" << p.failures
+                             << " bytes_out=" << p.bytesOut
+                             << " bytes_in=" << p.bytesIn << "\n";
+                }
+            }
+        }
+        else {
+            response << "ERR unknown_query_type\n";
+        }
+    }
+    
+    return response.str();
+}
+
+// µs since t0, for the ingest-to-ack histogram
+static uint64_t sinceUs(std::chrono::steady_clock::time_point t0){
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t0).count();
+}
+
+// QUERY METRICS: this server's own instruments, never routed through the leader
+std::string metrics(){
+    ServerMetrics &sm = serverMetrics();
+    MetricsText m;
+    m.histogram("sensor_ingest_ack_seconds", "Time from a write arriving to its reply being ready", sm.ingestAck);
+    m.counter("sensor_requests_total", "Request lines dispatched", sm.requests.value());
+    m.counter("sensor_received_bytes_total", "Bytes read from client and peer connections", sm.bytesIn.value());
+    m.counter("sensor_sent_bytes_total", "Bytes written to client and peer connections", sm.bytesOut.value());
+    m.counter("sensor_connections_accepted_total", "Connections accepted", sm.accepted.value());
+    m.gauge("sensor_connections_open", "Connections currently open", sm.open.value());
+    for(int g = 0; g < ggroups->size(); g++) ggroups->at(g).writeMetrics(m);
+    return m.str();
+}
+
+// Waits for every group's read barrier, for a query that reads them all, then calls
+// done once: with Ok, or with the first failure and the group it came from. The
+// groups' leaders are usually spread over the servers, so a linearizable read reads
+// the groups this server does not lead as a follower would, with a ReadIndex from
+// their leader, which is just as linearizable.
+static void readBarrierAll(ReadMode mode, std::function<void(ReadResult, Raft &)> done){
+    struct Gather {
+        std::atomic<int> left;
+        std::mutex mu;
+        ReadResult res = ReadResult::Ok;
+        Raft *from = nullptr;
+        std::function<void(ReadResult, Raft &)> done;
+    };
+    auto st = std::make_shared<Gather>();
+    st->left = ggroups->size();
+    st->done = std::move(done);
+    for(int g = 0; g < ggroups->size(); g++){
+        Raft &r = ggroups->at(g);
+        ReadMode m = mode == ReadMode::Linearizable && !r.isLeader() ? ReadMode::Follower : mode;
+        r.readBarrier(m, [st, &r](ReadResult res){
+            if(res != ReadResult::Ok){
+                std::lock_guard<std::mutex> lk(st->mu);
+                if(!st->from){
+                    st->res = res;
+                    st->from = &r;
+                }
+            }
+            if(--st->left == 0) st->done(st->res, st->from ? *st->from : r);
+        });
+    }
+}
+
+// the one group a query reads, that of the node it names, or -1 if it reads them all
+static int queryGroup(const std::string &q){
+    if(ggroups->size() == 1) return 0;
+    auto tokens = split_ws(q);
+    if(tokens.size() >= 3 && (tokens[1] == "AGG" || tokens[1] == "NODE" || tokens[1] == "RANGE"))
+        return groupOfNode(atoi(tokens[2].c_str()), ggroups->size());
+    return -1;
+}
+
+// Runs one request line from a sensor, query client or text-protocol peer. Writes
+// complete through done() once a quorum of their group holds them, which happens on
+// a Raft thread, so callers must not assume done() has run by the time dispatch()
+// returns.
+void dispatch(std::string_view msg, ReplyFn done){
+    if(!ggroups){
+        done("ERR no_raft\n");
+        return;
+    }
+    serverMetrics().requests.add();
+    auto t0 = std::chrono::steady_clock::now();
+
+    if (starts_with(msg, "ReqVote") || starts_with(msg, "AppendEntries") || starts_with(msg, "InstallSnapshot") ||
+        starts_with(msg, "ReadIndex") || starts_with(msg, "TimeoutNow") || starts_with(msg, "GROUP ")) {
+        int g = takeTextGroup(msg);
+        if(g < 0 || g >= ggroups->size()){
+            done("ERR unknown_group\n");
+            return;
+        }
+        ggroups->at(g).peerstring(msg, [done](std::string reply){
+            if (!reply.empty() && reply.back() != '\n')
+                reply.push_back('\n');
+            done(std::move(reply));
+        });
+    }
+    else if (starts_with(msg, "DATA_BATCH")) {
+        std::string_view seq = takeSeq(msg);
+        std::vector<Log> entries = expandBatch(msg);
+        if(entries.empty()){
+            done("ERR invalid_batch\n");
+            return;
+        }
+        std::string seqs(seq);
+        Raft &r = ggroups->forNode(entries[0].node);
+        r.appendEntriesAsync(std::move(entries), [&r, done, seqs, t0](AppendResult res){
+            serverMetrics().ingestAck.record(sinceUs(t0));
+            done(seqs.empty() ? appendReply(r, res, "OK replicated\n") : seqReply(r, res, seqs));
+        });
+    }
+    else if (starts_with(msg, "HEARTBEAT") || starts_with(msg, "DATA")) { 
+        std::string_view seq = takeSeq(msg);
+        // parsed here rather than by the group, since the node picks the group
+        std::vector<Log> one(1);
+        bool valid = parseCommand(msg, one[0]);
+        Raft &r = ggroups->forEntry(one[0]);
+        if(!valid){
+            done(seq.empty() ? appendReply(r, AppendResult::Invalid, "") : seqReply(r, AppendResult::Invalid, seq));
+            return;
+        }
+        if(one[0].kind == EntryKind::Opaque) one[0].command.assign(msg.data(), msg.size());
+        if(seq.empty()){
+            r.appendEntriesAsync(std::move(one), [&r, done, t0](AppendResult res){
+                serverMetrics().ingestAck.record(sinceUs(t0));
+                done(appendReply(r, res, "OK replicated\n"));
+            });
+            return;
+        }
+        std::string seqs(seq);
+        r.appendEntriesAsync(std::move(one), [&r, done, seqs, t0](AppendResult res){
+            serverMetrics().ingestAck.record(sinceUs(t0));
+            done(seqReply(r, res, seqs));
+        });
+    }
+    else if(starts_with(msg, "QUERY METRICS")){
+        done(metrics());
+    }
+    else if(starts_with(msg, "QUERY")){
+        std::string q(msg);
+        ReadMode mode;
+        if(!takeConsistency(q, mode)){
+            done("ERR invalid_consistency\n");
+            return;
+        }
+        if(mode == ReadMode::Stale){
+            done(query(q));
+            return;
+        }
+        auto answer = [done, q](ReadResult res, Raft &r){
+            if(res == ReadResult::Ok) done(query(q));
+            else done(res == ReadResult::NotLeader ? notLeader(r) : "ERR read_timeout\n");
+        };
+        int g = queryGroup(q);
+        if(g < 0){
+            readBarrierAll(mode, answer);
+            return;
+        }
+        Raft &r = ggroups->at(g);
+        r.readBarrier(mode, [answer, &r](ReadResult res){ answer(res, r); });
+    }
+    else if(starts_with(msg, "CMD TRANSFER_LEADER")){
+        // "CMD TRANSFER_LEADER <id> [group=<g>]", group 0 by default
+        std::string_view arg = msg.substr(19);
+        std::string_view idTok = next_token(arg);
+        std::string_view groupTok = next_token(arg);
+        int id, g = 0;
+        if(!parse_int_strict(idTok, id) ||
+           (!groupTok.empty() && (!starts_with(groupTok, "group=") || !parse_int_strict(groupTok.substr(6), g)))){
+            done("ERR usage: CMD TRANSFER_LEADER <id> [group=<g>]\n");
+            return;
+        }
+        if(g < 0 || g >= ggroups->size()){
+            done("ERR unknown_group\n");
+            return;
+        }
+        Raft &r = ggroups->at(g);
+        r.transferLeadership(id, [&r, done, id](TransferResult res){
+            switch(res){
+            case TransferResult::Done: done("OK transferred to " + std::to_string(id) + "\n"); break;
+            case TransferResult::NotLeader: done(notLeader(r)); break;
+            case TransferResult::UnknownPeer: done("ERR unknown_peer\n"); break;
+            case TransferResult::NotVoter: done("ERR not_voter\n"); break;
+            case TransferResult::Busy: done("ERR transfer_in_progress\n"); break;
+            case TransferResult::TimedOut: done("ERR transfer_timeout\n"); break;
+            }
+        });
+    }
+    else if(starts_with(msg, "CMD ")){
+        Raft &r = ggroups->at(0);
+        r.appendCommandAsync(msg.substr(4), [&r, done, t0](AppendResult res){
+            serverMetrics().ingestAck.record(sinceUs(t0));
+            done(appendReply(r, res, "OK appended\n"));
+        });
+    } 
+    else {
+        done("OK\n");
     }
 }
 
+// the flags byte of a request frame names its group; like dispatch(), done() may run
+// later on the group's WAL thread
+bool dispatchFrame(std::string_view frame, ReplyFn done){
+    if(!ggroups) return false;
+    int g = wireFrameGroup(frame.data());
+    return g < ggroups->size() && ggroups->at(g).peerframe(frame, std::move(done));
+}
+
+
+// thread-per-connection model, kept behind --io=threads for comparison
+void* connection(void* socket_ptr){
+    int c_sock = *(int*)socket_ptr;
+    free(socket_ptr);
+    ServerMetrics &sm = serverMetrics();
+    sm.accepted.add();
+    sm.open.add(1);
+
+    LineBuffer in;
+    bool binary = false;
+    
+    while(true){
+        char *buffer = in.space(2048);
+        int bytes = recv(c_sock, buffer, in.room(), 0);
+        if(bytes <= 0){
+            sm.open.add(-1);
+            close(c_sock);
+            return nullptr;
+        }
+        in.commit(bytes);
+        sm.bytesIn.add(bytes);
+       
+        while(in.size() > 0) {
+            // after a binary HELLO the peer sends only frames on this connection
+            if(binary){
+                std::string_view d = in.data();
+                size_t frameLen = 0;
+                int ready = wireFrameReady(d.data(), d.size(), frameLen);
+                if(ready == 0) break;
+
+                std::promise<std::string> p;
+                auto f = p.get_future();
+                if(ready < 0 || !dispatchFrame(d.substr(0, frameLen), [&p](std::string r){ p.set_value(std::move(r)); })){
+                    sm.open.add(-1);
+                    close(c_sock);
+                    return nullptr;
+                }
+                in.consume(frameLen);
+                std::string reply = f.get();
+                send(c_sock, reply.data(), reply.size(), MSG_NOSIGNAL);
+                sm.bytesOut.add(reply.size());
+                continue;
+            }
 
+            std::string_view msg;
+            if(!in.nextLine(msg)) break;
+            
+            if(msg.empty()) continue;
 
-Raft *graft = nullptr;
+            std::string reply;
+            if(!negotiateHello(msg, reply, binary)){
+                std::promise<std::string> p;
+                auto f = p.get_future();
+                dispatch(msg, [&p](std::string r){ p.set_value(std::move(r)); });
+                reply = f.get();
+            }
+            send(c_sock, reply.c_str(), reply.size(), MSG_NOSIGNAL);
+            sm.bytesOut.add(reply.size());
+        }
+    }
+}
+
+
+RaftGroups *ggroups = nullptr;
 
 int main(int argc, char *argv[]) {
-    if(argc < 2){
-        std::cout << "Usage: " << argv[0] << " [port] [peer1:port,peer2:port,...] [id]\n";
+    // positional arguments first, then optional --key=value settings in any order
+    std::vector<std::string> args;
+    std::map<std::string, std::string> opts;
+    for(int i = 1; i < argc; i++){
+        std::string a = argv[i];
+        if(a.rfind("--", 0) == 0){
+            size_t eq = a.find('=');
+            if(eq == std::string::npos) opts[a.substr(2)] = "1";
+            else opts[a.substr(2, eq-2)] = a.substr(eq+1);
+        } else {
+            args.push_back(a);
+        }
+    }
+
+    if(args.size() < 1){
+        std::cout << "Usage: " << argv[0] << " [port] [peer1:port,peer2:port,...] [id] [options]\n";
         std::cout << "Example: ./server 10035 127.0.0.1:10036,127.0.0.1:10037 1\n";
+        std::cout << "Options:\n";
+        std::cout << "  --batch=N          group commit: ship once N entries are waiting (default " << GROUP_COMMIT_MAX_BATCH << ")\n";
+        std::cout << "  --batch-wait-us=N  group commit: longest an entry waits for its batch (default " << GROUP_COMMIT_MAX_WAIT_US << ")\n";
+        std::cout << "  --peer-proto=P     protocol offered to peers: binary (default) or text\n";
+        std::cout << "  --io=M             connection model: epoll (default) or threads\n";
+        std::cout << "  --reactors=N       epoll reactor threads sharing the port via SO_REUSEPORT (default 1)\n";
+        std::cout << "  --wal-dir=DIR      persist the log, term and vote in a write-ahead log under DIR\n";
+        std::cout << "  --wal-sync=S       WAL fsync policy: always (default), interval or none\n";
+        std::cout << "  --wal-sync-ms=N    fsync period for --wal-sync=interval (default " << WAL_SYNC_INTERVAL_MS << ")\n";
+        std::cout << "  --snapshot-every=N snapshot the state machine and compact the log every N entries (default " << SNAPSHOT_EVERY << ", 0 = off)\n";
+        std::cout << "  --groups=N         Raft groups sharing out the sensors by node id, every server the same N (default 1)\n";
+        std::cout << "  --learners=LIST    host:port,... of non-voting learners the leader also replicates to\n";
+        std::cout << "  --learner          this server is a learner: it applies the log and serves queries but never votes\n";
         return 0;
     }
 
-    int port = atoi(argv[1]);
+    int port = atoi(args[0].c_str());
     std::vector<std::string> peers;
     int id = port;
     
-    if(argc >= 3){
-        std::string peerlist = argv[2];
+    if(args.size() >= 2){
+        std::string peerlist = args[1];
         size_t start = 0;
         while(true){
             size_t pos = peerlist.find(',', start);
@@ -203,23 +621,91 @@ int main(int argc, char *argv[]) {
         }
     }
     
-    if(argc >=4){
-        id = atoi(argv[3]);
+    if(args.size() >= 3){
+        id = atoi(args[2].c_str());
+    }
+
+    // learners follow the voters in the peer list
+    size_t voters = peers.size();
+    if(opts.count("learners")){
+        std::stringstream ls(opts["learners"]);
+        std::string p;
+        while(std::getline(ls, p, ',')) if(!p.empty()) peers.push_back(p);
     }
 
     std::cout << "Starting server on port " << port << ", peers:";
     for(auto &p: peers) std::cout << " " << p;
-    std::cout << ", id="<<id<<"\n";
+    std::cout << ", id="<<id<<(opts.count("learner") ? ", learner" : "")<<"\n";
+
+    // peer connections are long-lived; a peer dying mid-reply must not kill us
+    signal(SIGPIPE, SIG_IGN);
+
+    std::string io = opts.count("io") ? opts["io"] : "epoll";
+    int nreactors = opts.count("reactors") ? std::max(1, atoi(opts["reactors"].c_str())) : 1;
 
-    ServerStub1 ServerStub;
+    // one listening socket per reactor; SO_REUSEPORT lets the kernel spread accepts
+    std::vector<ServerStub1> stubs(io == "threads" ? 1 : nreactors);
+    for(auto &stub : stubs){
+        if(!stub.Init(port, stubs.size() > 1)){
+            std::cerr << "Failed to initialize server" << std::endl;
+            return 1;
+        }
+    }
 
-    if(!ServerStub.Init(port)){
-        std::cerr << "Failed to initialize server" << std::endl;
+    int ngroups = opts.count("groups") ? atoi(opts["groups"].c_str()) : 1;
+    if(ngroups < 1 || ngroups > MAX_RAFT_GROUPS){
+        std::cerr << "--groups must be between 1 and " << MAX_RAFT_GROUPS << std::endl;
         return 1;
     }
+    WalSync policy = WalSync::Always;
+    if(opts.count("wal-sync") && !parseWalSync(opts["wal-sync"], policy)){
+        std::cerr << "Unknown --wal-sync policy " << opts["wal-sync"] << std::endl;
+        return 1;
+    }
+    int syncMs = opts.count("wal-sync-ms") ? atoi(opts["wal-sync-ms"].c_str()) : WAL_SYNC_INTERVAL_MS;
+    // with several groups each keeps its WAL in a group-<g> directory under --wal-dir
+    if(opts.count("wal-dir") && ngroups > 1) mkdir(opts["wal-dir"].c_str(), 0755);
 
-    graft = new Raft(id, port, peers);
-    graft->start();
+    ggroups = new RaftGroups(id, port, peers, ngroups);
+    for(int g = 0; g < ngroups; g++){
+        Raft &r = ggroups->at(g);
+        r.setGroupCommit(
+            opts.count("batch") ? atoi(opts["batch"].c_str()) : GROUP_COMMIT_MAX_BATCH,
+            opts.count("batch-wait-us") ? atoi(opts["batch-wait-us"].c_str()) : GROUP_COMMIT_MAX_WAIT_US);
+        if(opts.count("peer-proto") && opts["peer-proto"] == "text") r.setPeerProtocol(0);
+        if(opts.count("snapshot-every")) r.setSnapshotEvery(atoi(opts["snapshot-every"].c_str()));
+        if(opts.count("learner")) r.setLearner(true);
+        for(size_t i = voters; i < peers.size(); i++) r.setPeerLearner(i);
+        if(opts.count("wal-dir")){
+            std::string dir = opts["wal-dir"];
+            if(ngroups > 1) dir += "/group-" + std::to_string(g);
+            if(!r.openWal(dir, policy, syncMs)){
+                std::cerr << "Failed to recover write-ahead log" << std::endl;
+                return 1;
+            }
+        }
+    }
+    ggroups->start();
+
+    if(io != "threads"){
+        std::vector<std::unique_ptr<Reactor>> reactors;
+        std::vector<std::thread> loops;
+        for(auto &stub : stubs){
+            reactors.emplace_back(new Reactor(dispatch, dispatchFrame));
+            if(!reactors.back()->Init(stub.GetSocket())){
+                std::cerr << "Failed to initialize reactor" << std::endl;
+                return 1;
+            }
+        }
+        for(size_t i = 1; i < reactors.size(); i++)
+            loops.emplace_back(&Reactor::run, reactors[i].get());
+        reactors[0]->run();
+        for(auto &t : loops) t.join();
+        delete ggroups;
+        return 0;
+    }
+
+    ServerStub1 &ServerStub = stubs[0];
 
     while(1){
         int client_fd = ServerStub.acceptclient();
@@ -236,6 +722,6 @@ int main(int argc, char *argv[]) {
         pthread_detach(thread);
     }
 
-    delete graft;
+    delete ggroups;
     return 0;
-}
\ No newline at end of file
+}
@@ -29,7 +29,7 @@ public:
     ServerStub1() : sockfd(-1), newfd(-1) {}
 
 
-    int Init(int port){
+    int Init(int port, bool reuseport = false){
         sockfd = socket(AF_INET, SOCK_STREAM, 0);
 	if (sockfd < 0) {
 		perror("ERROR: failed to create socket");
@@ -43,6 +43,12 @@ public:
             sockfd = -1;
             return 0;
         }
+        if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+            perror("ERROR: setsockopt SO_REUSEPORT failed");
+            close(sockfd);
+            sockfd = -1;
+            return 0;
+        }
 
 	memset(&addr, '\0', sizeof(addr));
 	addr.sin_family = AF_INET;
@@ -74,6 +80,7 @@ int acceptclient(){
 
 }
 void SetClientFD(int fd) { newfd = fd; }
+int GetSocket() const { return sockfd; }
 
 };
 
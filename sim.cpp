@@ -0,0 +1,293 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <set>
+#include <chrono>
+#include <random>
+#include <numeric>
+#include <algorithm>
+#include <functional>
+#include <stdio.h>
+#include <string.h>
+
+#include "sim.h"
+
+// Runs many seeded failure scenarios against an in-process cluster under virtual
+// time (see SimNet) and checks each one: no two leaders in a term, every replica ends
+// with the same state, and no acknowledged write is lost. Reports how long elections
+// and commits took in virtual time. A failing run prints its seed; --runs=1 --seed=S
+// --verbose replays it with the servers' own log lines.
+
+#define SIM_SETTLE_MS       10000   // fault-free time a run's cluster gets to converge before the checks
+#define SIM_TEMP_RANGE      30000   // a write's sequence number is node * range + temp
+
+enum class Scenario { None, Failover, Partition, Chaos };
+
+struct SimOptions {
+    SimConfig net;
+    Scenario scenario;
+    int runs;
+    double seconds;         // of load and faults per run, virtual
+    double writeEveryMs;
+    double faultEveryMs;
+    double faultMs;         // how long each fault lasts
+    bool verbose;
+};
+
+struct RunResult {
+    std::string failure;            // empty if every check passed
+    std::vector<double> electionMs; // fault on the leader to a new leader running
+    std::vector<double> commitMs;   // write sent to write committed
+    long long writes = 0;
+    long long acked = 0;
+    uint64_t events = 0;
+    double simMs = 0;
+};
+
+static bool sameReading(const SensorReading &a, const SensorReading &b){
+    return a.node_id == b.node_id && a.temperature == b.temperature && a.humidity == b.humidity &&
+           a.term == b.term && a.ts == b.ts;
+}
+
+// a leader is up and every server has applied everything it committed
+static bool converged(SimNet &net){
+    int l = net.leader();
+    if(l < 0) return false;
+    int commit = net.server(l).getApplyStats().commitIndex;
+    for(int k = 0; k < net.size(); k++)
+        if(net.server(k).getApplyStats().lastApplied != commit) return false;
+    return true;
+}
+
+// heals the cluster, gives it SIM_SETTLE_MS to converge and checks what every run
+// must satisfy
+static std::string verify(SimNet &net, const std::vector<int> &acked){
+    net.heal();
+    for(int k = 0; k < net.size(); k++) net.resume(k);
+    double deadline = net.elapsedMs() + SIM_SETTLE_MS;
+    while(!converged(net) && net.elapsedMs() < deadline) net.runUntil(net.elapsedMs() + 1);
+
+    if(!net.safetyViolation().empty()) return net.safetyViolation();
+    if(net.leader() < 0) return "no leader after healing";
+
+    std::vector<SensorReading> first = net.server(0).getSensorReadings();
+    ApplyStats a0 = net.server(0).getApplyStats();
+    for(int k = 1; k < net.size(); k++){
+        ApplyStats ak = net.server(k).getApplyStats();
+        if(ak.lastApplied != a0.lastApplied)
+            return "server " + std::to_string(k + 1) + " applied " + std::to_string(ak.lastApplied) +
+                   " entries, server 1 applied " + std::to_string(a0.lastApplied);
+        std::vector<SensorReading> r = net.server(k).getSensorReadings();
+        if(r.size() != first.size() || !std::equal(r.begin(), r.end(), first.begin(), sameReading))
+            return "server " + std::to_string(k + 1) + " holds different readings from server 1";
+    }
+
+    std::set<int> stored;
+    for(auto &r : first) stored.insert(r.node_id * SIM_TEMP_RANGE + r.temperature);
+    for(int seq : acked)
+        if(!stored.count(seq)) return "acknowledged write " + std::to_string(seq) + " was lost";
+    return "";
+}
+
+static void runOnce(const SimOptions &o, uint32_t seed, RunResult &res){
+    SimConfig c = o.net;
+    c.seed = seed;
+    std::vector<int> acked;
+    bool faultsOn = true;
+    double faultAt = -1;
+    int faultTerm = 0;
+    int nextSeq = 0;
+    double end = o.seconds * 1000;
+
+    SimNet net(c);
+    std::mt19937_64 &rng = net.random();
+
+    // one write every writeEveryMs to whichever server leads, as a client would find it
+    std::function<void()> client = [&](){
+        if(net.elapsedMs() >= end) return;
+        int l = net.leader();
+        if(l >= 0){
+            int seq = nextSeq++;
+            double sent = net.elapsedMs();
+            res.writes++;
+            std::string cmd = "DATA node=" + std::to_string(seq / SIM_TEMP_RANGE) +
+                              " temp=" + std::to_string(seq % SIM_TEMP_RANGE) + " humidity=0";
+            net.write(l, cmd, [&res, &acked, &net, seq, sent](AppendResult r){
+                if(r != AppendResult::Committed) return;
+                res.acked++;
+                res.commitMs.push_back(net.elapsedMs() - sent);
+                acked.push_back(seq);
+            });
+        }
+        net.after(o.writeEveryMs, client);
+    };
+
+    // faults never overlap: each one is undone before the next is due
+    std::function<void()> fault = [&](){
+        if(!faultsOn) return;
+        int l = net.leader();
+        int n = net.size();
+        bool hitLeader = false;
+        switch(o.scenario){
+        case Scenario::None:
+            return;
+        case Scenario::Failover:
+            if(l < 0) break;
+            net.pause(l);
+            net.after(o.faultMs, [&net, l]{ net.resume(l); });
+            hitLeader = true;
+            break;
+        case Scenario::Partition:
+            if(l < 0) break;
+            net.isolate(l);
+            net.after(o.faultMs, [&net]{ net.heal(); });
+            hitLeader = true;
+            break;
+        case Scenario::Chaos:
+            if(rng() % 2){
+                int k = rng() % n;
+                net.pause(k);
+                net.after(o.faultMs, [&net, k]{ net.resume(k); });
+                hitLeader = k == l;
+            } else {
+                // a random minority, with or without the leader
+                std::vector<int> side(n);
+                std::iota(side.begin(), side.end(), 0);
+                std::shuffle(side.begin(), side.end(), rng);
+                side.resize(1 + rng() % std::max(1, (n - 1) / 2));
+                net.partition(side);
+                net.after(o.faultMs, [&net]{ net.heal(); });
+                hitLeader = std::find(side.begin(), side.end(), l) != side.end();
+            }
+            break;
+        }
+        if(hitLeader && l >= 0){
+            faultAt = net.elapsedMs();
+            faultTerm = net.server(l).getTerm();
+        }
+        net.after(o.faultEveryMs, fault);
+    };
+
+    net.after(0, client);
+    net.after(o.faultEveryMs, fault);
+    while(net.step(end)){
+        if(faultAt < 0) continue;
+        int l = net.leader();
+        if(l >= 0 && net.server(l).getTerm() > faultTerm){
+            res.electionMs.push_back(net.elapsedMs() - faultAt);
+            faultAt = -1;
+        }
+    }
+    faultsOn = false;
+
+    res.failure = verify(net, acked);
+    res.events = net.eventsRun();
+    res.simMs = net.elapsedMs();
+}
+
+static void printLatency(std::ostream &out, const char *name, std::vector<double> &v){
+    std::sort(v.begin(), v.end());
+    auto pct = [&](double p){ return v.empty() ? 0.0 : v[(size_t)(p * (v.size() - 1))]; };
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%-26sp50 %.1f  p90 %.1f  p99 %.1f  max %.1f (%zu samples)\n",
+             name, pct(0.50), pct(0.90), pct(0.99), v.empty() ? 0.0 : v.back(), v.size());
+    out << buf;
+}
+
+static bool parseScenario(const std::string &s, Scenario &out){
+    if(s == "none") out = Scenario::None;
+    else if(s == "failover") out = Scenario::Failover;
+    else if(s == "partition") out = Scenario::Partition;
+    else if(s == "chaos") out = Scenario::Chaos;
+    else return false;
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    SimOptions o;
+    o.scenario = Scenario::Failover;
+    o.runs = 100;
+    o.seconds = 10;
+    o.writeEveryMs = 5;
+    o.faultEveryMs = 2000;
+    o.faultMs = 1000;
+    o.verbose = false;
+
+    for(int i = 1; i < argc; i++){
+        std::string arg = argv[i];
+        if(arg.rfind("--runs=", 0) == 0) o.runs = std::max(1, atoi(arg.c_str() + 7));
+        else if(arg.rfind("--seed=", 0) == 0) o.net.seed = strtoul(arg.c_str() + 7, nullptr, 10);
+        else if(arg.rfind("--servers=", 0) == 0) o.net.servers = std::max(1, atoi(arg.c_str() + 10));
+        else if(arg.rfind("--learners=", 0) == 0) o.net.learners = std::max(0, atoi(arg.c_str() + 11));
+        else if(arg.rfind("--seconds=", 0) == 0) o.seconds = std::max(0.1, atof(arg.c_str() + 10));
+        else if(arg.rfind("--write-every-ms=", 0) == 0) o.writeEveryMs = std::max(0.01, atof(arg.c_str() + 17));
+        else if(arg.rfind("--fault-every-ms=", 0) == 0) o.faultEveryMs = std::max(1.0, atof(arg.c_str() + 17));
+        else if(arg.rfind("--fault-ms=", 0) == 0) o.faultMs = std::max(0.0, atof(arg.c_str() + 11));
+        else if(arg.rfind("--delay-ms=", 0) == 0 && sscanf(arg.c_str() + 11, "%lf:%lf", &o.net.delayMinMs, &o.net.delayMaxMs) == 2) {}
+        else if(arg.rfind("--drop=", 0) == 0) o.net.drop = atof(arg.c_str() + 7);
+        else if(arg.rfind("--reorder=", 0) == 0) o.net.reorder = atof(arg.c_str() + 10);
+        else if(arg.rfind("--rpc-timeout-ms=", 0) == 0) o.net.rpcTimeoutMs = std::max(1, atoi(arg.c_str() + 17));
+        else if(arg.rfind("--snapshot-every=", 0) == 0) o.net.snapshotEvery = std::max(0, atoi(arg.c_str() + 17));
+        else if(arg.rfind("--scenario=", 0) == 0 && parseScenario(arg.substr(11), o.scenario)) {}
+        else if(arg == "--verbose") o.verbose = true;
+        else {
+            std::cout << "Usage: " << argv[0] << " [options]\n";
+            std::cout << "  --scenario=S          failover (pause the leader), partition (isolate the leader),\n";
+            std::cout << "                        chaos (pause any server or cut off a random minority) or none\n";
+            std::cout << "  --runs=N              runs, seeded seed, seed + 1, ... (default 100)\n";
+            std::cout << "  --seed=S              first seed (default 1)\n";
+            std::cout << "  --servers=N           voting servers (default 3)\n";
+            std::cout << "  --learners=N          non-voting learners besides them (default 0)\n";
+            std::cout << "  --seconds=T           virtual seconds of load and faults per run (default 10)\n";
+            std::cout << "  --write-every-ms=W    one client write per W ms (default 5)\n";
+            std::cout << "  --fault-every-ms=F    a fault every F ms (default 2000), lasting\n";
+            std::cout << "  --fault-ms=D          D ms (default 1000, kept below F)\n";
+            std::cout << "  --delay-ms=MIN:MAX    one-way message delay (default 0.2:2)\n";
+            std::cout << "  --drop=P              chance that a message is lost (default 0)\n";
+            std::cout << "  --reorder=P           chance that a message is held back and overtaken (default 0)\n";
+            std::cout << "  --rpc-timeout-ms=T    a sender gives up after T ms (default " << PEER_TIMEOUT_MS << ")\n";
+            std::cout << "  --snapshot-every=N    applied entries between snapshots (default " << SNAPSHOT_EVERY << ")\n";
+            std::cout << "  --verbose             let the servers print their log lines\n";
+            return 1;
+        }
+    }
+    o.faultMs = std::min(o.faultMs, o.faultEveryMs * 0.9);
+
+    // the servers' own log lines would swamp the report
+    std::ostream out(std::cout.rdbuf());
+    if(!o.verbose) std::cout.rdbuf(nullptr);
+
+    std::vector<double> elections, commits;
+    long long writes = 0, acked = 0;
+    uint64_t events = 0;
+    double simMs = 0;
+    int failed = 0;
+    auto t0 = std::chrono::steady_clock::now();
+    for(int r = 0; r < o.runs; r++){
+        uint32_t seed = o.net.seed + r;
+        RunResult res;
+        runOnce(o, seed, res);
+        if(!res.failure.empty()){
+            failed++;
+            out << "FAIL seed=" << seed << ": " << res.failure << "\n";
+        }
+        elections.insert(elections.end(), res.electionMs.begin(), res.electionMs.end());
+        commits.insert(commits.end(), res.commitMs.begin(), res.commitMs.end());
+        writes += res.writes;
+        acked += res.acked;
+        events += res.events;
+        simMs += res.simMs;
+    }
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+    char buf[256];
+    out << "runs:                     " << o.runs << " (" << failed << " failed)\n";
+    snprintf(buf, sizeof(buf), "virtual time:             %.0f s in %.2f s wall (%.0f runs/min)\n",
+             simMs / 1000, wall, wall > 0 ? o.runs * 60 / wall : 0.0);
+    out << buf;
+    out << "events:                   " << events << "\n";
+    out << "writes acked/sent:        " << acked << " / " << writes << "\n";
+    printLatency(out, "election (ms):", elections);
+    printLatency(out, "commit (ms):", commits);
+    return failed ? 1 : 0;
+}
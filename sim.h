@@ -0,0 +1,302 @@
+#ifndef __SIM_H__
+#define __SIM_H__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <queue>
+#include <memory>
+#include <random>
+#include <chrono>
+#include <functional>
+
+#include "raft.h"
+
+#define SIM_EPOCH_S         1000                // virtual time starts here; Raft reads time_point() as "never"
+#define SIM_WALL_EPOCH_MS   1700000000000LL     // the virtual wall clock at the start, for log timestamps
+
+struct SimConfig {
+    int servers = 3;
+    int learners = 0;               // more servers, numbered after the voters, that never vote
+    uint32_t seed = 1;
+    double delayMinMs = 0.2;        // one-way delay of every message, uniform in [min, max]
+    double delayMaxMs = 2;
+    double drop = 0;                // chance that a message is lost
+    double reorder = 0;             // chance that a message is held back until later ones overtake it
+    int rpcTimeoutMs = PEER_TIMEOUT_MS;     // a sender gives up on an exchange after this
+    int snapshotEvery = SNAPSHOT_EVERY;
+};
+
+// virtual time, moved forward only by SimNet as it takes events off its queue
+class SimClock : public Clock {
+public:
+    int64_t ns = (int64_t)SIM_EPOCH_S * 1000000000;
+
+    std::chrono::steady_clock::time_point now() override {
+        return std::chrono::steady_clock::time_point(std::chrono::nanoseconds(ns));
+    }
+    int64_t wallMs() override { return SIM_WALL_EPOCH_MS + ns / 1000000; }
+};
+
+// A discrete-event simulation of a whole cluster in one thread. Every server is a
+// Raft driven through poll() instead of its own threads, with a SimClock for time and
+// a SimNet transport for its peers. Messages, timers and the driver's own callbacks
+// are events ordered by virtual time (ties by the order they were scheduled), and
+// every random choice comes from one generator seeded from SimConfig, so a seed
+// replays a run exactly. Server k is Raft id k + 1; its peer i is server i, or i + 1
+// from k on. Servers from SimConfig::servers on are learners.
+//
+// Faults: a message can be delayed, dropped or held back so later ones overtake it;
+// links can be cut in either direction; a server can be paused like a stopped process,
+// keeping its state, with everything sent to it or due on it running once it resumes.
+class SimNet {
+private:
+    struct Event {
+        int64_t at;
+        uint64_t seq;
+        int server;                 // whose code runs, -1 for the driver
+        std::function<void()> run;
+    };
+
+    struct Later {
+        bool operator()(const Event &a, const Event &b) const {
+            return a.at != b.at ? a.at > b.at : a.seq > b.seq;
+        }
+    };
+
+    // one request/reply exchange; the reply and the sender's timeout race to settle it
+    template<class Reply>
+    struct Exchange {
+        PeerReplyFn<Reply> done;
+        bool settled = false;
+
+        void settle(bool ok, Reply &r){
+            if(settled) return;
+            settled = true;
+            done(ok, r);
+        }
+    };
+
+    class Endpoint : public Transport {
+    private:
+        SimNet &net;
+        int from;
+
+    public:
+        Endpoint(SimNet &n, int k) : net(n), from(k) {}
+
+        void call(size_t i, const ReqVoteArgs &a, PeerReplyFn<ReqVoteReply> done) override { net.send(from, i, a, std::move(done)); }
+        void call(size_t i, const AppendEntriesArgs &a, PeerReplyFn<AppendEntriesReply> done) override { net.send(from, i, a, std::move(done)); }
+        void call(size_t i, const InstallSnapshotArgs &a, PeerReplyFn<InstallSnapshotReply> done) override { net.send(from, i, a, std::move(done)); }
+        void call(size_t i, const ReadIndexArgs &a, PeerReplyFn<ReadIndexReply> done) override { net.send(from, i, a, std::move(done)); }
+        void call(size_t i, const TimeoutNowArgs &a, PeerReplyFn<TimeoutNowReply> done) override { net.send(from, i, a, std::move(done)); }
+    };
+
+    SimConfig cfg;
+    SimClock clock;
+    int64_t start;
+    std::mt19937_64 rng;
+    std::priority_queue<Event, std::vector<Event>, Later> events;
+    uint64_t nextSeq;
+    uint64_t processed;
+    std::vector<std::unique_ptr<Raft>> rafts;
+    std::vector<int> paused;
+    std::vector<std::vector<Event>> held;       // events of a paused server, run when it resumes
+    std::vector<int64_t> wakeAt;                // earliest poll already scheduled per server
+    std::vector<std::vector<int>> cut;          // cut[a][b]: messages from a to b are lost
+    std::map<int, int> termLeaders;             // every server seen leading each term
+    std::string violation;
+
+    static ReqVoteReply handle(Raft &r, ReqVoteArgs &a){ return r.handleReqVote(a); }
+    static AppendEntriesReply handle(Raft &r, AppendEntriesArgs &a){ return r.handleAppendEntries(a); }
+    static InstallSnapshotReply handle(Raft &r, InstallSnapshotArgs &a){ return r.handleInstallSnapshot(a); }
+    static ReadIndexReply handle(Raft &r, ReadIndexArgs &a){ return r.handleReadIndex(a); }
+    static TimeoutNowReply handle(Raft &r, TimeoutNowArgs &a){ return r.handleTimeoutNow(a); }
+
+    void schedule(int64_t at, int server, std::function<void()> run){
+        events.push(Event{at, nextSeq++, server, std::move(run)});
+    }
+
+    int64_t msToNs(double ms){ return (int64_t)(ms * 1e6); }
+
+    bool chance(double p){
+        return p > 0 && std::uniform_real_distribution<double>(0, 1)(rng) < p;
+    }
+
+    // one-way latency of a message that is not lost
+    int64_t delay(){
+        double ms = std::uniform_real_distribution<double>(cfg.delayMinMs, cfg.delayMaxMs)(rng);
+        if(chance(cfg.reorder))
+            ms += std::uniform_real_distribution<double>(cfg.delayMaxMs, 1.5 * cfg.rpcTimeoutMs)(rng);
+        return msToNs(ms);
+    }
+
+    // The request and the reply each take delay() and may be dropped, or cut off by a
+    // partition in place when they arrive; the sender's timeout settles the exchange if
+    // no reply makes it back in time.
+    template<class Args, class Reply>
+    void send(int from, size_t i, const Args &a, PeerReplyFn<Reply> done){
+        int to = (int)i < from ? (int)i : (int)i + 1;
+        auto x = std::make_shared<Exchange<Reply>>();
+        x->done = std::move(done);
+        schedule(clock.ns + msToNs(cfg.rpcTimeoutMs), from, [x]{
+            Reply none{};
+            x->settle(false, none);
+        });
+        if(chance(cfg.drop)) return;
+        Args req = a;
+        schedule(clock.ns + delay(), to, [this, from, to, x, req]() mutable {
+            if(cut[from][to]) return;
+            Reply r = handle(*rafts[to], req);
+            if(chance(cfg.drop)) return;
+            schedule(clock.ns + delay(), from, [this, from, to, x, r]() mutable {
+                if(!cut[to][from]) x->settle(true, r);
+            });
+        });
+    }
+
+    // runs server k's loops and makes sure it is woken when they next have work
+    void poll(int k){
+        int64_t next = std::chrono::duration_cast<std::chrono::nanoseconds>(rafts[k]->poll().time_since_epoch()).count();
+        next = std::max(next, clock.ns + 1000);
+        if(next < wakeAt[k]){
+            wakeAt[k] = next;
+            schedule(next, k, [this, k, next]{ if(wakeAt[k] == next) wakeAt[k] = INT64_MAX; });
+        }
+        if(rafts[k]->isLeader()){
+            if(k >= cfg.servers && violation.empty())
+                violation = "learner server " + std::to_string(k + 1) + " became leader";
+            int term = rafts[k]->getTerm();
+            auto it = termLeaders.find(term);
+            if(it == termLeaders.end()) termLeaders[term] = k;
+            else if(it->second != k && violation.empty())
+                violation = "two leaders in term " + std::to_string(term) + ": servers " +
+                            std::to_string(it->second + 1) + " and " + std::to_string(k + 1);
+        }
+    }
+
+    void run(Event &e){
+        if(e.server >= 0 && paused[e.server]){
+            held[e.server].push_back(std::move(e));
+            return;
+        }
+        if(e.run) e.run();
+        if(e.server >= 0) poll(e.server);
+    }
+
+public:
+    explicit SimNet(const SimConfig &c)
+      : cfg(c), rng(c.seed), nextSeq(0), processed(0)
+    {
+        start = clock.ns;
+        int n = cfg.servers + cfg.learners;
+        paused.assign(n, 0);
+        held.resize(n);
+        wakeAt.assign(n, INT64_MAX);
+        cut.assign(n, std::vector<int>(n, 0));
+        for(int k = 0; k < n; k++){
+            std::vector<std::string> peers;
+            for(int j = 0; j < n; j++) if(j != k) peers.push_back("sim:" + std::to_string(j + 1));
+            rafts.emplace_back(new Raft(k + 1, 0, peers));
+            rafts[k]->setLearner(k >= cfg.servers);
+            for(int j = cfg.servers; j < n; j++) if(j != k) rafts[k]->setPeerLearner(j < k ? j : j - 1);
+            rafts[k]->setTransport(std::unique_ptr<Transport>(new Endpoint(*this, k)));
+            rafts[k]->setClock(&clock);
+            rafts[k]->setSeed((uint32_t)rng());
+            rafts[k]->setSnapshotEvery(cfg.snapshotEvery);
+        }
+        for(int k = 0; k < n; k++) schedule(clock.ns, k, nullptr);
+    }
+
+    // the servers go first, so their callbacks never outlive the queue
+    ~SimNet(){
+        for(auto &r : rafts) r->stop();
+    }
+
+    int size() const { return rafts.size(); }
+    Raft &server(int k){ return *rafts[k]; }
+    double elapsedMs() const { return (clock.ns - start) / 1e6; }
+    uint64_t eventsRun() const { return processed; }
+    // empty unless two servers have led the same term
+    const std::string &safetyViolation() const { return violation; }
+    std::mt19937_64 &random(){ return rng; }
+
+    // runs f on the driver's side, ms from now
+    void after(double ms, std::function<void()> f){
+        schedule(clock.ns + msToNs(ms), -1, std::move(f));
+    }
+
+    // Runs the next event if it is due by untilMs (since the start); otherwise moves the
+    // clock to untilMs and returns false.
+    bool step(double untilMs){
+        int64_t limit = start + msToNs(untilMs);
+        if(events.empty() || events.top().at > limit){
+            clock.ns = std::max(clock.ns, limit);
+            return false;
+        }
+        // pop() only compares at and seq, which moving the event leaves in place
+        Event e = std::move(const_cast<Event &>(events.top()));
+        events.pop();
+        clock.ns = std::max(clock.ns, e.at);
+        processed++;
+        run(e);
+        return true;
+    }
+
+    void runUntil(double ms){
+        while(step(ms)) {}
+    }
+
+    // a client write sent to server k; a paused server does not answer, which the
+    // client sees as NotLeader
+    void write(int k, std::string cmd, std::function<void(AppendResult)> done){
+        if(paused[k]){
+            done(AppendResult::NotLeader);
+            return;
+        }
+        rafts[k]->appendCommandAsync(cmd, std::move(done));
+        poll(k);
+    }
+
+    void pause(int k){ paused[k] = 1; }
+
+    void resume(int k){
+        if(!paused[k]) return;
+        paused[k] = 0;
+        std::vector<Event> due;
+        due.swap(held[k]);
+        for(auto &e : due) run(e);
+        poll(k);
+    }
+
+    bool isPaused(int k) const { return paused[k]; }
+
+    // cuts every link between the two sides, in both directions
+    void partition(const std::vector<int> &side){
+        std::vector<int> in(size(), 0);
+        for(int k : side) in[k] = 1;
+        for(int a = 0; a < size(); a++)
+            for(int b = 0; b < size(); b++)
+                if(in[a] != in[b]) cut[a][b] = 1;
+    }
+
+    void isolate(int k){ partition(std::vector<int>{k}); }
+
+    void heal(){
+        for(auto &row : cut) std::fill(row.begin(), row.end(), 0);
+    }
+
+    // the running leader with the highest term, -1 if there is none
+    int leader(){
+        int best = -1, bestTerm = -1;
+        for(int k = 0; k < size(); k++){
+            if(paused[k] || !rafts[k]->isLeader()) continue;
+            int t = rafts[k]->getTerm();
+            if(t > bestTerm){ best = k; bestTerm = t; }
+        }
+        return best;
+    }
+};
+
+#endif
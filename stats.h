@@ -0,0 +1,176 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <math.h>
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+
+#define SKETCH_RELATIVE_ACCURACY 0.01
+
+// count, min, max, mean and variance of a stream, updated in O(1) per value
+// (Welford's method, which stays accurate where sum / sum-of-squares would not)
+struct RunningStats {
+    long long count = 0;
+    double mean = 0;
+    double m2 = 0;
+    double min = 0;
+    double max = 0;
+
+    void add(double x){
+        count++;
+        if(count == 1){ min = max = x; }
+        else { min = std::min(min, x); max = std::max(max, x); }
+        double d = x - mean;
+        mean += d / count;
+        m2 += d * (x - mean);
+    }
+
+    // folds in the stats of another stream (Chan et al.'s pairwise update)
+    void merge(const RunningStats &o){
+        if(o.count == 0) return;
+        if(count == 0){ *this = o; return; }
+        long long n = count + o.count;
+        double d = o.mean - mean;
+        mean += d * o.count / n;
+        m2 += o.m2 + d * d * count * o.count / n;
+        min = std::min(min, o.min);
+        max = std::max(max, o.max);
+        count = n;
+    }
+
+    double variance() const { return count > 1 ? m2 / (count - 1) : 0; }
+    double stddev() const { return sqrt(variance()); }
+};
+
+// smoothed mean and mean deviation of a latency stream, as TCP keeps them for its
+// retransmission timeout (Jacobson/Karels): recent samples weigh most
+struct LatencyEstimator {
+    bool primed = false;
+    double smoothed = 0;
+    double deviation = 0;
+
+    void add(double x){
+        if(!primed){
+            primed = true;
+            smoothed = x;
+            deviation = x / 2;
+            return;
+        }
+        deviation = 0.75 * deviation + 0.25 * fabs(smoothed - x);
+        smoothed = 0.875 * smoothed + 0.125 * x;
+    }
+};
+
+// DDSketch: quantiles within a relative error of alpha. A value x > 0 lands in bucket
+// ceil(log_gamma(x)) with gamma = (1 + alpha) / (1 - alpha); negative values use a
+// mirrored set of buckets. Ingest refuses readings outside int16, so the bucket count
+// stays in the hundreds and no bucket collapsing is needed.
+class DDSketch {
+private:
+    // counts for a contiguous range of bucket indexes, grown at either end on demand
+    struct Buckets {
+        int first = 0;
+        std::vector<long long> counts;
+
+        void add(int b){
+            if(counts.empty()) first = b;
+            if(b < first){
+                counts.insert(counts.begin(), first - b, 0);
+                first = b;
+            }
+            if(b - first >= (int)counts.size()) counts.resize(b - first + 1, 0);
+            counts[b - first]++;
+        }
+
+        void merge(const Buckets &o){
+            if(o.counts.empty()) return;
+            if(counts.empty()){ *this = o; return; }
+            int end = std::max(first + (int)counts.size(), o.first + (int)o.counts.size());
+            if(o.first < first){
+                counts.insert(counts.begin(), first - o.first, 0);
+                first = o.first;
+            }
+            counts.resize(end - first, 0);
+            for(size_t i = 0; i < o.counts.size(); i++) counts[o.first - first + i] += o.counts[i];
+        }
+    };
+
+    double gamma;
+    double logGamma;
+    Buckets pos;
+    Buckets neg;
+    long long zero;
+    long long count;
+
+    int bucket(double x) const { return (int)ceil(log(x) / logGamma); }
+    double value(int b) const { return 2 * pow(gamma, b) / (gamma + 1); }
+
+public:
+    explicit DDSketch(double alpha = SKETCH_RELATIVE_ACCURACY)
+      : gamma((1 + alpha) / (1 - alpha)), logGamma(log(gamma)), zero(0), count(0) {}
+
+    void add(double x){
+        count++;
+        if(x > 0) pos.add(bucket(x));
+        else if(x < 0) neg.add(bucket(-x));
+        else zero++;
+    }
+
+    long long size() const { return count; }
+
+    // sketches with the same alpha merge exactly: their buckets line up
+    void merge(const DDSketch &o){
+        pos.merge(o.pos);
+        neg.merge(o.neg);
+        zero += o.zero;
+        count += o.count;
+    }
+
+    // q in [0, 1]; 0 for an empty sketch
+    double quantile(double q) const {
+        if(count == 0) return 0;
+        long long rank = (long long)(q * (count - 1));
+        long long seen = 0;
+        for(int i = (int)neg.counts.size() - 1; i >= 0; i--){
+            seen += neg.counts[i];
+            if(seen > rank) return -value(neg.first + i);
+        }
+        seen += zero;
+        if(seen > rank) return 0;
+        for(size_t i = 0; i < pos.counts.size(); i++){
+            seen += pos.counts[i];
+            if(seen > rank) return value(pos.first + (int)i);
+        }
+        return pos.counts.empty() ? 0 : value(pos.first + (int)pos.counts.size() - 1);
+    }
+};
+
+// the figures QUERY AGG reports for one column
+struct ColumnSummary {
+    double min, max, mean, stddev;
+    double p50, p90, p99;
+};
+
+// a column's running moments and quantile sketch, kept side by side
+struct ColumnStats {
+    RunningStats moments;
+    DDSketch sketch;
+
+    void add(double x){
+        moments.add(x);
+        sketch.add(x);
+    }
+
+    void merge(const ColumnStats &o){
+        moments.merge(o.moments);
+        sketch.merge(o.sketch);
+    }
+
+    ColumnSummary summary() const {
+        return ColumnSummary{moments.min, moments.max, moments.mean, moments.stddev(),
+                             sketch.quantile(0.5), sketch.quantile(0.9), sketch.quantile(0.99)};
+    }
+};
+
+#endif
@@ -318,10 +318,178 @@ if [ ${#SURVIVING_COUNTS[@]} -eq 2 ]; then
     fi
 fi
 
+echo ""
+echo "PHASE 8: Shared Commit Batch"
+echo "-----------------------------------"
+
+# A lone server holding its batch open for 1.5s: two connections' DATA lines end up
+# in one commit, and both must be answered as soon as it commits, not only the one
+# whose write closed the batch.
+BATCH_PORT=$((BASE_PORT+10))
+./server $BATCH_PORT "" 1 --batch=2 --batch-wait-us=1500000 > s_batch.log 2>&1 &
+BATCH_PID=$!
+sleep 3
+
+(echo "DATA node=1 temp=20 humidity=40"; sleep 3) | nc -w 3 127.0.0.1 $BATCH_PORT > batch_b.out 2>/dev/null &
+B_PID=$!
+sleep 0.3
+A_RESULT=$( (echo "DATA node=2 temp=21 humidity=41"; sleep 1) | nc -w 1 127.0.0.1 $BATCH_PORT 2>/dev/null)
+B_RESULT=$(cat batch_b.out)
+
+echo "  Connection A: $A_RESULT"
+echo "  Connection B: $B_RESULT"
+if echo "$A_RESULT" | grep -q "OK replicated" && echo "$B_RESULT" | grep -q "OK replicated"; then
+    echo "Both connections answered when the shared batch committed"
+else
+    echo "A connection in the shared batch was not answered"
+fi
+kill $B_PID 2>/dev/null
+
+kill $BATCH_PID 2>/dev/null
+
+echo ""
+echo "PHASE 9: WAL Restart"
+echo "-----------------------------------"
+
+# A lone server with a write-ahead log: acknowledged readings must survive kill -9.
+# The reading sent after the restart commits whatever tail the old term left open.
+WAL_PORT=$((BASE_PORT+11))
+rm -rf wal_test
+./server $WAL_PORT "" 1 --wal-dir=wal_test > s_wal.log 2>&1 &
+WAL_PID=$!
+sleep 3
+for i in 1 2 3; do
+    (echo "DATA node=7 temp=2$i humidity=5$i"; sleep 0.5) | nc -w 1 127.0.0.1 $WAL_PORT > /dev/null 2>&1
+done
+BEFORE=$( (echo "QUERY STATS"; sleep 0.5) | nc -w 1 127.0.0.1 $WAL_PORT 2>/dev/null | grep "Total Sensor Readings")
+kill -9 $WAL_PID 2>/dev/null
+wait $WAL_PID 2>/dev/null
+
+./server $WAL_PORT "" 1 --wal-dir=wal_test >> s_wal.log 2>&1 &
+WAL_PID=$!
+sleep 3
+(echo "DATA node=7 temp=24 humidity=54"; sleep 0.5) | nc -w 1 127.0.0.1 $WAL_PORT > /dev/null 2>&1
+AFTER=$( (echo "QUERY STATS"; sleep 0.5) | nc -w 1 127.0.0.1 $WAL_PORT 2>/dev/null | grep "Total Sensor Readings")
+
+echo "  Before kill: $BEFORE"
+echo "  After restart: $AFTER"
+if echo "$BEFORE" | grep -q ": 3$" && echo "$AFTER" | grep -q ": 4$"; then
+    echo "Acknowledged readings survived the restart"
+else
+    echo "Readings were lost across the restart"
+fi
+kill $WAL_PID 2>/dev/null
+
+echo ""
+echo "PHASE 10: Linearizable Reads"
+echo "-----------------------------------"
+
+# A write acknowledged by the leader must be visible to a linearizable read on the
+# leader and to a follower read on the other survivor.
+LIN_LEADER_PORT=""
+LIN_FOLLOWER_PORT=""
+LIN_FOLLOWER_ID=""
+for i in 0 1 2; do
+    server_id=$((i+1))
+    [ $server_id -eq $LEADER_ID ] && continue
+    STATUS=$( (echo "QUERY STATUS"; sleep 0.5) | nc -w 1 127.0.0.1 ${PORTS[$i]} 2>/dev/null)
+    if echo "$STATUS" | grep -q "Leader=Yes"; then
+        LIN_LEADER_PORT=${PORTS[$i]}
+    else
+        LIN_FOLLOWER_PORT=${PORTS[$i]}
+        LIN_FOLLOWER_ID=$server_id
+    fi
+done
+
+if [ -z "$LIN_LEADER_PORT" ] || [ -z "$LIN_FOLLOWER_PORT" ]; then
+    echo "No leader/follower pair among the survivors"
+else
+    PRE=$( (echo "QUERY STATS"; sleep 1) | nc -w 2 127.0.0.1 $LIN_LEADER_PORT 2>/dev/null | grep "Total Sensor Readings" | sed 's/.*: \([0-9]*\)/\1/')
+    WRITE=$( (echo "DATA node=9 temp=30 humidity=60"; sleep 1) | nc -w 2 127.0.0.1 $LIN_LEADER_PORT 2>/dev/null)
+    LIN=$( (echo "QUERY STATS consistency=linearizable"; sleep 1) | nc -w 2 127.0.0.1 $LIN_LEADER_PORT 2>/dev/null | grep "Total Sensor Readings" | sed 's/.*: \([0-9]*\)/\1/')
+    FOLLOW=$( (echo "QUERY STATS consistency=follower"; sleep 1) | nc -w 2 127.0.0.1 $LIN_FOLLOWER_PORT 2>/dev/null | grep "Total Sensor Readings" | sed 's/.*: \([0-9]*\)/\1/')
+
+    echo "  Write: $WRITE"
+    echo "  Linearizable read on leader (port $LIN_LEADER_PORT): $LIN readings"
+    echo "  Follower read on port $LIN_FOLLOWER_PORT: $FOLLOW readings"
+    if echo "$WRITE" | grep -q "OK replicated" && [ -n "$PRE" ] && [ -n "$LIN" ] && [ -n "$FOLLOW" ] &&
+       [ "$LIN" -gt "$PRE" ] && [ "$FOLLOW" -ge "$LIN" ]; then
+        echo "Both reads include the acknowledged write"
+    else
+        echo "A read missed the acknowledged write"
+    fi
+fi
+
+echo ""
+echo "PHASE 11: Leadership Transfer"
+echo "-----------------------------------"
+
+# The leader hands off to the other survivor, which must then report itself leader.
+if [ -z "$LIN_LEADER_PORT" ] || [ -z "$LIN_FOLLOWER_PORT" ]; then
+    echo "No leader/follower pair to transfer between"
+else
+    TRANSFER=$( (echo "CMD TRANSFER_LEADER $LIN_FOLLOWER_ID"; sleep 3) | nc -w 4 127.0.0.1 $LIN_LEADER_PORT 2>/dev/null)
+    sleep 1
+    STATUS=$( (echo "QUERY STATUS"; sleep 0.5) | nc -w 1 127.0.0.1 $LIN_FOLLOWER_PORT 2>/dev/null)
+    echo "  Transfer to server $LIN_FOLLOWER_ID: $TRANSFER"
+    if echo "$TRANSFER" | grep -q "OK transferred to $LIN_FOLLOWER_ID" && echo "$STATUS" | grep -q "Leader=Yes"; then
+        echo "Server $LIN_FOLLOWER_ID took over leadership"
+    else
+        echo "Leadership transfer failed"
+    fi
+fi
+
+echo ""
+echo "PHASE 12: Reading Range Boundaries"
+echo "-----------------------------------"
+
+# readings are stored as int16: the extremes are kept exactly, one past them is refused
+RANGE_PORT=$((BASE_PORT+12))
+./server $RANGE_PORT "" 1 > s_range.log 2>&1 &
+RANGE_PID=$!
+sleep 2
+
+RANGE_OK=true
+check_reply() {
+    REPLY_GOT=$( (echo "$1"; sleep 2) | nc -w 2 127.0.0.1 $RANGE_PORT 2>/dev/null)
+    echo "  $1 -> $REPLY_GOT"
+    if ! echo "$REPLY_GOT" | grep -q "$2"; then
+        RANGE_OK=false
+    fi
+}
+
+check_reply "DATA node=7 temp=32767 humidity=-32768" "OK replicated"
+check_reply "DATA node=7 temp=-32767 humidity=32767" "OK replicated"
+check_reply "DATA node=7 temp=32768 humidity=0" "ERR invalid_command"
+check_reply "DATA node=7 temp=0 humidity=-32769" "ERR invalid_command"
+check_reply "DATA_BATCH node=8 32767,-32768 -32767,32767" "OK replicated"
+check_reply "DATA_BATCH node=8 1,2 32768,0" "ERR invalid_batch"
+check_reply "DATA_BATCH node=8 1,-32769" "ERR invalid_batch"
+
+STORED=$(./query 127.0.0.1 $RANGE_PORT 2 7 2>&1)
+if ! echo "$STORED" | grep -q "Total Readings: 2" || ! echo "$STORED" | grep -q "Temperature=32767°C, Humidity=-32768%"; then
+    RANGE_OK=false
+fi
+STORED=$(./query 127.0.0.1 $RANGE_PORT 2 8 2>&1)
+if ! echo "$STORED" | grep -q "Total Readings: 2" || ! echo "$STORED" | grep -q "Temperature=-32767°C, Humidity=32767%"; then
+    RANGE_OK=false
+fi
+
+if [ "$RANGE_OK" = true ]; then
+    echo "Boundary readings stored exactly, out-of-range readings refused"
+else
+    echo "Reading range check failed"
+fi
+
+kill $RANGE_PID 2>/dev/null
+
 echo ""
 echo "Logs saved:"
 echo "  - Server logs: s1.log, s2.log, s3.log"
 echo "  - Node logs: n1.log, n2.log, n3.log, n4.log, n5.log"
+echo "  - Batch test server log: s_batch.log"
+echo "  - WAL test server log: s_wal.log"
+echo "  - Range test server log: s_range.log"
 echo ""
 echo "============================================="
 echo "TEST COMPLETE"
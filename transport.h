@@ -0,0 +1,98 @@
+#ifndef __TRANSPORT_H__
+#define __TRANSPORT_H__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <functional>
+
+#include "rpc.h"
+#include "peerconn.h"
+
+// Where Raft reads the time: its timers, leases and log timestamps. Servers use the
+// system clocks; the simulator swaps in a virtual one so runs are reproducible.
+class Clock {
+public:
+    virtual ~Clock(){}
+    virtual std::chrono::steady_clock::time_point now() = 0;
+    virtual int64_t wallMs() = 0;
+};
+
+class SystemClock : public Clock {
+public:
+    std::chrono::steady_clock::time_point now() override { return std::chrono::steady_clock::now(); }
+    int64_t wallMs() override { return wallClockMs(); }
+};
+
+static inline Clock &systemClock(){
+    static SystemClock c;
+    return c;
+}
+
+// done(ok, reply) ends one exchange; ok is false if no usable reply came back
+template<class Reply>
+using PeerReplyFn = std::function<void(bool, Reply &)>;
+
+// How Raft reaches its peers: one request/reply exchange with peer i, an index into
+// its peer list. done runs exactly once, without Raft's lock, either before call()
+// returns (TcpTransport blocks the calling thread for the round trip) or later from
+// whatever drives the transport (the simulator). Raft keeps at most one exchange per
+// peer outstanding. The receiving side is Raft's handle*() methods, reached through
+// peerstring() / peerframe() on a server and directly in the simulator.
+class Transport {
+public:
+    virtual ~Transport(){}
+    virtual void call(size_t i, const ReqVoteArgs &a, PeerReplyFn<ReqVoteReply> done) = 0;
+    virtual void call(size_t i, const AppendEntriesArgs &a, PeerReplyFn<AppendEntriesReply> done) = 0;
+    virtual void call(size_t i, const InstallSnapshotArgs &a, PeerReplyFn<InstallSnapshotReply> done) = 0;
+    virtual void call(size_t i, const ReadIndexArgs &a, PeerReplyFn<ReadIndexReply> done) = 0;
+    virtual void call(size_t i, const TimeoutNowArgs &a, PeerReplyFn<TimeoutNowReply> done) = 0;
+
+    // 0 keeps peer connections on the text protocol
+    virtual void setProtocol(int version){ (void)version; }
+    // requests go to Raft group g on each peer
+    virtual void setGroup(int g){ (void)g; }
+    virtual std::vector<PeerConnStats> stats(){ return std::vector<PeerConnStats>(); }
+};
+
+// one PeerConn per peer; each call is a blocking round trip on the caller's thread
+class TcpTransport : public Transport {
+private:
+    std::vector<std::unique_ptr<PeerConn>> conns;
+
+    template<class Args, class Reply>
+    void roundTrip(size_t i, const Args &a, PeerReplyFn<Reply> &done){
+        Reply r{};
+        bool ok = i < conns.size() && conns[i]->call(a, r);
+        done(ok, r);
+    }
+
+public:
+    explicit TcpTransport(const std::vector<std::string> &peers){
+        for(auto &p : peers) conns.emplace_back(new PeerConn(p));
+    }
+
+    void call(size_t i, const ReqVoteArgs &a, PeerReplyFn<ReqVoteReply> done) override { roundTrip(i, a, done); }
+    void call(size_t i, const AppendEntriesArgs &a, PeerReplyFn<AppendEntriesReply> done) override { roundTrip(i, a, done); }
+    void call(size_t i, const InstallSnapshotArgs &a, PeerReplyFn<InstallSnapshotReply> done) override { roundTrip(i, a, done); }
+    void call(size_t i, const ReadIndexArgs &a, PeerReplyFn<ReadIndexReply> done) override { roundTrip(i, a, done); }
+    void call(size_t i, const TimeoutNowArgs &a, PeerReplyFn<TimeoutNowReply> done) override { roundTrip(i, a, done); }
+
+    void setProtocol(int version) override {
+        for(auto &c : conns) c->setProtocol(version);
+    }
+
+    void setGroup(int g) override {
+        for(auto &c : conns) c->setGroup(g);
+    }
+
+    std::vector<PeerConnStats> stats() override {
+        std::vector<PeerConnStats> out;
+        for(auto &c : conns) out.push_back(c->stats());
+        return out;
+    }
+};
+
+#endif
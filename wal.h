@@ -0,0 +1,538 @@
+#ifndef __WAL_H__
+#define __WAL_H__
+
+#include <iostream>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "rpc.h"
+
+#define WAL_SEGMENT_BYTES   (64 << 20)
+#define WAL_MAGIC           0x4c415752u     // "RWAL"
+#define WAL_FORMAT          2               // 1: entries without ts, still replayed
+#define WAL_RECORD_HEADER   8               // u32 length, u32 crc32c of the body
+#define WAL_MAX_RECORD      (WIRE_MAX_FRAME)
+
+// fsync policy: Always before anything is acknowledged, Interval from a background
+// timer (a crash can lose the last few ms of acked writes), None leaves it to the OS
+enum class WalSync { Always, Interval, None };
+
+enum WalRecord : uint8_t {
+    WAL_ENTRY  = 1,     // index, term, ts, command; an index at or below the tail overwrites it
+    WAL_STATE  = 2,     // currentterm, votedfor + 1
+    WAL_COMMIT = 3,     // commit index hint, never fsynced on its own
+    WAL_RESET  = 4,     // snapshot index, term: the log was replaced by that snapshot
+    WAL_TYPED  = 5,     // index, term, ts, kind and fields as in AppendEntries frames;
+                        // written in place of WAL_ENTRY, which older logs still hold
+};
+
+struct WalRecovery {
+    int base;               // index covered by the snapshot; logs[0] is base + 1
+    int baseTerm;
+    std::string snapshot;   // empty if none was taken yet
+    std::vector<Log> logs;
+    int term;
+    int vote;
+    int commit;
+    long long bytes;
+    int segments;
+};
+
+struct Crc32cTable {
+    uint32_t t[8][256];
+    Crc32cTable(){
+        for(uint32_t i = 0; i < 256; i++){
+            uint32_t c = i;
+            for(int k = 0; k < 8; k++) c = (c & 1) ? (c >> 1) ^ 0x82f63b78u : c >> 1;
+            t[0][i] = c;
+        }
+        for(int s = 1; s < 8; s++)
+            for(int i = 0; i < 256; i++) t[s][i] = (t[s-1][i] >> 8) ^ t[0][t[s-1][i] & 0xff];
+    }
+};
+
+// CRC-32C (Castagnoli), slice-by-8: eight table lookups per 8 input bytes
+static inline uint32_t crc32c(const char *data, size_t n){
+    static const Crc32cTable tab;
+    const uint32_t (*table)[256] = tab.t;
+    uint32_t crc = 0xffffffffu;
+    const unsigned char *p = (const unsigned char*)data;
+    while(n >= 8){
+        uint32_t lo = crc ^ get_u32((const char*)p);
+        uint32_t hi = get_u32((const char*)p + 4);
+        crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^ table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24] ^
+              table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^ table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+        p += 8;
+        n -= 8;
+    }
+    while(n--) crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc ^ 0xffffffffu;
+}
+
+// Append-only write-ahead log split into numbered segment files. Every record is
+// length-prefixed and CRC-checked so a torn write at the tail is detected and cut
+// off on recovery. Callers encode records into an in-memory buffer under their own
+// lock (cheap) and call sync() outside it; whoever syncs writes out everything
+// buffered so far with one write and one fdatasync, so concurrent appenders share
+// the cost. Each segment starts with the current term/vote/commit, so dropping old
+// segments never loses the hard state. Snapshots live next to the segments as
+// snap-<index>-<term>.snap; once one is durable, the segments it covers are deleted.
+class Wal{
+private:
+    std::string dir;
+    WalSync policy;
+
+    std::mutex bufMu;       // guards pending and the last known hard state
+    std::string pending;
+    int stateTerm, stateVote, stateCommit;
+
+    std::mutex syncMu;      // one writer at a time; held across write and fsync
+    int fd;
+    uint64_t segSeq;
+    size_t segBytes;
+    bool dirty;             // written but not yet fsynced
+
+    // highest entry index in each segment, for compaction; guarded by syncMu
+    std::vector<std::pair<uint64_t, int>> segLast;
+    int pendingLast;        // highest entry index in pending; guarded by bufMu
+
+    std::string segPath(uint64_t seq) const {
+        char name[64];
+        snprintf(name, sizeof(name), "/wal-%016llu.log", (unsigned long long)seq);
+        return dir + name;
+    }
+
+    static void record(std::string &out, WalRecord type, const std::string &body){
+        std::string b;
+        b.reserve(body.size() + 1);
+        b.push_back((char)type);
+        b += body;
+        put_u32(out, b.size());
+        put_u32(out, crc32c(b.data(), b.size()));
+        out += b;
+    }
+
+    static std::string stateBody(int term, int vote){
+        std::string b;
+        put_varint(b, term);
+        put_varint(b, vote + 1);
+        return b;
+    }
+
+    static std::string commitBody(int commit){
+        std::string b;
+        put_varint(b, commit);
+        return b;
+    }
+
+    std::string snapPath(int index, int term, const char *ext) const {
+        char name[64];
+        snprintf(name, sizeof(name), "/snap-%016d-%d.%s", index, term, ext);
+        return dir + name;
+    }
+
+    void syncDir(){
+        int dfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+        if(dfd >= 0){
+            fsync(dfd);
+            close(dfd);
+        }
+    }
+
+    // newest snapshot file, by index; false if there is none
+    bool latestSnapshot(int &index, int &term){
+        bool found = false;
+        index = term = 0;
+        DIR *d = opendir(dir.c_str());
+        if(!d) return false;
+        while(dirent *e = readdir(d)){
+            int idx, t;
+            char tail;
+            if(sscanf(e->d_name, "snap-%d-%d.sna%c", &idx, &t, &tail) == 3 && tail == 'p' && idx >= index){
+                index = idx;
+                term = t;
+                found = true;
+            }
+        }
+        closedir(d);
+        return found;
+    }
+
+    bool writeAll(const std::string &buf){
+        size_t off = 0;
+        while(off < buf.size()){
+            ssize_t n = write(fd, buf.data() + off, buf.size() - off);
+            if(n < 0 && errno == EINTR) continue;
+            if(n <= 0){
+                perror("ERROR: WAL write failed");
+                return false;
+            }
+            off += n;
+        }
+        segBytes += buf.size();
+        dirty = true;
+        return true;
+    }
+
+    // caller holds syncMu
+    bool openSegment(uint64_t seq){
+        if(fd >= 0){
+            if(dirty) fdatasync(fd);
+            close(fd);
+        }
+        fd = open(segPath(seq).c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if(fd < 0){
+            perror("ERROR: failed to open WAL segment");
+            return false;
+        }
+        segSeq = seq;
+        segBytes = lseek(fd, 0, SEEK_END);
+        dirty = false;
+        if(segBytes > 0){
+            if(segLast.empty() || segLast.back().first != seq) segLast.push_back(std::make_pair(seq, 0));
+            return true;
+        }
+
+        std::string head;
+        put_u32(head, WAL_MAGIC);
+        put_u32(head, WAL_FORMAT);
+        {
+            std::lock_guard<std::mutex> lk(bufMu);
+            record(head, WAL_STATE, stateBody(stateTerm, stateVote));
+            record(head, WAL_COMMIT, commitBody(stateCommit));
+        }
+        segLast.push_back(std::make_pair(seq, 0));
+        if(!writeAll(head)) return false;
+        // the new directory entry must survive a crash too
+        syncDir();
+        return true;
+    }
+
+    std::vector<uint64_t> listSegments() const {
+        std::vector<uint64_t> seqs;
+        DIR *d = opendir(dir.c_str());
+        if(!d) return seqs;
+        while(dirent *e = readdir(d)){
+            unsigned long long seq;
+            char tail;
+            if(sscanf(e->d_name, "wal-%llu.lo%c", &seq, &tail) == 2 && tail == 'g') seqs.push_back(seq);
+        }
+        closedir(d);
+        std::sort(seqs.begin(), seqs.end());
+        return seqs;
+    }
+
+    // Replays one segment; returns the offset just past the last good record. Sets
+    // torn if the segment ends in a partial or corrupt record, and format to the
+    // header's version; a segment in an unknown format is not replayed at all.
+    // Format 1 entries carry no ts and are stamped with the time of recovery.
+    size_t replaySegment(const char *base, size_t len, WalRecovery &r, int &maxIndex, bool &torn, bool &bad, uint32_t &format){
+        torn = false;
+        format = WAL_FORMAT;
+        if(len < 8){
+            torn = len > 0;
+            return 0;
+        }
+        if(get_u32(base) != WAL_MAGIC){ bad = true; return 0; }
+        format = get_u32(base + 4);
+        if(format < 1 || format > WAL_FORMAT) return 0;
+        int64_t legacyTs = format < 2 ? wallClockMs() : 0;
+        size_t off = 8;
+        while(off < len){
+            if(len - off < WAL_RECORD_HEADER){ torn = true; break; }
+            uint32_t n = get_u32(base + off);
+            uint32_t crc = get_u32(base + off + 4);
+            if(n == 0 || n > WAL_MAX_RECORD || len - off - WAL_RECORD_HEADER < n){ torn = true; break; }
+            const char *body = base + off + WAL_RECORD_HEADER;
+            if(crc32c(body, n) != crc){ torn = true; break; }
+
+            WireReader rd(body + 1, n - 1);
+            switch((WalRecord)(unsigned char)body[0]){
+            case WAL_ENTRY:
+            case WAL_TYPED: {
+                int idx = rd.varint();
+                int term = rd.varint();
+                int64_t ts = format < 2 ? legacyTs : (int64_t)rd.varint64();
+                Log e(term, std::string(), ts);
+                bool ok = rd.ok;
+                if(body[0] == WAL_TYPED){
+                    ok = ok && get_entry_body(rd, e);
+                } else {
+                    std::string cmd;
+                    int clen = rd.varint();
+                    ok = rd.ok && rd.bytes(cmd, clen);
+                    if(ok) e = commandEntry(term, std::move(cmd), ts);
+                }
+                if(!ok || idx < 1 || idx > r.base + (int)r.logs.size() + 1){ bad = true; return off; }
+                maxIndex = std::max(maxIndex, idx);
+                if(idx <= r.base) break;        // already covered by the snapshot
+                if(idx <= r.base + (int)r.logs.size()) r.logs.resize(idx - r.base - 1);
+                r.logs.push_back(std::move(e));
+                break;
+            }
+            case WAL_RESET:
+                // the snapshot file this refers to (or a newer one) was made durable first
+                rd.varint();
+                rd.varint();
+                r.logs.clear();
+                break;
+            case WAL_STATE:
+                r.term = rd.varint();
+                r.vote = rd.varint() - 1;
+                break;
+            case WAL_COMMIT:
+                r.commit = std::max(r.commit, rd.varint());
+                break;
+            default:
+                bad = true;
+                return off;
+            }
+            if(!rd.ok){ bad = true; return off; }
+            off += WAL_RECORD_HEADER + n;
+        }
+        return off;
+    }
+
+public:
+    Wal(const std::string &path, WalSync p)
+      : dir(path), policy(p), stateTerm(0), stateVote(-1), stateCommit(0),
+        fd(-1), segSeq(0), segBytes(0), dirty(false), pendingLast(0) {}
+
+    ~Wal(){
+        std::lock_guard<std::mutex> lk(syncMu);
+        if(fd >= 0){
+            if(dirty && policy != WalSync::None) fdatasync(fd);
+            close(fd);
+        }
+    }
+
+    WalSync syncPolicy() const { return policy; }
+
+    // Rebuilds the log and hard state from the newest snapshot plus every segment,
+    // mapping each read-only. A torn tail on the newest segment (a crash mid-write) is
+    // truncated away; damage anywhere else means acknowledged data is gone, so
+    // recovery fails instead.
+    bool recover(WalRecovery &r){
+        r.term = 0;
+        r.vote = -1;
+        r.commit = 0;
+        r.bytes = 0;
+        r.segments = 0;
+        r.snapshot.clear();
+        mkdir(dir.c_str(), 0755);
+
+        if(latestSnapshot(r.base, r.baseTerm)){
+            std::string path = snapPath(r.base, r.baseTerm, "snap");
+            FILE *f = fopen(path.c_str(), "rb");
+            if(!f){
+                perror("ERROR: failed to open snapshot");
+                return false;
+            }
+            char buf[65536];
+            size_t n;
+            while((n = fread(buf, 1, sizeof(buf), f)) > 0) r.snapshot.append(buf, n);
+            fclose(f);
+            r.bytes += r.snapshot.size();
+        }
+
+        std::vector<uint64_t> seqs = listSegments();
+        uint32_t format = WAL_FORMAT;
+        for(size_t i = 0; i < seqs.size(); i++){
+            std::string path = segPath(seqs[i]);
+            int rfd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if(rfd < 0){
+                perror("ERROR: failed to open WAL segment");
+                return false;
+            }
+            struct stat st;
+            fstat(rfd, &st);
+            size_t len = st.st_size;
+            size_t good = 0;
+            int maxIndex = 0;
+            bool torn = false, bad = false;
+            format = WAL_FORMAT;
+            if(len > 0){
+                void *m = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, rfd, 0);
+                if(m == MAP_FAILED){
+                    perror("ERROR: failed to map WAL segment");
+                    close(rfd);
+                    return false;
+                }
+                madvise(m, len, MADV_SEQUENTIAL);
+                good = replaySegment((const char*)m, len, r, maxIndex, torn, bad, format);
+                munmap(m, len);
+            }
+            close(rfd);
+            r.bytes += good;
+            r.segments++;
+            segLast.push_back(std::make_pair(seqs[i], maxIndex));
+
+            // never mistaken for a torn tail: truncating it would delete acknowledged data
+            if(format < 1 || format > WAL_FORMAT){
+                std::cerr << "ERROR: WAL segment " << path << " has unsupported WAL format " << format << std::endl;
+                return false;
+            }
+            if(bad || (torn && i + 1 < seqs.size())){
+                std::cerr << "ERROR: WAL segment " << path << " is corrupt at offset " << good << std::endl;
+                return false;
+            }
+            if(torn){
+                std::cerr << "WAL: truncating torn tail of " << path << " at offset " << good
+                          << " (" << (len - good) << " bytes)" << std::endl;
+                if(truncate(path.c_str(), good) < 0) perror("ERROR: failed to truncate WAL segment");
+            }
+        }
+        r.commit = std::min(std::max(r.commit, r.base), r.base + (int)r.logs.size());
+
+        std::lock_guard<std::mutex> lk(syncMu);
+        {
+            std::lock_guard<std::mutex> bl(bufMu);
+            stateTerm = r.term;
+            stateVote = r.vote;
+            stateCommit = r.commit;
+        }
+        // new records never go into a segment written in an older format
+        if(seqs.empty()) return openSegment(1);
+        return openSegment(format == WAL_FORMAT ? seqs.back() : seqs.back() + 1);
+    }
+
+    // the encoders below only buffer; nothing is durable until sync() returns
+    void appendEntry(int idx, const Log &e){
+        std::string b;
+        b.reserve(e.command.size() + 28);
+        put_varint(b, idx);
+        put_varint(b, e.term);
+        put_varint64(b, e.ts);
+        put_entry_body(b, e);
+        std::lock_guard<std::mutex> lk(bufMu);
+        record(pending, WAL_TYPED, b);
+        pendingLast = std::max(pendingLast, idx);
+    }
+
+    // the log now starts after a snapshot that replaced it entirely
+    void reset(int index, int term){
+        std::string b;
+        put_varint(b, index);
+        put_varint(b, term);
+        std::lock_guard<std::mutex> lk(bufMu);
+        record(pending, WAL_RESET, b);
+    }
+
+    void setState(int term, int vote){
+        std::lock_guard<std::mutex> lk(bufMu);
+        if(term == stateTerm && vote == stateVote) return;
+        stateTerm = term;
+        stateVote = vote;
+        record(pending, WAL_STATE, stateBody(term, vote));
+    }
+
+    void setCommit(int commit){
+        std::lock_guard<std::mutex> lk(bufMu);
+        if(commit <= stateCommit) return;
+        stateCommit = commit;
+        record(pending, WAL_COMMIT, commitBody(commit));
+    }
+
+    // Writes out everything buffered so far and, under the Always policy, fsyncs it.
+    // Callers that arrive while another sync is running find their records already
+    // written by it and return without a second fsync.
+    bool sync(){
+        std::lock_guard<std::mutex> lk(syncMu);
+        if(fd < 0) return false;
+        std::string buf;
+        int last;
+        {
+            std::lock_guard<std::mutex> bl(bufMu);
+            buf.swap(pending);
+            last = pendingLast;
+            pendingLast = 0;
+        }
+        if(!buf.empty()){
+            if(segBytes + buf.size() > WAL_SEGMENT_BYTES && segBytes > 0 && !openSegment(segSeq + 1)) return false;
+            if(!writeAll(buf)) return false;
+            segLast.back().second = std::max(segLast.back().second, last);
+        }
+        if(policy == WalSync::Always && dirty){
+            if(fdatasync(fd) < 0){
+                perror("ERROR: WAL fsync failed");
+                return false;
+            }
+            dirty = false;
+        }
+        return true;
+    }
+
+    // Writes a snapshot durably (temp file, fsync, rename) and then deletes older
+    // snapshots and every closed segment whose entries it fully covers. Segments go
+    // oldest first and stop at the first one still needed, so the remaining ones
+    // always replay as a contiguous log.
+    bool saveSnapshot(const std::string &blob, int index, int term){
+        std::string tmp = snapPath(index, term, "tmp");
+        int sfd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(sfd < 0){
+            perror("ERROR: failed to write snapshot");
+            return false;
+        }
+        size_t off = 0;
+        while(off < blob.size()){
+            ssize_t n = write(sfd, blob.data() + off, blob.size() - off);
+            if(n < 0 && errno == EINTR) continue;
+            if(n <= 0) break;
+            off += n;
+        }
+        bool ok = off == blob.size() && fsync(sfd) == 0;
+        close(sfd);
+        if(!ok || rename(tmp.c_str(), snapPath(index, term, "snap").c_str()) < 0){
+            perror("ERROR: failed to write snapshot");
+            unlink(tmp.c_str());
+            return false;
+        }
+        syncDir();
+
+        DIR *d = opendir(dir.c_str());
+        if(d){
+            while(dirent *e = readdir(d)){
+                int idx, t;
+                if(sscanf(e->d_name, "snap-%d-%d.", &idx, &t) == 2 && idx < index) unlink((dir + "/" + e->d_name).c_str());
+            }
+            closedir(d);
+        }
+
+        std::lock_guard<std::mutex> lk(syncMu);
+        while(segLast.size() > 1 && segLast.front().first != segSeq && segLast.front().second <= index){
+            unlink(segPath(segLast.front().first).c_str());
+            segLast.erase(segLast.begin());
+        }
+        return true;
+    }
+
+    // background flush for the Interval policy
+    void flushInterval(){
+        std::lock_guard<std::mutex> lk(syncMu);
+        if(fd >= 0 && dirty){
+            fdatasync(fd);
+            dirty = false;
+        }
+    }
+};
+
+static inline bool parseWalSync(const std::string &s, WalSync &p){
+    if(s == "always") p = WalSync::Always;
+    else if(s == "interval") p = WalSync::Interval;
+    else if(s == "none") p = WalSync::None;
+    else return false;
+    return true;
+}
+
+#endif